@@ -1,5 +1,5 @@
 ## test
-./main ../images/emma.png
+./lowpoly render --in ../images/emma.png --out ../output
 
 ## generate tar
 tar --exclude='./src/images' --exclude='./.git' --exclude='./.vscode' --exclude='./reports'  -cvzf low-poly-effect-parallel-renderer.tgz .
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <random>
 #include <set>
 #include <unordered_map>
+#include <vector>
 
 #include "CImg.h"
 
@@ -29,13 +30,31 @@ struct Triangle {
 using CImg = cimg_library::CImg<unsigned char>;
 using CImgInt = cimg_library::CImg<int>;
 
-// Functions for Delaunay triangulation
-void pickVertices(CImg &edge);
-void pickVerticesGPU(CImg &edge);
-
-CImgInt jumpFloodAlgorithm(CImg &vertices);
-CImgInt jumpFloodAlgorithmGPU(CImg &vertices);
-
+// Minimum distance between the vertices filling the regions without edges
+const int FILL_SPACING = 100;
+
+// Functions for Delaunay triangulation, the vertices are listed in scan order
+void addBoundaryVertices(std::vector<Point> &vertices, int width, int height,
+                         int spacing = FILL_SPACING);
+void decimateVertices(std::vector<Point> &vertices, const CImg *image,
+                      int width, int height, int maxVertices);
+void budgetVertices(std::vector<Point> &vertices, const CImg *image,
+                    int width, int height, int maxVertices);
+std::vector<Point> pickVertices(const CImg &edge, int maxVertices = 0,
+                                const CImg *image = nullptr);
+std::vector<Point> pickVerticesGPU(const CImg &edge, int maxVertices = 0,
+                                   const CImg *image = nullptr);
+
+std::vector<int> jumpFloodSteps(int width, int height, bool onePlus);
+CImgInt jumpFloodAlgorithm(const std::vector<Point> &vertices, int width,
+                           int height, bool onePlus = false);
+CImgInt jumpFloodAlgorithmGPU(const std::vector<Point> &vertices, int width,
+                              int height, bool onePlus = false);
+CImgInt featureTransformVoronoi(const std::vector<Point> &vertices, int width,
+                                int height);
+
+std::vector<Triangle> extractTriangles(const CImgInt &voronoi);
+void rasterizeTriangles(const std::vector<Triangle> &triangles, CImg &image);
 void delaunayTriangulation(CImgInt &voronoi, CImg &image);
 void delaunayTriangulationGPU(CImgInt &voronoi, CImg &image);
 
@@ -1,92 +1,723 @@
 #include "delaunay.h"
 
+#include <atomic>
+#include <climits>
+#include <iterator>
+
+#include "processing.h"
+#include "trace.h"
+
 // @todo: change to use siteId = x * width + y to store site center information
 
+// Candidates around an active sample, and darts thrown at a tile, before
+// giving up, as in Bridson's sampler
+const int FILL_ATTEMPTS = 30;
+
+// Side of the fill tiles, in cells of the sample grid
+const int FILL_TILE_CELLS = 4;
+
 /**
- * Pick a subset of points in edges for triangulation
- * @param edge The edge obtained from edge draw algorithm
+ * Whether a fill candidate is at least the spacing away from the fixed
+ * points and from the samples around it
+ * @param candidate Candidate point
+ * @param vertices Fixed points in scan order
+ * @param bucketStart Index of the first fixed point of every bucket, the
+ * buckets being squares of side spacing in scan order
+ * @param bucketsX Number of buckets in a row
+ * @param samples Sample of every cell of the grid, x = -1 if none
+ * @param cellsX Number of cells in a row
+ * @param cellSize Side of the cells, small enough to hold one sample each
+ * @param spacing Minimum distance between the points
  */
-void pickVertices(CImg &edge) {
-    cimg_forXY(edge, x, y) {
-        if (edge(x, y) == 254) {
-            edge(x, y) = 255;
-        } else {
-            edge(x, y) = 0;
+static bool farEnough(const Point &candidate,
+                      const std::vector<Point> &vertices,
+                      const std::vector<int> &bucketStart, int bucketsX,
+                      const std::vector<Point> &samples, int cellsX,
+                      int cellSize, int spacing) {
+    auto near = [&](const Point &point) {
+        int dx = point.x - candidate.x, dy = point.y - candidate.y;
+        return dx * dx + dy * dy < spacing * spacing;
+    };
+
+    int bucketsY = static_cast<int>(bucketStart.size() - 1) / bucketsX;
+    int bx = candidate.x / spacing, by = candidate.y / spacing;
+    for (int y = std::max(by - 1, 0); y <= std::min(by + 1, bucketsY - 1);
+         y++) {
+        for (int x = std::max(bx - 1, 0); x <= std::min(bx + 1, bucketsX - 1);
+             x++) {
+            int bucket = y * bucketsX + x;
+            for (int i = bucketStart[bucket]; i < bucketStart[bucket + 1];
+                 i++) {
+                if (near(vertices[i])) return false;
+            }
         }
     }
 
-    edge(0, 0) = 255;
-    edge(0, edge.height() - 1) = 255;
-    edge(edge.width() - 1, 0) = 255;
-    edge(edge.width() - 1, edge.height() - 1) = 255;
-
-    // Optionally, add edge boundary points
-    std::uniform_int_distribution<int> distribution(0, 255);
-    std::default_random_engine generator;
-    for (int x = 0; x < edge.width(); x += distribution(generator)) {
-        for (int y = 0; y < edge.height(); y += distribution(generator)) {
-            edge(x, y) = 255;
+    int cellsY = static_cast<int>(samples.size()) / cellsX;
+    int cx = candidate.x / cellSize, cy = candidate.y / cellSize;
+    for (int y = std::max(cy - 2, 0); y <= std::min(cy + 2, cellsY - 1); y++) {
+        for (int x = std::max(cx - 2, 0); x <= std::min(cx + 2, cellsX - 1);
+             x++) {
+            const Point &sample = samples[y * cellsX + x];
+            if (sample.x >= 0 && near(sample)) return false;
         }
     }
-    for (int x = 0; x < edge.width(); x += distribution(generator)) {
-        edge(x, 0) = 255;
-        edge(x, edge.height() - 1) = 255;
+    return true;
+}
+
+/**
+ * Corners and evenly spaced points of the border of an image, in no order
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param spacing Distance between the points
+ */
+static std::vector<Point> borderVertices(int width, int height, int spacing) {
+    std::vector<Point> border = {Point{0, 0}, Point{0, height - 1},
+                                 Point{width - 1, 0},
+                                 Point{width - 1, height - 1}};
+    for (int x = spacing; x < width - 1; x += spacing) {
+        border.push_back(Point{x, 0});
+        border.push_back(Point{x, height - 1});
     }
-    for (int y = 0; y < edge.height(); y += distribution(generator)) {
-        edge(0, y) = 255;
-        edge(edge.width() - 1, y) = 255;
+    for (int y = spacing; y < height - 1; y += spacing) {
+        border.push_back(Point{0, y});
+        border.push_back(Point{width - 1, y});
     }
+    return border;
 }
 
-int squaredDistance(int x, int y, int xx, int yy) {
-    if (x == -1 || y == -1 || xx == -1 || y == -1) {
-        return -1;
-    } else {
-        int dx = x - xx;
-        int dy = y - yy;
-        return dx * dx + dy * dy;
+/**
+ * Add the corners and evenly spaced points of the border of the image to
+ * the picked vertices, and fill the regions without edges with blue noise,
+ * so that the triangles cover the whole image.
+ *
+ * The fill points come from Bridson's Poisson-disk sampler: every point is
+ * at least the spacing away from the others and from the picked vertices,
+ * and new points are tried around the accepted ones until none fits. The
+ * image is cut into tiles sampled in parallel, in four phases where no two
+ * tiles of a phase touch, so a tile only sees the final samples of its
+ * neighbors. Every tile has its own random seed, which makes the points
+ * independent of the number of threads. The list stays sorted in scan order
+ * without duplicates.
+ * @param vertices Picked vertices in scan order, extended in place
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param spacing Minimum distance between the fill points
+ */
+void addBoundaryVertices(std::vector<Point> &vertices, int width, int height,
+                         int spacing) {
+    TRACE_SCOPE("fillVertices");
+    spacing = std::max(spacing, 1);
+    std::vector<Point> boundary = borderVertices(width, height, spacing);
+
+    // Merge both lists in scan order, dropping repeated points
+    auto before = [](const Point &a, const Point &b) {
+        return a.y != b.y ? a.y < b.y : a.x < b.x;
+    };
+    auto same = [](const Point &a, const Point &b) {
+        return a.x == b.x && a.y == b.y;
+    };
+    auto merge = [&](std::vector<Point> &points) {
+        std::sort(points.begin(), points.end(), before);
+        std::vector<Point> merged;
+        merged.reserve(vertices.size() + points.size());
+        std::merge(vertices.begin(), vertices.end(), points.begin(),
+                   points.end(), std::back_inserter(merged), before);
+        merged.erase(std::unique(merged.begin(), merged.end(), same),
+                     merged.end());
+        vertices.swap(merged);
+    };
+    merge(boundary);
+
+    // Buckets of the fixed points, squares of side spacing in scan order
+    const int bucketsX = (width + spacing - 1) / spacing;
+    const int bucketsY = (height + spacing - 1) / spacing;
+    std::vector<int> bucketStart(bucketsY * bucketsX + 1, 0);
+    for (const Point &vertex : vertices) {
+        bucketStart[(vertex.y / spacing) * bucketsX + vertex.x / spacing + 1]++;
+    }
+    for (int i = 0; i < bucketsY * bucketsX; i++) {
+        bucketStart[i + 1] += bucketStart[i];
+    }
+    std::vector<Point> fixedPoints(vertices.size());
+    std::vector<int> bucketEnd(bucketStart.begin(), bucketStart.end() - 1);
+    for (const Point &vertex : vertices) {
+        int bucket = (vertex.y / spacing) * bucketsX + vertex.x / spacing;
+        fixedPoints[bucketEnd[bucket]++] = vertex;
     }
-}
 
-CImgInt jumpFloodAlgorithm(CImg &vertices) {
-    int width = vertices.width();
-    int height = vertices.height();
+    // Samples closer than the spacing never share a cell
+    const int cellSize = std::max(static_cast<int>(spacing / sqrt(2.0)), 1);
+    const int cellsX = (width + cellSize - 1) / cellSize;
+    const int cellsY = (height + cellSize - 1) / cellSize;
+    std::vector<Point> samples(cellsY * cellsX, Point{-1, -1});
 
-    // Our voronoi diagram which each pixel contains
-    // information about closest site/vertex
-    CImgInt voronoi(width, height, 1, 1, -1);
-    cimg_forXY(vertices, x, y) {
-        if (vertices(x, y) != 0) {
-            voronoi(x, y) = y * width + x;
-        }
-    }
-
-    int maxStep = std::max(vertices.width(), vertices.height()) / 2;
-    while (maxStep > 0) {
-        cimg_forXY(voronoi, x, y) {
-            int minSiteId = -1;
-            int minDist = -1;  // squared distance (x1 - x2)^2 + (y1 - y2)^2
-            for (int dy = -1; dy <= 1; dy++) {
-                for (int dx = -1; dx <= 1; dx++) {
-                    int nx = x + dx * maxStep;
-                    int ny = y + dy * maxStep;
-                    if (nx >= 0 && nx < width && ny >= 0 && ny < height) {
-                        int siteId = voronoi(nx, ny);
-                        if (siteId != -1) {
-                            int dist = squaredDistance(x, y, siteId % width,
-                                                       siteId / width);
-                            if (minDist == -1 || minDist > dist) {
-                                minSiteId = siteId;
-                                minDist = dist;
+    // A tile spans more than the spacing, so the tiles of a phase never
+    // read the cells written by each other
+    const int tileSize = FILL_TILE_CELLS * cellSize;
+    const int tilesX = (width + tileSize - 1) / tileSize;
+    const int tilesY = (height + tileSize - 1) / tileSize;
+    std::vector<std::vector<Point>> tileSamples(tilesY * tilesX);
+    for (int phase = 0; phase < 4; phase++) {
+        int phaseX = phase % 2, phaseY = phase / 2;
+        int phaseTilesX = (tilesX - phaseX + 1) / 2;
+        int phaseTilesY = (tilesY - phaseY + 1) / 2;
+        parallelFor(0, phaseTilesY * phaseTilesX, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                int tx = 2 * (i % phaseTilesX) + phaseX;
+                int ty = 2 * (i / phaseTilesX) + phaseY;
+                int left = tx * tileSize, top = ty * tileSize;
+                int right = std::min(left + tileSize, width);
+                int bottom = std::min(top + tileSize, height);
+
+                std::seed_seq seed{tx, ty};
+                std::mt19937 generator(seed);
+                std::uniform_int_distribution<int> column(left, right - 1);
+                std::uniform_int_distribution<int> row(top, bottom - 1);
+                std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+                std::vector<Point> &accepted = tileSamples[ty * tilesX + tx];
+                auto accept = [&](const Point &candidate) {
+                    if (!farEnough(candidate, fixedPoints, bucketStart,
+                                   bucketsX, samples, cellsX, cellSize,
+                                   spacing)) {
+                        return false;
+                    }
+                    samples[(candidate.y / cellSize) * cellsX +
+                            candidate.x / cellSize] = candidate;
+                    accepted.push_back(candidate);
+                    return true;
+                };
+
+                // Darts start the sampling, which then grows around the
+                // active samples, each trying candidates at one to two
+                // spacings until none fits
+                std::vector<Point> active;
+                for (int dart = 0; dart < FILL_ATTEMPTS; dart++) {
+                    Point candidate{column(generator), row(generator)};
+                    if (accept(candidate)) active.push_back(candidate);
+                    while (!active.empty()) {
+                        int index = std::uniform_int_distribution<int>(
+                            0, static_cast<int>(active.size()) - 1)(generator);
+                        Point center = active[index];
+                        bool found = false;
+                        for (int k = 0; k < FILL_ATTEMPTS && !found; k++) {
+                            double radius = spacing * (1 + unit(generator));
+                            double angle = 2 * M_PI * unit(generator);
+                            Point next{
+                                center.x + int(lround(radius * cos(angle))),
+                                center.y + int(lround(radius * sin(angle)))};
+                            if (next.x < left || next.x >= right ||
+                                next.y < top || next.y >= bottom) {
+                                continue;
                             }
+                            found = accept(next);
+                            if (found) active.push_back(next);
+                        }
+                        if (!found) {
+                            active[index] = active.back();
+                            active.pop_back();
                         }
                     }
                 }
             }
-            voronoi(x, y) = minSiteId;
+        });
+    }
+
+    std::vector<Point> fill;
+    for (const std::vector<Point> &tile : tileSamples) {
+        fill.insert(fill.end(), tile.begin(), tile.end());
+    }
+    TRACE_COUNTER("fillVertexCount", static_cast<long long>(fill.size()));
+    merge(fill);
+}
+
+/**
+ * Squared Sobel gradient of the gray level of an image at a pixel, the
+ * strength of a vertex. Pixels outside of the image replicate the border.
+ * @param image Image, RGB or grayscale
+ * @param x Column of the pixel
+ * @param y Row of the pixel
+ */
+static int vertexStrength(const CImg &image, int x, int y) {
+    int gray[3][3];
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            int px = std::min(std::max(x + dx, 0), image.width() - 1);
+            int py = std::min(std::max(y + dy, 0), image.height() - 1);
+            gray[dy + 1][dx + 1] =
+                image.spectrum() < 3
+                    ? image(px, py)
+                    : (77 * image(px, py, 0) + 150 * image(px, py, 1) +
+                       29 * image(px, py, 2)) >> 8;
+        }
+    }
+    int gradientX = gray[2][0] + 2 * gray[2][1] + gray[2][2] - gray[0][0] -
+                    2 * gray[0][1] - gray[0][2];
+    int gradientY = gray[0][2] + 2 * gray[1][2] + gray[2][2] - gray[0][0] -
+                    2 * gray[1][0] - gray[2][0];
+    return gradientX * gradientX + gradientY * gradientY;
+}
+
+/**
+ * Number of cells of a grid holding at least one vertex, counted by bands of
+ * cells in parallel
+ * @param vertices Vertices in scan order
+ * @param rowStart Index of the first vertex of every row
+ * @param width Width of the image
+ * @param cellSize Side of the cells
+ */
+static int occupiedCells(const std::vector<Point> &vertices,
+                         const std::vector<int> &rowStart, int width,
+                         int cellSize) {
+    int height = static_cast<int>(rowStart.size()) - 1;
+    int numBands = (height + cellSize - 1) / cellSize;
+    int numColumns = (width + cellSize - 1) / cellSize;
+    std::atomic<int> occupied(0);
+    parallelFor(0, numBands, [&](int bandBegin, int bandEnd) {
+        // Band that last saw every column of cells
+        std::vector<int> seen(numColumns, -1);
+        int count = 0;
+        for (int b = bandBegin; b < bandEnd; b++) {
+            int end = rowStart[std::min((b + 1) * cellSize, height)];
+            for (int i = rowStart[b * cellSize]; i < end; i++) {
+                int column = vertices[i].x / cellSize;
+                if (seen[column] != b) {
+                    seen[column] = b;
+                    count++;
+                }
+            }
+        }
+        occupied += count;
+    });
+    return occupied.load();
+}
+
+/**
+ * Bound the number of vertices by grid decimation: the image is cut into
+ * square cells, and only the vertex of strongest gradient of every cell is
+ * kept, the first one in scan order on ties. The cells are the smallest ones
+ * that leave at most maxVertices vertices, found by a binary search on their
+ * side.
+ * @param vertices Vertices in scan order, decimated in place
+ * @param image Image the strength of the vertices is measured on, see
+ * vertexStrength, or nullptr to keep the first vertex of every cell
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param maxVertices Number of vertices to keep at most
+ */
+void decimateVertices(std::vector<Point> &vertices, const CImg *image,
+                      int width, int height, int maxVertices) {
+    TRACE_SCOPE("decimateVertices");
+    int numVertices = static_cast<int>(vertices.size());
+    if (numVertices <= maxVertices) return;
+    if (maxVertices <= 0) {
+        vertices.clear();
+        return;
+    }
+
+    std::vector<int> rowStart(height + 1, 0);
+    for (const Point &vertex : vertices) {
+        rowStart[vertex.y + 1]++;
+    }
+    for (int y = 0; y < height; y++) {
+        rowStart[y + 1] += rowStart[y];
+    }
+
+    // Smallest cells within the budget. A grid of at most maxVertices cells
+    // always is, and the count of occupied cells shrinks with their size
+    // except for small jumps, so the search keeps the upper end feasible.
+    int low = 1, high = 1;
+    while (static_cast<long long>((width + high - 1) / high) *
+               ((height + high - 1) / high) >
+           maxVertices) {
+        high *= 2;
+    }
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (occupiedCells(vertices, rowStart, width, middle) <= maxVertices) {
+            high = middle;
+        } else {
+            low = middle + 1;
         }
-        maxStep /= 2;  // Reduce the step size
     }
+    const int cellSize = high;
+
+    std::vector<int> strength(image ? numVertices : 0);
+    parallelFor(0, static_cast<int>(strength.size()), [&](int begin,
+                                                          int end) {
+        for (int i = begin; i < end; i++) {
+            strength[i] = vertexStrength(*image, vertices[i].x, vertices[i].y);
+        }
+    });
+
+    // Strongest vertex of every cell, by bands of cells in parallel
+    int numBands = (height + cellSize - 1) / cellSize;
+    int numColumns = (width + cellSize - 1) / cellSize;
+    std::vector<std::vector<Point>> bandVertices(numBands);
+    parallelFor(0, numBands, [&](int bandBegin, int bandEnd) {
+        std::vector<int> seen(numColumns, -1), best(numColumns);
+        std::vector<int> kept;
+        for (int b = bandBegin; b < bandEnd; b++) {
+            int end = rowStart[std::min((b + 1) * cellSize, height)];
+            kept.clear();
+            for (int i = rowStart[b * cellSize]; i < end; i++) {
+                int column = vertices[i].x / cellSize;
+                if (seen[column] != b) {
+                    seen[column] = b;
+                    best[column] = i;
+                    kept.push_back(column);
+                } else if (image && strength[i] > strength[best[column]]) {
+                    best[column] = i;
+                }
+            }
+            for (int &column : kept) {
+                column = best[column];
+            }
+            std::sort(kept.begin(), kept.end());
+            for (int i : kept) {
+                bandVertices[b].push_back(vertices[i]);
+            }
+        }
+    });
+
+    vertices.clear();
+    for (const std::vector<Point> &band : bandVertices) {
+        vertices.insert(vertices.end(), band.begin(), band.end());
+    }
+    TRACE_COUNTER("decimationCellSize", cellSize);
+}
+
+/**
+ * Decimate the picked vertices and add the boundary points, see
+ * addBoundaryVertices, keeping at most maxVertices vertices in all. The fill
+ * points depend on the vertices they avoid, so the edge vertices first get
+ * the budget left by the border points, and while the filled list is over
+ * the budget, the edge vertices are decimated again with their share cut by
+ * the excess. The border points and the fill of an image without edges are
+ * always kept, even when they alone are over the budget.
+ * @param vertices Picked vertices in scan order, replaced by the decimated
+ * and filled list
+ * @param image Image the strength of the vertices is measured on, see
+ * decimateVertices
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param maxVertices Number of vertices to keep at most
+ */
+void budgetVertices(std::vector<Point> &vertices, const CImg *image,
+                    int width, int height, int maxVertices) {
+    TRACE_SCOPE("budgetVertices");
+    const std::vector<Point> edgeVertices = std::move(vertices);
+    const int numBorder =
+        static_cast<int>(borderVertices(width, height, FILL_SPACING).size());
+    int budget = maxVertices - numBorder;
+    while (true) {
+        budget = std::max(budget, 0);
+        vertices = edgeVertices;
+        decimateVertices(vertices, image, width, height, budget);
+        int kept = static_cast<int>(vertices.size());
+        addBoundaryVertices(vertices, width, height);
+        int excess = static_cast<int>(vertices.size()) - maxVertices;
+        if (excess <= 0 || kept == 0) break;
+        budget = std::min(budget, kept) - excess;
+    }
+}
+
+/**
+ * Pick a subset of points in edges for triangulation: the edge pixels marked
+ * as vertices (254) by the edge drawing, and the boundary points. Rows count
+ * their vertices in parallel, a prefix sum gives the first slot of every
+ * row, and the rows write their vertices in parallel, so the list comes out
+ * in scan order without any lock.
+ * @param edge The edge obtained from edge draw algorithm
+ * @param maxVertices Number of vertices to keep at most, including the
+ * boundary points, see budgetVertices, 0 for no limit
+ * @param image Image the strength of the vertices is measured on when they
+ * are decimated
+ * @return The vertices in scan order
+ */
+std::vector<Point> pickVertices(const CImg &edge, int maxVertices,
+                                const CImg *image) {
+    TRACE_SCOPE("pickVertices");
+    const int width = edge.width(), height = edge.height();
+
+    std::vector<int> rowStart(height + 1, 0);
+    parallelFor(0, height, [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            const unsigned char *pixels = edge.data(0, y);
+            rowStart[y + 1] = std::count(pixels, pixels + width, 254);
+        }
+    }, 16);
+    for (int y = 0; y < height; ++y) {
+        rowStart[y + 1] += rowStart[y];
+    }
+
+    std::vector<Point> vertices(rowStart[height]);
+    parallelFor(0, height, [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            const unsigned char *pixels = edge.data(0, y);
+            Point *out = vertices.data() + rowStart[y];
+            for (int x = 0; x < width; ++x) {
+                if (pixels[x] == 254) *out++ = Point{x, y};
+            }
+        }
+    }, 16);
+
+    if (maxVertices > 0) {
+        budgetVertices(vertices, image, width, height, maxVertices);
+    } else {
+        addBoundaryVertices(vertices, width, height);
+    }
+    TRACE_COUNTER("vertexCount", static_cast<long long>(vertices.size()));
+    return vertices;
+}
+
+// Coordinates of the site standing for no site during the jump flooding,
+// farther than any pixel from every pixel
+const int JFA_NO_SITE_COORDINATE = 1 << 20;
+
+/**
+ * One jump flooding pass over a row: every pixel takes the closest of the
+ * sites seen at its eight neighbors step pixels away and at itself, the
+ * first one in scan order of the neighbors on ties. The pixels whose
+ * neighbors all lie in the image skip the bounds tests, and the closest site
+ * is kept without branches.
+ * @param source Site of every pixel after the previous pass, as an index in
+ * siteX and siteY
+ * @param target Receives the site of every pixel of the row
+ * @param siteX Column of every site, the last one standing for no site
+ * @param siteY Row of every site
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param y The row
+ * @param step Distance to the neighbors
+ */
+static void jumpFloodRow(const int *source, int *target, const int *siteX,
+                         const int *siteY, int width, int height, int y,
+                         int step) {
+    const int *rows[3];
+    int numRows = 0;
+    for (int dy = -1; dy <= 1; dy++) {
+        int ny = y + dy * step;
+        if (ny >= 0 && ny < height) rows[numRows++] = source + ny * width;
+    }
+
+    auto closest = [&](int x, int dxBegin, int dxEnd) {
+        int minSite = 0;
+        long long minDist = LLONG_MAX;
+        for (int r = 0; r < numRows; r++) {
+            for (int dx = dxBegin; dx <= dxEnd; dx++) {
+                int site = rows[r][x + dx * step];
+                long long distX = siteX[site] - x, distY = siteY[site] - y;
+                long long dist = distX * distX + distY * distY;
+                bool closer = dist < minDist;
+                minSite = closer ? site : minSite;
+                minDist = closer ? dist : minDist;
+            }
+        }
+        return minSite;
+    };
+
+    int interiorBegin = std::min(step, width);
+    int interiorEnd = std::max(width - step, interiorBegin);
+    for (int x = 0; x < interiorBegin; x++) {
+        target[x] = closest(x, 0, x + step < width ? 1 : 0);
+    }
+    for (int x = interiorBegin; x < interiorEnd; x++) {
+        target[x] = closest(x, -1, 1);
+    }
+    for (int x = interiorEnd; x < width; x++) {
+        target[x] = closest(x, x >= step ? -1 : 0, 0);
+    }
+}
+
+/**
+ * Steps of the jump flooding passes: halves of a power of two down to 1, the
+ * first one being at least half of the larger side of the image, so that the
+ * steps add up to reach every pixel from every site.
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param onePlus Whether to start with a pass of step 1, see
+ * jumpFloodAlgorithm
+ */
+std::vector<int> jumpFloodSteps(int width, int height, bool onePlus) {
+    std::vector<int> steps;
+    if (onePlus) steps.push_back(1);
+    int size = 1;
+    while (size < std::max(width, height)) size *= 2;
+    for (int step = size / 2; step > 0; step /= 2) {
+        steps.push_back(step);
+    }
+    return steps;
+}
+
+/**
+ * Compute the Voronoi diagram of the picked vertices with the jump flooding
+ * algorithm. Every pass reads the previous pass from one buffer and writes
+ * the other, so the rows of a pass are processed by bands in parallel. The
+ * passes carry the index of the site in the vertex list, which spares
+ * decoding the site ids at every neighbor.
+ *
+ * Jump flooding can miss the closest site of a few pixels; 1+JFA, a first
+ * pass of step 1 before the halving steps, fixes most of them.
+ * @param vertices The sites, see pickVertices
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param onePlus Whether to run the pass of step 1 first
+ * @return Image containing the site id (y * width + x) closest to each pixel
+ */
+CImgInt jumpFloodAlgorithm(const std::vector<Point> &vertices, int width,
+                           int height, bool onePlus) {
+    TRACE_SCOPE("jumpFlood");
+
+    const int noSite = static_cast<int>(vertices.size());
+    std::vector<int> siteX(noSite + 1, JFA_NO_SITE_COORDINATE);
+    std::vector<int> siteY(noSite + 1, JFA_NO_SITE_COORDINATE);
+    std::vector<int> current(static_cast<size_t>(width) * height);
+    std::vector<int> next(current.size());
+    parallelFor(0, height, [&](int rowBegin, int rowEnd) {
+        std::fill(current.begin() + rowBegin * width,
+                  current.begin() + rowEnd * width, noSite);
+    }, 16);
+    parallelFor(0, noSite, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            siteX[i] = vertices[i].x;
+            siteY[i] = vertices[i].y;
+            current[static_cast<size_t>(vertices[i].y) * width +
+                    vertices[i].x] = i;
+        }
+    });
+
+    std::vector<int> steps = jumpFloodSteps(width, height, onePlus);
+    for (int step : steps) {
+        parallelFor(0, height, [&](int rowBegin, int rowEnd) {
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                jumpFloodRow(current.data(), next.data() + y * width,
+                             siteX.data(), siteY.data(), width, height, y,
+                             step);
+            }
+        }, 16);
+        current.swap(next);
+    }
+
+    // Site ids of the pixels
+    CImgInt voronoi(width, height, 1, 1);
+    parallelFor(0, height, [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            const int *sites = current.data() + y * width;
+            cimg_forX(voronoi, x) {
+                const int site = sites[x];
+                voronoi(x, y) =
+                    site == noSite ? -1 : siteY[site] * width + siteX[site];
+            }
+        }
+    }, 16);
+
+    return voronoi;
+}
+
+/**
+ * Compute the exact Voronoi diagram of the picked vertices with a separable
+ * feature transform, after Meijster et al. A column pass finds the closest
+ * site of every pixel within its column, and a row pass then takes the
+ * closest of these sites over the row, as the lower envelope of the
+ * parabolas (x - column)^2 + (y - site row)^2. The columns are swept by
+ * bands, top down then bottom up, and the rows are processed in parallel,
+ * so the cost is two passes over the image whatever its size. Unlike jump
+ * flooding, every pixel gets a closest site, the one of the smallest column
+ * then of the smallest row on ties.
+ * @param vertices The sites, see pickVertices
+ * @param width Width of the image
+ * @param height Height of the image
+ * @return Image containing the site id (y * width + x) closest to each pixel
+ */
+CImgInt featureTransformVoronoi(const std::vector<Point> &vertices, int width,
+                                int height) {
+    TRACE_SCOPE("featureTransform");
+
+    // Row of the closest site of the column of every pixel, -1 if none
+    CImgInt voronoi(width, height, 1, 1, -1);
+    parallelFor(0, static_cast<int>(vertices.size()), [&](int begin,
+                                                          int end) {
+        for (int i = begin; i < end; i++) {
+            voronoi(vertices[i].x, vertices[i].y) = vertices[i].y;
+        }
+    });
+    parallelFor(0, width, [&](int columnBegin, int columnEnd) {
+        for (int y = 1; y < height; y++) {
+            int *row = voronoi.data(0, y);
+            const int *above = voronoi.data(0, y - 1);
+            for (int x = columnBegin; x < columnEnd; x++) {
+                if (row[x] < 0) row[x] = above[x];
+            }
+        }
+        std::vector<int> below(columnEnd - columnBegin, -1);
+        for (int y = height - 1; y >= 0; y--) {
+            int *row = voronoi.data(0, y);
+            for (int x = columnBegin; x < columnEnd; x++) {
+                int &closestBelow = below[x - columnBegin];
+                if (row[x] == y) {
+                    closestBelow = y;
+                } else if (closestBelow >= 0 &&
+                           (row[x] < 0 || closestBelow - y < y - row[x])) {
+                    row[x] = closestBelow;
+                }
+            }
+        }
+    }, 64);
+
+    parallelFor(0, height, [&](int rowBegin, int rowEnd) {
+        // Columns of the parabolas of the lower envelope, and the first
+        // pixel of every parabola
+        std::vector<int> column(width), start(width), siteRow(width);
+        std::vector<long long> siteDist(width);
+        for (int y = rowBegin; y < rowEnd; y++) {
+            int *row = voronoi.data(0, y);
+            std::copy(row, row + width, siteRow.begin());
+            auto dist = [&](int x, int c) {
+                return static_cast<long long>(x - c) * (x - c) + siteDist[c];
+            };
+
+            int q = -1;
+            for (int u = 0; u < width; u++) {
+                if (siteRow[u] < 0) continue;
+                siteDist[u] =
+                    static_cast<long long>(y - siteRow[u]) * (y - siteRow[u]);
+                while (q >= 0 &&
+                       dist(start[q], column[q]) > dist(start[q], u)) {
+                    q--;
+                }
+                if (q < 0) {
+                    q = 0;
+                    column[0] = u;
+                    start[0] = 0;
+                    continue;
+                }
+                // First pixel closer to u than to the last parabola
+                long long c = column[q];
+                long long numerator =
+                    u * static_cast<long long>(u) - c * c + siteDist[u] -
+                    siteDist[c];
+                long long denominator = 2 * (u - c);
+                long long separation =
+                    numerator >= 0 ? numerator / denominator
+                                   : -((-numerator + denominator - 1) /
+                                       denominator);
+                if (separation + 1 < width) {
+                    q++;
+                    column[q] = u;
+                    start[q] = static_cast<int>(separation + 1);
+                }
+            }
+            if (q < 0) continue;  // no site at all
+
+            for (int x = width - 1; x >= 0; x--) {
+                int c = column[q];
+                row[x] = siteRow[c] * width + c;
+                if (x == start[q]) q--;
+            }
+        }
+    }, 16);
 
     return voronoi;
 }
@@ -151,61 +782,138 @@ Point centerPixelOfTriangle(int ax, int ay, int bx, int by, int cx, int cy) {
     }
 }
 
-void delaunayTriangulation(CImgInt &voronoi, CImg &image) {
+/**
+ * Build triangles from the Voronoi diagram, one or two for every 2x2 block of
+ * pixels touching three or four sites. Triangles are collected per row chunk
+ * in parallel and concatenated in scan order.
+ * @param voronoi Voronoi diagram from the jump flooding algorithm
+ * @return Triangles as triplets of site ids
+ */
+std::vector<Triangle> extractTriangles(const CImgInt &voronoi) {
+    TRACE_SCOPE("triangles");
+
     int width = voronoi.width();
     int height = voronoi.height();
-    std::vector<Triangle> triangles;
 
-    cimg_forXY(voronoi, x, y) {
-        if (x < width - 1 && y < height - 1) {
-            int topLeft = voronoi(x, y);
-            int topRight = voronoi(x + 1, y);
-            int botLeft = voronoi(x, y + 1);
-            int botRight = voronoi(x + 1, y + 1);
-
-            std::set<int> uniqueSites;
-            uniqueSites.insert(topLeft);
-            uniqueSites.insert(topRight);
-            uniqueSites.insert(botLeft);
-            uniqueSites.insert(botRight);
-            std::vector<int> sitesVector(uniqueSites.begin(),
-                                         uniqueSites.end());
-
-            if (sitesVector.size() == 4) {
-                triangles.push_back(Triangle{topLeft, topRight, botLeft});
-                triangles.push_back(Triangle{topRight, botLeft, botRight});
-            } else if (sitesVector.size() == 3) {
-                triangles.push_back(
-                    Triangle{sitesVector[0], sitesVector[1], sitesVector[2]});
-            }
-        }
-    }
-
-    for (int i = 0; i < triangles.size(); i++) {
-        int s1 = triangles[i].s1;
-        int s2 = triangles[i].s2;
-        int s3 = triangles[i].s3;
-
-        int ax = s1 % width, ay = s1 / width;
-        int bx = s2 % width, by = s2 / width;
-        int cx = s3 % width, cy = s3 / width;
-
-        Point centerPixel = centerPixelOfTriangle(ax, ay, bx, by, cx, cy);
-        int R = image(centerPixel.x, centerPixel.y, 0);
-        int G = image(centerPixel.x, centerPixel.y, 1);
-        int B = image(centerPixel.x, centerPixel.y, 2);
-
-        // Scan over image dimensions
-        for (int x = std::min(std::min(ax, bx), cx);
-             x < std::max(std::max(ax, bx), cx); x++) {
-            for (int y = std::min(std::min(ay, by), cy);
-                 y < std::max(std::max(ay, by), cy); y++) {
-                if (pointInTriangle(x, y, ax, ay, bx, by, cx, cy)) {
-                    image(x, y, 0) = R;
-                    image(x, y, 1) = G;
-                    image(x, y, 2) = B;
+    // Collect triangles of each chunk of rows separately
+    int numChunks = std::max(1, std::min(height - 1, getNumThreads() * 4));
+    int rowsPerChunk = (height - 1 + numChunks - 1) / numChunks;
+    std::vector<std::vector<Triangle>> chunkTriangles(numChunks);
+    parallelFor(0, numChunks, [&](int chunkBegin, int chunkEnd) {
+        for (int chunk = chunkBegin; chunk < chunkEnd; ++chunk) {
+            std::vector<Triangle> &local = chunkTriangles[chunk];
+            int rowEnd = std::min(height - 1, (chunk + 1) * rowsPerChunk);
+            for (int y = chunk * rowsPerChunk; y < rowEnd; ++y) {
+                for (int x = 0; x < width - 1; ++x) {
+                    int topLeft = voronoi(x, y);
+                    int topRight = voronoi(x + 1, y);
+                    int botLeft = voronoi(x, y + 1);
+                    int botRight = voronoi(x + 1, y + 1);
+
+                    std::set<int> uniqueSites;
+                    uniqueSites.insert(topLeft);
+                    uniqueSites.insert(topRight);
+                    uniqueSites.insert(botLeft);
+                    uniqueSites.insert(botRight);
+                    std::vector<int> sitesVector(uniqueSites.begin(),
+                                                 uniqueSites.end());
+
+                    if (sitesVector.size() == 4) {
+                        local.push_back(Triangle{topLeft, topRight, botLeft});
+                        local.push_back(
+                            Triangle{topRight, botLeft, botRight});
+                    } else if (sitesVector.size() == 3) {
+                        local.push_back(Triangle{
+                            sitesVector[0], sitesVector[1], sitesVector[2]});
+                    }
                 }
             }
         }
+    });
+
+    std::vector<Triangle> triangles;
+    for (std::vector<Triangle> &local : chunkTriangles) {
+        triangles.insert(triangles.end(), local.begin(), local.end());
     }
-}
\ No newline at end of file
+    TRACE_COUNTER("triangleCount", static_cast<long long>(triangles.size()));
+    return triangles;
+}
+
+/**
+ * Fill triangles with the color of the image at their center. Colors are
+ * sampled before painting, then the image is painted by horizontal bands so
+ * that every pixel is written by a single thread in triangle order.
+ * @param triangles Triangles as triplets of site ids
+ * @param image Image to sample colors from and paint the triangles on
+ */
+void rasterizeTriangles(const std::vector<Triangle> &triangles, CImg &image) {
+    TRACE_SCOPE("raster");
+
+    int width = image.width();
+    int height = image.height();
+
+    // Sample colors before painting so that no triangle reads a pixel that
+    // another triangle has already painted
+    std::vector<Color> colors(triangles.size());
+    parallelFor(0, static_cast<int>(triangles.size()), [&](int begin,
+                                                           int end) {
+        for (int i = begin; i < end; i++) {
+            int s1 = triangles[i].s1;
+            int s2 = triangles[i].s2;
+            int s3 = triangles[i].s3;
+
+            int ax = s1 % width, ay = s1 / width;
+            int bx = s2 % width, by = s2 / width;
+            int cx = s3 % width, cy = s3 / width;
+
+            Point centerPixel = centerPixelOfTriangle(ax, ay, bx, by, cx, cy);
+            colors[i] = Color{image(centerPixel.x, centerPixel.y, 0),
+                              image(centerPixel.x, centerPixel.y, 1),
+                              image(centerPixel.x, centerPixel.y, 2)};
+        }
+    });
+
+    // Paint triangles, each band of rows owned by one thread
+    std::atomic<long long> paintedPixels(0);
+    parallelFor(0, height, [&](int bandBegin, int bandEnd) {
+        long long painted = 0;
+        for (int i = 0; i < triangles.size(); i++) {
+            int s1 = triangles[i].s1;
+            int s2 = triangles[i].s2;
+            int s3 = triangles[i].s3;
+
+            int ax = s1 % width, ay = s1 / width;
+            int bx = s2 % width, by = s2 / width;
+            int cx = s3 % width, cy = s3 / width;
+
+            int minY = std::max(std::min(std::min(ay, by), cy), bandBegin);
+            int maxY = std::min(std::max(std::max(ay, by), cy), bandEnd);
+            if (minY >= maxY) continue;
+
+            // Scan over image dimensions
+            for (int x = std::min(std::min(ax, bx), cx);
+                 x < std::max(std::max(ax, bx), cx); x++) {
+                for (int y = minY; y < maxY; y++) {
+                    if (pointInTriangle(x, y, ax, ay, bx, by, cx, cy)) {
+                        image(x, y, 0) = colors[i].R;
+                        image(x, y, 1) = colors[i].G;
+                        image(x, y, 2) = colors[i].B;
+                        painted++;
+                    }
+                }
+            }
+        }
+        paintedPixels += painted;
+    }, 16);
+    TRACE_COUNTER("rasterizedPixels", paintedPixels.load());
+}
+
+/**
+ * Build triangles from the Voronoi diagram and paint them on the image
+ * @param voronoi Voronoi diagram from the jump flooding algorithm
+ * @param image Image to sample colors from and paint the triangles on
+ */
+void delaunayTriangulation(CImgInt &voronoi, CImg &image) {
+    std::vector<Triangle> triangles = extractTriangles(voronoi);
+    rasterizeTriangles(triangles, image);
+}
@@ -2,6 +2,7 @@
 #include <curand_kernel.h>
 
 #include "delaunay.h"
+#include "trace.h"
 
 #define gpuErrchk(ans) \
     { gpuAssert((ans), __FILE__, __LINE__); }
@@ -14,73 +15,106 @@ inline void gpuAssert(cudaError_t code, const char *file, int line,
     }
 }
 
-__global__ void pickVerticesKernel(unsigned char *edge, int width, int height) {
-    int x = blockIdx.x * blockDim.x + threadIdx.x;
-    int y = blockIdx.y * blockDim.y + threadIdx.y;
+// Number of vertices (254) of every row, one thread per row
+__global__ void countVerticesKernel(const unsigned char *edge, int *rowCount,
+                                    int width, int height) {
+    int y = blockIdx.x * blockDim.x + threadIdx.x;
 
-    if (x < width && y < height) {
-        int idx = y * width + x;
-        if (edge[idx] == 254) {
-            edge[idx] = 255;
-        } else {
-            edge[idx] = 0;
+    if (y < height) {
+        int count = 0;
+        for (int x = 0; x < width; x++) {
+            count += edge[y * width + x] == 254;
         }
+        rowCount[y] = count;
     }
 }
 
-void pickVerticesGPU(CImg &edge) {
+// Write the vertices of every row from its first slot, one thread per row
+__global__ void scatterVerticesKernel(const unsigned char *edge,
+                                      const int *rowStart, Point *vertices,
+                                      int width, int height) {
+    int y = blockIdx.x * blockDim.x + threadIdx.x;
+
+    if (y < height) {
+        int slot = rowStart[y];
+        for (int x = 0; x < width; x++) {
+            if (edge[y * width + x] == 254) {
+                vertices[slot++] = Point{x, y};
+            }
+        }
+    }
+}
+
+/**
+ * Pick the vertices on the GPU, see pickVertices. The rows are counted and
+ * then written in parallel, the prefix sum of the row counts in between runs
+ * on the host.
+ * @param edge The edge obtained from edge draw algorithm
+ * @param maxVertices Number of vertices to keep at most, 0 for no limit
+ * @param image Image the strength of the vertices is measured on when they
+ * are decimated
+ * @return The vertices in scan order
+ */
+std::vector<Point> pickVerticesGPU(const CImg &edge, int maxVertices,
+                                   const CImg *image) {
+    TRACE_SCOPE("pickVerticesGPU");
+
     int width = edge.width();
     int height = edge.height();
 
     unsigned char *d_edge;
+    int *d_rowStart;
     size_t size = width * height * sizeof(unsigned char);
 
     cudaMalloc(&d_edge, size);
+    cudaMalloc(&d_rowStart, height * sizeof(int));
     cudaMemcpy(d_edge, edge.data(), size, cudaMemcpyHostToDevice);
 
-    dim3 dimBlock(16, 16);
-    dim3 dimGrid((width + dimBlock.x - 1) / dimBlock.x,
-                 (height + dimBlock.y - 1) / dimBlock.y);
-
-    pickVerticesKernel<<<dimGrid, dimBlock>>>(d_edge, width, height);
+    dim3 dimBlock(256);
+    dim3 dimGrid((height + dimBlock.x - 1) / dimBlock.x);
 
-    cudaMemcpy(edge.data(), d_edge, size, cudaMemcpyDeviceToHost);
+    // Count, then turn the counts into the first slot of every row
+    std::vector<int> rowStart(height + 1, 0);
+    countVerticesKernel<<<dimGrid, dimBlock>>>(d_edge, d_rowStart, width,
+                                               height);
+    cudaMemcpy(rowStart.data() + 1, d_rowStart, height * sizeof(int),
+               cudaMemcpyDeviceToHost);
+    for (int y = 0; y < height; y++) {
+        rowStart[y + 1] += rowStart[y];
+    }
+    cudaMemcpy(d_rowStart, rowStart.data(), height * sizeof(int),
+               cudaMemcpyHostToDevice);
+
+    std::vector<Point> vertices(rowStart[height]);
+    Point *d_vertices;
+    cudaMalloc(&d_vertices, std::max<size_t>(vertices.size(), 1) *
+                                sizeof(Point));
+    scatterVerticesKernel<<<dimGrid, dimBlock>>>(d_edge, d_rowStart,
+                                                 d_vertices, width, height);
+    cudaMemcpy(vertices.data(), d_vertices, vertices.size() * sizeof(Point),
+               cudaMemcpyDeviceToHost);
     cudaFree(d_edge);
+    cudaFree(d_rowStart);
+    cudaFree(d_vertices);
 
-    // Set the corners to 255
-    edge(0, 0) = 255;
-    edge(0, height - 1) = 255;
-    edge(width - 1, 0) = 255;
-    edge(width - 1, height - 1) = 255;
-
-    // Optionally, add edge boundary points
-    std::uniform_int_distribution<int> distribution(0, 255);
-    std::default_random_engine generator;
-    for (int x = 0; x < width; x += distribution(generator)) {
-        for (int y = 0; y < height; y += distribution(generator)) {
-            edge(x, y) = 255;
-        }
-    }
-    for (int x = 0; x < width; x += distribution(generator)) {
-        edge(x, 0) = 255;
-        edge(x, height - 1) = 255;
-    }
-    for (int y = 0; y < height; y += distribution(generator)) {
-        edge(0, y) = 255;
-        edge(width - 1, y) = 255;
+    // The decimation runs on the host, on the compact list
+    if (maxVertices > 0) {
+        budgetVertices(vertices, image, width, height, maxVertices);
+    } else {
+        addBoundaryVertices(vertices, width, height);
     }
+    TRACE_COUNTER("vertexCount", static_cast<long long>(vertices.size()));
+    return vertices;
 }
 
-__global__ void setupJumpFloodKernel(unsigned char *d_vertices, int *d_voronoi,
-                                     int width, int height) {
-    int x = blockIdx.x * blockDim.x + threadIdx.x;
-    int y = blockIdx.y * blockDim.y + threadIdx.y;
+__global__ void setupJumpFloodKernel(const Point *d_vertices,
+                                     int numVertices, int *d_voronoi,
+                                     int width) {
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
 
-    if (x < width && y < height) {
-        int idx = y * width + x;
-        if (d_vertices[idx] != 0) {
-            d_voronoi[idx] = idx;
-        }
+    if (i < numVertices) {
+        int idx = d_vertices[i].y * width + d_vertices[i].x;
+        d_voronoi[idx] = idx;
     }
 }
 
@@ -94,8 +128,8 @@ __device__ int squaredDistanceCUDA(int x, int y, int xx, int yy) {
     }
 }
 
-__global__ void jumpFloodAlgorithmKernel(int *d_voronoi, int width, int height,
-                                         int step) {
+__global__ void jumpFloodAlgorithmKernel(const int *d_voronoi, int *d_next,
+                                         int width, int height, int step) {
     int x = blockIdx.x * blockDim.x + threadIdx.x;
     int y = blockIdx.y * blockDim.y + threadIdx.y;
 
@@ -120,41 +154,50 @@ __global__ void jumpFloodAlgorithmKernel(int *d_voronoi, int width, int height,
                 }
             }
         }
-        d_voronoi[idx] = minSiteId;
+        d_next[idx] = minSiteId;
     }
 }
 
-CImgInt jumpFloodAlgorithmGPU(CImg &vertices) {
-    int width = vertices.width();
-    int height = vertices.height();
+CImgInt jumpFloodAlgorithmGPU(const std::vector<Point> &vertices, int width,
+                              int height, bool onePlus) {
+    TRACE_SCOPE("jumpFloodGPU");
 
-    unsigned char *d_vertices;
-    int *d_voronoi;
-    cudaMalloc(&d_vertices, width * height * sizeof(unsigned char));
+    int numVertices = static_cast<int>(vertices.size());
+    Point *d_vertices;
+    int *d_voronoi, *d_next;
+    cudaMalloc(&d_vertices, std::max(numVertices, 1) * sizeof(Point));
     cudaMalloc(&d_voronoi, width * height * sizeof(int));
-    cudaMemcpy(d_vertices, vertices.data(),
-               width * height * sizeof(unsigned char), cudaMemcpyHostToDevice);
+    cudaMalloc(&d_next, width * height * sizeof(int));
+    cudaMemcpy(d_vertices, vertices.data(), numVertices * sizeof(Point),
+               cudaMemcpyHostToDevice);
     cudaMemset(d_voronoi, -1, width * height * sizeof(int));
 
     dim3 dimBlock(16, 16);
     dim3 dimGrid((width + dimBlock.x - 1) / dimBlock.x,
                  (height + dimBlock.y - 1) / dimBlock.y);
 
-    setupJumpFloodKernel<<<dimGrid, dimBlock>>>(d_vertices, d_voronoi, width,
-                                                height);
+    // Seed the sites from the vertex list
+    dim3 seedBlock(256);
+    dim3 seedGrid((numVertices + seedBlock.x - 1) / seedBlock.x);
+    if (numVertices > 0) {
+        setupJumpFloodKernel<<<seedGrid, seedBlock>>>(d_vertices, numVertices,
+                                                      d_voronoi, width);
+    }
     cudaFree(d_vertices);
 
-    int maxStep = std::max(width, height) / 2;
-    while (maxStep > 0) {
-        jumpFloodAlgorithmKernel<<<dimGrid, dimBlock>>>(d_voronoi, width,
-                                                        height, maxStep);
-        maxStep /= 2;
+    // Every pass reads one buffer and writes the other
+    std::vector<int> steps = jumpFloodSteps(width, height, onePlus);
+    for (int step : steps) {
+        jumpFloodAlgorithmKernel<<<dimGrid, dimBlock>>>(d_voronoi, d_next,
+                                                        width, height, step);
+        std::swap(d_voronoi, d_next);
     }
 
     CImgInt voronoi(width, height, 1, 1, -1);
     cudaMemcpy(voronoi.data(), d_voronoi, width * height * sizeof(int),
                cudaMemcpyDeviceToHost);
     cudaFree(d_voronoi);
+    cudaFree(d_next);
 
     return voronoi;
 }
@@ -281,6 +324,8 @@ __global__ void transformTrianglesKernel(unsigned char *d_image,
 }
 
 void delaunayTriangulationGPU(CImgInt &voronoi, CImg &image) {
+    TRACE_SCOPE("triangulationGPU");
+
     int width = voronoi.width();
     int height = voronoi.height();
 
@@ -314,7 +359,7 @@ void delaunayTriangulationGPU(CImgInt &voronoi, CImg &image) {
     int host_triangles_count;
     cudaMemcpy(&host_triangles_count, triangles_count, sizeof(int),
                cudaMemcpyDeviceToHost);
-    std::cout << "\tTriangles count: " << host_triangles_count << std::endl;
+    TRACE_COUNTER("triangleCount", host_triangles_count);
 
     // Step 2: Transform triangles to image
     dim3 dimBlock2(16);
@@ -1,17 +1,30 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #include "CImg.h"
 #include "edgedraw.h"
+#include "gaussianblur.h"
+#include "processing.h"
+#include "trace.h"
 
 /**
  * Extract edges from the image using Canny edge detection method.
  *
  * @param image Image to extract edge, with RGB color and single depth.
  * @param method Method to use for edge detection, 0 for grayscale, 1 for RGB.
+ * @param thresholds How the hysteresis thresholds are found, see trackEdge.
+ * @param tileSize Side of the tiles with their own thresholds, 0 for one
+ * pair of thresholds over the whole image.
  * @pre Noise should have been removed on the image in previous steps.
  */
-CImg extractEdgeCanny(CImg &image, int method) {
+CImg extractEdgeCanny(CImg &image, int method, int thresholds, int tileSize) {
+    TRACE_SCOPE("canny");
+
     // Create a new image to store the edge
     CImg gradient(image.width(), image.height());
-    CImgFloat direction(image.width(), image.height());
+    CImg direction(image.width(), image.height());
 
     // Calculate gradient magnitude for each pixel
     if (method == 0) {
@@ -20,82 +33,245 @@ CImg extractEdgeCanny(CImg &image, int method) {
         gradientInColor(image, gradient, direction);
     }
 
-    // Non-maximum Suppression
-    CImg edge(image.width(), image.height());
+    // Non-maximum Suppression, which leaves the image border unset
+    CImg edge(image.width(), image.height(), 1, 1, 0);
     nonMaxSuppression(edge, gradient, direction);
 
     // Track edges
-    trackEdge(edge);
+    trackEdge(edge, thresholds, tileSize);
 
     return edge;
 }
 
 /**
- * Convert colored image to grayscale and calculate gradient
+ * Convert a row of a colored image to grayscale
+ * @param red Red channel of the row.
+ * @param green Green channel of the row.
+ * @param blue Blue channel of the row.
+ * @param gray Receives the luminance.
+ * @param width Width of the row.
  */
-void gradientInGray(CImg &image, CImg &gradient, CImgFloat &direction) {
-    // auto start = std::chrono::high_resolution_clock::now();
+void convertRowToGray(const unsigned char *red, const unsigned char *green,
+                      const unsigned char *blue, unsigned char *gray,
+                      int width) {
+    for (int x = 0; x < width; ++x) {
+        gray[x] = 0.299 * red[x] + 0.587 * green[x] + 0.114 * blue[x];
+    }
+}
 
-    // Convert the image to grayscale
+/**
+ * Bring a loaded image to the three RGB channels of the pipeline: gray and
+ * gray with alpha images replicate their gray level, and alpha is dropped.
+ * @param image Image of any number of channels, converted in place.
+ */
+void toRgb(CImg &image) {
+    if (image.spectrum() < 3) {
+        image.channels(0, 0);
+        image.resize(-100, -100, -100, 3);
+    } else if (image.spectrum() > 3) {
+        image.channels(0, 2);
+    }
+}
+
+/**
+ * Convert a colored image to grayscale
+ * @param image Image with RGB color.
+ * @return Single channel luminance image.
+ */
+CImg convertToGray(const CImg &image) {
+    TRACE_SCOPE("gray");
     CImg grayImage(image.width(), image.height());
 
-    cimg_forXY(image, x, y) {
-        // Calculate the grayscale value of the pixel
-        unsigned char grayValue = 0.299 * image(x, y, 0) +
-                                  0.587 * image(x, y, 1) +
-                                  0.114 * image(x, y, 2);
+    parallelFor(0, image.height(), [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            convertRowToGray(image.data(0, y, 0, 0), image.data(0, y, 0, 1),
+                             image.data(0, y, 0, 2), grayImage.data(0, y),
+                             image.width());
+        }
+    });
+    return grayImage;
+}
+
+/**
+ * Convert colored image to grayscale and calculate gradient. A single
+ * channel image is taken as already converted. The image border is left
+ * untouched.
+ * @param image Image, RGB or grayscale.
+ * @param gradient Gradient magnitude, saturated to 255.
+ * @param direction Gradient direction bins.
+ * @param op GRADIENT_SOBEL or GRADIENT_SCHARR.
+ * @param magnitude MAGNITUDE_EXACT, MAGNITUDE_L1 or
+ * MAGNITUDE_ALPHA_MAX_BETA_MIN.
+ */
+void gradientInGray(CImg &image, CImg &gradient, CImg &direction, int op,
+                    int magnitude) {
+    TRACE_SCOPE("gradient");
 
-        // Set the grayscale value in the gray image
-        grayImage(x, y) = grayValue;
+    // Convert the image to grayscale
+    CImg convertedImage;
+    if (image.spectrum() != 1) {
+        convertedImage = convertToGray(image);
     }
+    CImg &grayImage = image.spectrum() == 1 ? image : convertedImage;
+    const int simdLevel = detectSimdLevel();
 
-    // auto end = std::chrono::high_resolution_clock::now();
-    // auto duration =
-    //     std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-    // std::cout << "Time Grayscale CPU: " << duration.count() << "
-    // microseconds"
-    //           << std::endl;
+    // Calculate the gradient in the grayscale image, one row at a time
+    parallelFor(
+        1, grayImage.height() - 1,
+        [&](int rowBegin, int rowEnd) {
+            GradientRow kernel(grayImage.width(), op, magnitude, simdLevel);
+            const unsigned char *rows[3];
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                for (int k = 0; k < 3; k++) {
+                    rows[k] = grayImage.data(0, y - 1 + k);
+                }
+                kernel.compute(rows, gradient.data(0, y),
+                               direction.data(0, y));
+            }
+        },
+        16);
+}
 
-    // Calculate the gradient in the grayscale image
-    // start = std::chrono::high_resolution_clock::now();
-    cimg_forXY(grayImage, x, y) {
-        // If the pixel is not at the edge of the image
-        if (x > 0 && x < grayImage.width() - 1 && y > 0 &&
-            y < grayImage.height() - 1) {
-            gradientResp gr = calculateGradient(grayImage, x, y);
-            gradient(x, y) = gr.mag;
-            direction(x, y) = gr.dir;
-        }
+/**
+ * Fused Gaussian blur, grayscale conversion and gradient. Rows stream through
+ * a rolling window of 2 * BLUR_RADIUS + 3 rows: the 2 * BLUR_RADIUS + 1
+ * horizontally blurred rows of every channel that make one blurred row, and
+ * the 3 gray rows of the derivative operator. No blurred or gray image is ever
+ * stored, and the gradient is the same as the fixed point blur followed by
+ * gradientInGray.
+ * @param image Unblurred image, RGB or grayscale.
+ * @param gradient Gradient magnitude, zero on the image border.
+ * @param direction Gradient direction bins, zero on the image border.
+ * @param sigma Standard deviation of the Gaussian blur.
+ * @param op GRADIENT_SOBEL or GRADIENT_SCHARR.
+ * @param magnitude Magnitude formula, see gradientInGray.
+ */
+void blurredGradientInGray(const CImg &image, CImg &gradient, CImg &direction,
+                           double sigma, int op, int magnitude) {
+    TRACE_SCOPE("blurGradient");
+    const int width = image.width(), height = image.height();
+    const int channels = image.spectrum();
+    const int window = 2 * BLUR_RADIUS + 1;
+    const int simdLevel = detectSimdLevel();
+
+    cimg_forX(gradient, x) {
+        gradient(x, 0) = gradient(x, height - 1) = 0;
+        direction(x, 0) = direction(x, height - 1) = 0;
+    }
+    cimg_forY(gradient, y) {
+        gradient(0, y) = gradient(width - 1, y) = 0;
+        direction(0, y) = direction(width - 1, y) = 0;
     }
 
-    // end = std::chrono::high_resolution_clock::now();
-    // duration =
-    //     std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-    // std::cout << "Time Gradient CPU: " << duration.count() << " microseconds"
-    //           << std::endl;
+    parallelFor(
+        1, height - 1,
+        [&](int rowBegin, int rowEnd) {
+            FixedPointRowBlur blur(width, sigma, simdLevel);
+            GradientRow kernel(width, op, magnitude, simdLevel);
+            std::vector<int16_t> horizontal(size_t(window) * channels * width);
+            std::vector<unsigned char> blurred(size_t(channels) * width);
+            std::vector<unsigned char> gray(3 * size_t(width));
+            const int16_t *rows[BLUR_WIDTH];
+
+            // Horizontal pass of row v of channel c, rows outside of the
+            // image replicate the border rows
+            auto horizontalRow = [&](int v, int c) {
+                int slot = (v % window + window) % window;
+                return horizontal.data() +
+                       (size_t(slot) * channels + c) * width;
+            };
+
+            int nextRow = rowBegin - 1 - BLUR_RADIUS;
+            for (int g = rowBegin - 1; g <= rowEnd; g++) {
+                // Blurred row g, once its lowest horizontal row is ready
+                for (; nextRow <= g + BLUR_RADIUS; nextRow++) {
+                    int source = std::min(std::max(nextRow, 0), height - 1);
+                    for (int c = 0; c < channels; c++) {
+                        blur.horizontal(image.data(0, source, 0, c),
+                                        horizontalRow(nextRow, c));
+                    }
+                }
+                for (int c = 0; c < channels; c++) {
+                    for (int k = 0; k < BLUR_WIDTH; k++) {
+                        rows[k] = horizontalRow(g - BLUR_RADIUS + k, c);
+                    }
+                    blur.vertical(rows, blurred.data() + c * width);
+                }
+
+                // Gray row g
+                unsigned char *grayRow = gray.data() + (g % 3) * width;
+                if (channels == 1) {
+                    std::copy(blurred.begin(), blurred.end(), grayRow);
+                } else {
+                    const unsigned char *r = blurred.data();
+                    convertRowToGray(r, r + width, r + 2 * width, grayRow,
+                                     width);
+                }
+
+                // Gradient of row g - 1, now that its lower neighbor is ready
+                int y = g - 1;
+                if (y < rowBegin) continue;
+                const unsigned char *grayRows[3] = {
+                    gray.data() + ((y - 1) % 3) * width,
+                    gray.data() + (y % 3) * width,
+                    gray.data() + (g % 3) * width};
+                kernel.compute(grayRows, gradient.data(0, y),
+                               direction.data(0, y));
+            }
+        },
+        16);
 }
 
 /**
- * Calculate gradient separately in RGB dimension and combine
+ * Calculate the Di Zenzo gradient of a colored image. The derivatives of the
+ * three channels form a structure tensor per pixel, whose largest eigenvalue
+ * gives the magnitude and whose eigenvector gives the direction, so an edge
+ * between two colors of the same gray level is still found. A single channel
+ * image falls back to gradientInGray. The image border is left untouched.
+ * @param image Image, RGB or grayscale. Channels after the third are ignored.
+ * @param gradient Gradient magnitude, saturated to 255, close to the gray
+ * gradient on a gray image.
+ * @param direction Gradient direction bins.
+ * @param op GRADIENT_SOBEL or GRADIENT_SCHARR.
  */
-void gradientInColor(CImg &image, CImg &gradient, CImgFloat &direction) {
-    // TODO: Implement this function
-    std::cout << "Error: Function not implemented" << std::endl;
+void gradientInColor(CImg &image, CImg &gradient, CImg &direction, int op) {
+    if (image.spectrum() < 3) {
+        gradientInGray(image, gradient, direction, op);
+        return;
+    }
+    TRACE_SCOPE("gradient");
+    const int simdLevel = detectSimdLevel();
+
+    // Calculate the tensor of all channels in one pass, one row at a time
+    parallelFor(
+        1, image.height() - 1,
+        [&](int rowBegin, int rowEnd) {
+            ColorGradientRow kernel(image.width(), op, simdLevel);
+            const unsigned char *rows[9];
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                for (int c = 0; c < 3; c++) {
+                    for (int k = 0; k < 3; k++) {
+                        rows[3 * c + k] = image.data(0, y - 1 + k, 0, c);
+                    }
+                }
+                kernel.compute(rows, gradient.data(0, y),
+                               direction.data(0, y));
+            }
+        },
+        16);
 }
 
 /**
- * Calculate gradient for a single pixel
+ * Calculate the Sobel gradient for a single pixel, the reference of the row
+ * kernels in gradient_simd.cpp
  *
- * @return Gradient magnitude of the pixel
+ * @return Gradient magnitude of the pixel, saturated to 255
  * @pre The pixel is not at the edge of the image.
  */
 gradientResp calculateGradient(CImg &image, int x, int y) {
     static const int SOBEL_X[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
     static const int SOBEL_Y[3][3] = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
 
-    static const int SCHARR_X[3][3] = {{3, 0, -3}, {10, 0, -10}, {3, 0, -3}};
-    static const int SCHARR_Y[3][3] = {{3, 10, 3}, {0, 0, 0}, {-3, -10, -3}};
-
     // Calculate the gradient in the x and y directions
     int gradientX = 0;
     int gradientY = 0;
@@ -107,128 +283,364 @@ gradientResp calculateGradient(CImg &image, int x, int y) {
     }
 
     // Calculate the magnitude of the gradient
-    return gradientResp(sqrt(gradientX * gradientX + gradientY * gradientY),
-                        atan2(gradientY, gradientX) * 180 / M_PI);
+    return gradientResp(
+        std::min(sqrt(gradientX * gradientX + gradientY * gradientY), 255.0),
+        directionBin(gradientX, gradientY));
 }
 
 /**
  * Apply non-maximum suppression to the gradient image
  */
-void nonMaxSuppression(CImg &edge, CImg &gradient, CImgFloat &direction) {
-    cimg_forXY(edge, x, y) {
-        // If the pixel is not at the edge of the image
-        if (x > 0 && x < edge.width() - 1 && y > 0 && y < edge.height() - 1) {
-            if (x > 0 && x < edge.width() - 1 && y > 0 &&
-                y < edge.height() - 1) {
-                float angle = direction(x, y);  // Get the continuous angle
-                int dir = discretizeDirection(
-                    angle);  // Discretize the angle into four main directions
-
-                unsigned char magnitude = gradient(x, y);
-                unsigned char mag1 = 0, mag2 = 0;
-
-                // Determine neighboring pixels to compare based on the gradient
-                // direction
-                switch (dir) {
-                    case 0:  // Horizontal edge (East-West)
-                        mag1 = gradient(x - 1, y);
-                        mag2 = gradient(x + 1, y);
-                        break;
-                    case 1:  // Diagonal edge (Northeast-Southwest)
-                        mag1 = gradient(x - 1, y - 1);
-                        mag2 = gradient(x + 1, y + 1);
-                        break;
-                    case 2:  // Vertical edge (North-South)
-                        mag1 = gradient(x, y - 1);
-                        mag2 = gradient(x, y + 1);
-                        break;
-                    case 3:  // Diagonal edge (Northwest-Southeast)
-                        mag1 = gradient(x + 1, y - 1);
-                        mag2 = gradient(x - 1, y + 1);
-                        break;
-                }
+void nonMaxSuppression(CImg &edge, CImg &gradient, CImg &direction) {
+    TRACE_SCOPE("nonMaxSuppression");
+    parallelFor(0, edge.height(), [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            cimg_forX(edge, x) {
+                // If the pixel is not at the edge of the image
+                if (x > 0 && x < edge.width() - 1 && y > 0 &&
+                    y < edge.height() - 1) {
+                    // Merge the direction bins into four main directions
+                    int dir = discretizeDirection(direction(x, y));
 
-                // Retain pixel if its magnitude is greater than its neighbors
-                // along the gradient direction
-                if (magnitude >= mag1 && magnitude >= mag2) {
-                    edge(x, y) = magnitude;  // This pixel is a local maximum
-                } else {
-                    edge(x, y) = 0;  // Suppress pixel
+                    unsigned char magnitude = gradient(x, y);
+                    unsigned char mag1 = 0, mag2 = 0;
+
+                    // Determine neighboring pixels to compare based on the
+                    // gradient direction
+                    switch (dir) {
+                        case 0:  // Horizontal edge (East-West)
+                            mag1 = gradient(x - 1, y);
+                            mag2 = gradient(x + 1, y);
+                            break;
+                        case 1:  // Diagonal edge (Northeast-Southwest)
+                            mag1 = gradient(x - 1, y - 1);
+                            mag2 = gradient(x + 1, y + 1);
+                            break;
+                        case 2:  // Vertical edge (North-South)
+                            mag1 = gradient(x, y - 1);
+                            mag2 = gradient(x, y + 1);
+                            break;
+                        case 3:  // Diagonal edge (Northwest-Southeast)
+                            mag1 = gradient(x + 1, y - 1);
+                            mag2 = gradient(x - 1, y + 1);
+                            break;
+                    }
+
+                    // Retain pixel if its magnitude is greater than its
+                    // neighbors along the gradient direction
+                    if (magnitude >= mag1 && magnitude >= mag2) {
+                        edge(x, y) = magnitude;  // This pixel is a local max
+                    } else {
+                        edge(x, y) = 0;  // Suppress pixel
+                    }
                 }
             }
         }
-    }
+    });
 }
 
-int discretizeDirection(float angle) {
-    if (angle < 0) {
-        angle += 180;
-    }
-    if ((angle < 22.5 && angle >= -22.5) || angle >= 157.5 || angle < -157.5) {
-        return 0;
-    } else if ((angle >= 22.5 && angle < 67.5) ||
-               (angle < -112.5 && angle >= -157.5)) {
-        return 1;
-    } else if ((angle >= 67.5 && angle < 112.5) ||
-               (angle < -67.5 && angle >= -112.5)) {
-        return 2;
-    } else if ((angle >= 112.5 && angle < 157.5) ||
-               (angle < -22.5 && angle >= -67.5)) {
-        return 3;
-    } else {
-        std::cout << "Error: Angle out of range" << std::endl;
-        return -1;
+/**
+ * Merge pairs of direction bins into four directions of 45 degrees centered
+ * on 0, 45, 90 and 135 degrees
+ * @param bin Direction bin, see directionBin.
+ */
+int discretizeDirection(unsigned char bin) { return ((bin + 1) / 2) % 4; }
+
+/**
+ * Root of the union-find tree of a candidate. Every candidate links to a
+ * candidate of lower number, so the path halving of concurrent calls keeps
+ * the trees valid.
+ * @param parent Parent of every candidate, the root links to itself.
+ * @param i Number of the candidate.
+ */
+static int findRoot(std::atomic<int> *parent, int i) {
+    while (true) {
+        int p = parent[i].load(std::memory_order_relaxed);
+        if (p == i) return i;
+        int grandparent = parent[p].load(std::memory_order_relaxed);
+        if (grandparent != p) {
+            parent[i].store(grandparent, std::memory_order_relaxed);
+        }
+        i = grandparent;
     }
 }
 
-void trackEdge(CImg &edge) {
-    // Calculate mean and standard deviation of the gradient magnitude
-    unsigned int sum = 0;
-    unsigned int sumSq = 0;
-    unsigned int numPixels = edge.width() * edge.height();
+/**
+ * Merge the union-find trees of two candidates, lock free. The root of
+ * higher number is linked to the other one, retrying if a concurrent merge
+ * linked it first.
+ * @param parent Parent of every candidate, the root links to itself.
+ * @param a Number of the first candidate.
+ * @param b Number of the second candidate.
+ */
+static void unite(std::atomic<int> *parent, int a, int b) {
+    while (true) {
+        a = findRoot(parent, a);
+        b = findRoot(parent, b);
+        if (a == b) return;
+        if (a < b) std::swap(a, b);
+        int expected = a;
+        if (parent[a].compare_exchange_weak(expected, b)) return;
+    }
+}
 
-    cimg_forXY(edge, x, y) { sum += edge(x, y); }
-    float mean = sum / numPixels;
+// Hysteresis classes of the pixels while edges are tracked, the other
+// pixels being 0
+static const unsigned char HYSTERESIS_WEAK = 1;
+static const unsigned char HYSTERESIS_STRONG = 2;
 
-    cimg_forXY(edge, x, y) {
-        sumSq += (edge(x, y) - mean) * (edge(x, y) - mean);
+/**
+ * Number the weak and strong pixels of a row in scan order
+ * @param edge Hysteresis classes of the pixels.
+ * @param y The row.
+ * @param first Number of the first candidate of the row.
+ * @param ids Receives the number of every pixel, -1 if not a candidate.
+ */
+static void numberCandidates(const CImg &edge, int y, int first,
+                             std::vector<int> &ids) {
+    const unsigned char *pixels = edge.data(0, y);
+    for (int x = 0; x < edge.width(); ++x) {
+        ids[x] = pixels[x] ? first++ : -1;
     }
-    float stdDev = sqrt(sumSq / numPixels);
+}
 
-    // Calculate high and low thresholds according to mean and standard
-    // deviation
-    unsigned char highThreshold = mean + 2 * stdDev;
-    unsigned char lowThreshold = mean + 1 * stdDev;
+/**
+ * Hysteresis thresholds from the histogram of a suppressed gradient. Zero
+ * magnitudes are never edges, so both thresholds are at least 1.
+ * @param histogram Number of pixels of every magnitude.
+ * @param thresholds HYSTERESIS_MEAN_STD or HYSTERESIS_OTSU.
+ * @param low Receives the smallest magnitude of a weak pixel.
+ * @param high Receives the smallest magnitude of a strong pixel.
+ */
+static void hysteresisThresholds(const long long *histogram, int thresholds,
+                                 unsigned char &low, unsigned char &high) {
+    long long count = 0;
+    double sum = 0;
+    for (int v = 0; v < 256; v++) {
+        count += histogram[v];
+        sum += double(v) * histogram[v];
+    }
+    double mean = count ? sum / count : 0;
 
-    cimg_forXY(edge, x, y) {
-        if (edge(x, y) >= highThreshold && edge(x, y) != 255) {
-            // Mark as a strong edge
-            mark(edge, x, y, lowThreshold);
-        } else if (edge(x, y) < lowThreshold) {
-            edge(x, y) = 0;  // Suppress noise
+    double lowValue, highValue;
+    if (thresholds == HYSTERESIS_OTSU) {
+        // Magnitude maximizing the variance between the pixels up to it and
+        // the pixels above it
+        long long below = 0;
+        double sumBelow = 0, bestVariance = -1;
+        int otsu = 0;
+        for (int t = 0; t < 255; t++) {
+            below += histogram[t];
+            sumBelow += double(t) * histogram[t];
+            long long above = count - below;
+            if (below == 0 || above == 0) continue;
+            double difference = sumBelow / below - (sum - sumBelow) / above;
+            double variance = double(below) * above * difference * difference;
+            if (variance > bestVariance) {
+                bestVariance = variance;
+                otsu = t;
+            }
+        }
+        highValue = otsu + 1;
+        lowValue = highValue / 2;
+    } else {
+        double squares = 0;
+        for (int v = 0; v < 256; v++) {
+            squares += (v - mean) * (v - mean) * histogram[v];
         }
+        double stdDev = count ? sqrt(squares / count) : 0;
+        highValue = mean + 2 * stdDev;
+        lowValue = mean + 1 * stdDev;
     }
+    low = static_cast<unsigned char>(std::min(std::max(lowValue, 1.0), 255.0));
+    high =
+        static_cast<unsigned char>(std::min(std::max(highValue, 1.0), 255.0));
+}
 
-    // Clear unselected edges
-    cimg_forXY(edge, x, y) {
-        if (edge(x, y) != 255) {
-            edge(x, y) = 0;
+/**
+ * Merge every candidate of a row with its 8-connected candidate neighbors
+ * on its left and in the row above
+ * @param parent Parent of every candidate, the root links to itself.
+ * @param above Candidate numbers of the row above, null to skip it.
+ * @param row Candidate numbers of the row.
+ * @param width Width of the rows.
+ */
+static void linkRow(std::atomic<int> *parent, const int *above,
+                    const int *row, int width) {
+    for (int x = 0; x < width; ++x) {
+        int id = row[x];
+        if (id < 0) continue;
+        // The pixel above touches the three other neighbors, the left one
+        // touches the upper left one
+        if (above && above[x] >= 0) {
+            unite(parent, id, above[x]);
+            continue;
+        }
+        if (x > 0 && row[x - 1] >= 0) {
+            unite(parent, id, row[x - 1]);
+        } else if (above && x > 0 && above[x - 1] >= 0) {
+            unite(parent, id, above[x - 1]);
+        }
+        if (above && x + 1 < width && above[x + 1] >= 0) {
+            unite(parent, id, above[x + 1]);
         }
     }
 }
 
-void mark(CImg &edge, int x, int y, unsigned char lowThreshold) {
-    edge(x, y) = 255;  // Mark as a strong edge
-
-    // Check 8-connected neighbors for weak edges
-    for (int dx = -1; dx <= 1; ++dx) {
-        for (int dy = -1; dy <= 1; ++dy) {
-            int nx = x + dx, ny = y + dy;
-            if (nx >= 0 && nx < edge.width() && ny >= 0 && ny < edge.height() &&
-                edge(nx, ny) != 255 && edge(nx, ny) >= lowThreshold) {
-                // Recursively mark weak edges
-                mark(edge, nx, ny, lowThreshold);
+/**
+ * Hysteresis thresholding of the suppressed gradient. Pixels above the low
+ * threshold are grouped into 8-connected components, and the components
+ * holding a pixel above the high threshold are kept as edges.
+ *
+ * The thresholds come from 256-bin histograms built in one parallel pass,
+ * either for the whole image or for every tile, which suits photos whose
+ * contrast changes across the frame. A pixel is then weak or strong
+ * according to the thresholds of its own tile.
+ *
+ * Candidates are numbered in scan order, so the union-find forest holds
+ * only them. Bands of rows link their candidates in parallel, then the
+ * components are merged across the band borders with lock-free unions. The
+ * result does not depend on the number of threads, and no recursion follows
+ * the edges.
+ *
+ * @param edge Suppressed gradient, replaced by 255 on edges and 0 elsewhere.
+ * @param thresholds HYSTERESIS_MEAN_STD or HYSTERESIS_OTSU.
+ * @param tileSize Side of the tiles with their own thresholds, 0 for one
+ * pair of thresholds over the whole image.
+ */
+void trackEdge(CImg &edge, int thresholds, int tileSize) {
+    TRACE_SCOPE("trackEdge");
+
+    const int width = edge.width(), height = edge.height();
+    const int bandRows = 16;
+    const int numBands = (height + bandRows - 1) / bandRows;
+
+    // Histogram of every tile, tiles spanning whole bands of rows when there
+    // is a single pair of thresholds
+    const int tileWidth = tileSize > 0 ? tileSize : width;
+    const int tileHeight = tileSize > 0 ? tileSize : bandRows;
+    const int tilesX = (width + tileWidth - 1) / tileWidth;
+    const int tilesY = (height + tileHeight - 1) / tileHeight;
+    std::vector<long long> histograms(tilesY * tilesX * 256, 0);
+    parallelFor(0, tilesY, [&](int tileBegin, int tileEnd) {
+        for (int ty = tileBegin; ty < tileEnd; ty++) {
+            int rowEnd = std::min((ty + 1) * tileHeight, height);
+            for (int y = ty * tileHeight; y < rowEnd; ++y) {
+                const unsigned char *pixels = edge.data(0, y);
+                for (int x = 0; x < width; ++x) {
+                    int tile = ty * tilesX + x / tileWidth;
+                    histograms[tile * 256 + pixels[x]]++;
+                }
+            }
+        }
+    });
+    if (tileSize <= 0) {
+        for (int tile = 1; tile < tilesY; tile++) {
+            for (int v = 0; v < 256; v++) {
+                histograms[v] += histograms[tile * 256 + v];
             }
         }
     }
-}
\ No newline at end of file
+
+    // Calculate high and low thresholds of every tile
+    int numTiles = tileSize > 0 ? tilesY * tilesX : 1;
+    std::vector<unsigned char> lowThreshold(numTiles), highThreshold(numTiles);
+    for (int tile = 0; tile < numTiles; tile++) {
+        hysteresisThresholds(&histograms[tile * 256], thresholds,
+                             lowThreshold[tile], highThreshold[tile]);
+    }
+
+    // Classify the pixels as weak or strong candidates, and count the
+    // candidates of every row
+    std::vector<int> rowStart(height + 1, 0);
+    parallelFor(0, height, [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            unsigned char *pixels = edge.data(0, y);
+            int count = 0;
+            for (int x = 0; x < width; ++x) {
+                int tile = tileSize > 0 ? (y / tileSize) * tilesX + x / tileSize
+                                        : 0;
+                unsigned char magnitude = pixels[x];
+                if (magnitude >= highThreshold[tile]) {
+                    pixels[x] = HYSTERESIS_STRONG;
+                } else if (magnitude >= lowThreshold[tile]) {
+                    pixels[x] = HYSTERESIS_WEAK;
+                } else {
+                    pixels[x] = 0;
+                }
+                count += pixels[x] != 0;
+            }
+            rowStart[y + 1] = count;
+        }
+    }, 16);
+    for (int y = 0; y < height; ++y) {
+        rowStart[y + 1] += rowStart[y];
+    }
+    int numCandidates = rowStart[height];
+    std::unique_ptr<std::atomic<int>[]> parent(
+        new std::atomic<int>[numCandidates]);
+    std::unique_ptr<std::atomic<bool>[]> strong(
+        new std::atomic<bool>[numCandidates]);
+
+    // Link the candidates inside every band
+    parallelFor(0, numBands, [&](int bandBegin, int bandEnd) {
+        std::vector<int> above(width), row(width);
+        for (int b = bandBegin; b < bandEnd; b++) {
+            int rowBegin = b * bandRows;
+            int rowEnd = std::min(rowBegin + bandRows, height);
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                numberCandidates(edge, y, rowStart[y], row);
+                for (int id = rowStart[y]; id < rowStart[y + 1]; ++id) {
+                    parent[id].store(id, std::memory_order_relaxed);
+                    strong[id].store(false, std::memory_order_relaxed);
+                }
+                linkRow(parent.get(), y > rowBegin ? above.data() : nullptr,
+                        row.data(), width);
+                std::swap(above, row);
+            }
+        }
+    });
+
+    // Merge the components across the top border of every band
+    parallelFor(1, numBands, [&](int bandBegin, int bandEnd) {
+        std::vector<int> above(width), row(width);
+        for (int b = bandBegin; b < bandEnd; b++) {
+            int y = b * bandRows;
+            numberCandidates(edge, y - 1, rowStart[y - 1], above);
+            numberCandidates(edge, y, rowStart[y], row);
+            linkRow(parent.get(), above.data(), row.data(), width);
+        }
+    });
+
+    // Link every candidate to its root, and flag the roots of the
+    // components holding a strong pixel
+    parallelFor(0, height, [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            const unsigned char *pixels = edge.data(0, y);
+            int id = rowStart[y];
+            for (int x = 0; x < width; ++x) {
+                if (!pixels[x]) continue;
+                int root = findRoot(parent.get(), id);
+                parent[id].store(root, std::memory_order_relaxed);
+                if (pixels[x] == HYSTERESIS_STRONG) {
+                    strong[root].store(true, std::memory_order_relaxed);
+                }
+                id++;
+            }
+        }
+    }, 16);
+
+    // Keep the strong components
+    parallelFor(0, height, [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            unsigned char *pixels = edge.data(0, y);
+            int id = rowStart[y];
+            for (int x = 0; x < width; ++x) {
+                if (!pixels[x]) continue;
+                int root = parent[id++].load(std::memory_order_relaxed);
+                pixels[x] =
+                    strong[root].load(std::memory_order_relaxed) ? 255 : 0;
+            }
+        }
+    }, 16);
+}
@@ -1,19 +1,28 @@
 #include <cuda_runtime.h>
 
+#include <algorithm>
+#include <iostream>
+
 #include "edgedraw.h"
+#include "trace.h"
 
 __constant__ int SOBEL_X[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
 __constant__ int SOBEL_Y[3][3] = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
 __constant__ unsigned char SUPPRESS_THRESHOLD = GRADIENT_THRESH;
 __constant__ int ANCHORS_THRESHOLD = ANCHOR_THRESH;
+__constant__ int PICK_SPACING = VERTEX_SPACING;
 __constant__ int SMALL_BLOCK_LENGTH = smallBlockLength;
 
-__device__ void drawEdgesFromAnchorKernel(int x, int y,
-                                          unsigned char *d_gradient,
-                                          float *d_direction,
-                                          unsigned char *d_edge,
-                                          const bool horizontal, int width,
-                                          int height, int pickCtr);
+// Pending walks of the edge tracer per thread, in local memory
+const int TRACE_STACK_SIZE = 128;
+
+// Walks that did not fit in the stack of their thread, traced by a later
+// launch. count keeps growing past capacity, so overflows are known.
+struct TraceSpill {
+    TraceFrame *frames;
+    int *count;
+    int capacity;
+};
 
 __global__ void colorToGrayKernel(unsigned char *image,
                                   unsigned char *grayImage, int width,
@@ -35,6 +44,28 @@ __global__ void colorToGrayKernel(unsigned char *image,
         }
 }
 
+/**
+ * Sobel gradient of a pixel inside the border of the gray image
+ * @param angle receives the direction in degrees
+ * @return the magnitude
+ */
+__device__ unsigned char sobelCuda(const unsigned char *grayImage, int px,
+                                   int py, int width, float &angle) {
+    int gradientX = 0, gradientY = 0;
+
+    // Apply the Sobel filter
+    for (int i = -1; i <= 1; i++) {
+        for (int j = -1; j <= 1; j++) {
+            int pixel = grayImage[(py + j) * width + (px + i)];
+            gradientX += SOBEL_X[i + 1][j + 1] * pixel;
+            gradientY += SOBEL_Y[i + 1][j + 1] * pixel;
+        }
+    }
+
+    angle = atan2f(gradientY, gradientX) * 180 / M_PI;
+    return sqrtf(gradientX * gradientX + gradientY * gradientY);
+}
+
 __global__ void gradientCalculationKernel(unsigned char *grayImage,
                                           unsigned char *gradient,
                                           float *direction, int width,
@@ -47,21 +78,9 @@ __global__ void gradientCalculationKernel(unsigned char *grayImage,
         for (int py = y * SMALL_BLOCK_LENGTH;
              py > 0 && py < height - 1 && py < (y + 1) * SMALL_BLOCK_LENGTH;
              ++py) {
-            int gradientX = 0, gradientY = 0;
-
-            // Apply the Sobel filter
-            for (int i = -1; i <= 1; i++) {
-                for (int j = -1; j <= 1; j++) {
-                    int pixel = grayImage[(py + j) * width + (px + i)];
-                    gradientX += SOBEL_X[i + 1][j + 1] * pixel;
-                    gradientY += SOBEL_Y[i + 1][j + 1] * pixel;
-                }
-            }
-
             int idx = py * width + px;
             gradient[idx] =
-                sqrtf(gradientX * gradientX + gradientY * gradientY);
-            direction[idx] = atan2f(gradientY, gradientX) * 180 / M_PI;
+                sobelCuda(grayImage, px, py, width, direction[idx]);
         }
 }
 
@@ -75,8 +94,6 @@ void gradientInGrayGPU(CImg &image, CImg &gradient, CImgFloat &direction) {
     size_t grayImageSize = width * height * sizeof(unsigned char);
     size_t directionSize = width * height * sizeof(float);
 
-    // auto start = std::chrono::high_resolution_clock::now();
-
     cudaMalloc(&d_image, imageSize);
     cudaMalloc(&d_grayImage, grayImageSize);
     cudaMalloc(&d_gradient, grayImageSize);
@@ -95,13 +112,6 @@ void gradientInGrayGPU(CImg &image, CImg &gradient, CImgFloat &direction) {
 
     colorToGrayKernel<<<gridSize, blockSize>>>(d_image, d_grayImage, width,
                                                height);
-    // auto end = std::chrono::high_resolution_clock::now();
-    // auto duration =
-    //     std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-    // std::cout << "Time Grayscale GPU: " << duration.count() << " microseconds"
-    //           << std::endl;
-
-    // start = std::chrono::high_resolution_clock::now();
     gradientCalculationKernel<<<gridSize, blockSize>>>(
         d_grayImage, d_gradient, d_direction, width, height);
 
@@ -111,12 +121,6 @@ void gradientInGrayGPU(CImg &image, CImg &gradient, CImgFloat &direction) {
     cudaMemcpy(direction.data(), d_direction, directionSize,
                cudaMemcpyDeviceToHost);
 
-    // end = std::chrono::high_resolution_clock::now();
-    // duration =
-    //     std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-    // std::cout << "Time Gradient GPU: " << duration.count() << " microseconds"
-    //           << std::endl;
-
     // Free device memory
     cudaFree(d_image);
     cudaFree(d_grayImage);
@@ -174,6 +178,10 @@ void suppressWeakGradientsGPU(CImg &gradient) {
     cudaFree(d_gradient);
 }
 
+__device__ bool validCuda(int x, int y, int width, int height) {
+    return x > 0 && y > 0 && x < width - 1 && y < height - 1;
+}
+
 __device__ bool isHorizontalCuda(float angle) {
     if ((angle < 45 && angle >= -45) || angle >= 136 || angle < -135) {
         return true;  // horizontal
@@ -211,6 +219,67 @@ __global__ void determineAnchorsKernel(unsigned char *gradient,
         }
 }
 
+/**
+ * Suppressed Sobel gradient of a pixel, zero on the image border
+ */
+__device__ unsigned char suppressedSobelCuda(const unsigned char *grayImage,
+                                             int px, int py, int width,
+                                             int height, float &angle) {
+    angle = 0;
+    if (!validCuda(px, py, width, height)) return 0;
+    unsigned char magnitude = sobelCuda(grayImage, px, py, width, angle);
+    return magnitude <= SUPPRESS_THRESHOLD ? 0 : magnitude;
+}
+
+/**
+ * Gradient, weak gradient suppression and anchors in one kernel, the same as
+ * gradientCalculationKernel, suppressWeakGradientsKernel and
+ * determineAnchorsKernel. A thread computes the suppressed gradient of its
+ * pixels and, for the pixels left, of the two neighbors across the edge, so
+ * the anchors do not wait for the gradient of the whole image.
+ */
+__global__ void gradientAnchorsKernel(unsigned char *grayImage,
+                                      unsigned char *gradient,
+                                      float *direction, bool *anchor,
+                                      int width, int height) {
+    int x = blockIdx.x * blockDim.x + threadIdx.x;
+    int y = blockIdx.y * blockDim.y + threadIdx.y;
+
+    for (int px = x * SMALL_BLOCK_LENGTH;
+         px > 0 && px < width - 1 && px < (x + 1) * SMALL_BLOCK_LENGTH; ++px)
+        for (int py = y * SMALL_BLOCK_LENGTH;
+             py > 0 && py < height - 1 && py < (y + 1) * SMALL_BLOCK_LENGTH;
+             ++py) {
+            int idx = py * width + px;
+            float angle, neighborAngle;
+            int magnitude = suppressedSobelCuda(grayImage, px, py, width,
+                                                height, angle);
+            gradient[idx] = magnitude;
+            direction[idx] = angle;
+
+            // Anchors are tested on every other pixel of a block, see
+            // determineAnchorsKernel
+            if (magnitude == 0 || (px - x * SMALL_BLOCK_LENGTH) % 2 ||
+                (py - y * SMALL_BLOCK_LENGTH) % 2) {
+                continue;
+            }
+            int mag1 = 0, mag2 = 0;
+            if (isHorizontalCuda(angle)) {
+                mag1 = suppressedSobelCuda(grayImage, px, py - 1, width,
+                                           height, neighborAngle);
+                mag2 = suppressedSobelCuda(grayImage, px, py + 1, width,
+                                           height, neighborAngle);
+            } else {
+                mag1 = suppressedSobelCuda(grayImage, px - 1, py, width,
+                                           height, neighborAngle);
+                mag2 = suppressedSobelCuda(grayImage, px + 1, py, width,
+                                           height, neighborAngle);
+            }
+            anchor[idx] = magnitude - mag1 >= ANCHORS_THRESHOLD &&
+                          magnitude - mag2 >= ANCHORS_THRESHOLD;
+        }
+}
+
 void determineAnchorsGPU(const CImg &gradient, const CImgFloat &direction,
                          CImgBool &anchor) {
     int width = gradient.width();
@@ -256,180 +325,114 @@ void determineAnchorsGPU(const CImg &gradient, const CImgFloat &direction,
     cudaFree(d_anchor);
 }
 
-__device__ bool validCuda(int x, int y, int width, int height) {
-    return x > 0 && y > 0 && x < width - 1 && y < height - 1;
-}
-
-__device__ void drawHorizontalEdgeFromAnchorKernel(
-    int x, int y, unsigned char *d_gradient, float *d_direction,
-    unsigned char *d_edge, int width, int height, int pickCtr) {
-    if (!validCuda(x, y, width, height) || d_edge[y * width + x]) return;
-
-    int initPickCtr = pickCtr;
-
-    int curr_x = x;
-    int curr_y = y;
-    d_edge[y * width + x] = 0;
-    while (validCuda(curr_x, curr_y, width, height) &&
-           d_gradient[curr_y * width + curr_x] > 0 &&
-           !d_edge[curr_y * width + curr_x] &&
-           isHorizontalCuda(d_direction[curr_y * width + curr_x])) {
-        d_edge[curr_y * width + curr_x] = 255;
-        if (pickCtr % 8 == 0) {
-            d_edge[curr_y * width + curr_x] = 254;
-        };
-        unsigned char leftUp = d_gradient[(curr_y - 1) * width + curr_x - 1];
-        unsigned char left = d_gradient[curr_y * width + curr_x - 1];
-        unsigned char leftDown = d_gradient[(curr_y + 1) * width + curr_x - 1];
-        // Move to the pixel with the highest gradient value
-        if (leftUp > left && leftUp > leftDown) {
-            curr_x -= 1;
-            curr_y -= 1;  // Move up-left
-        } else if (leftDown > left && leftDown > leftUp) {
-            curr_x -= 1;
-            curr_y += 1;  // Move down-left
-        } else {
-            curr_x -= 1;  // Move straight-left
-        }
-        pickCtr += 1;
+/**
+ * Queue the two walks of an edge through a point, see pushWalks in
+ * edgedraw.cpp. When the stack is full the point is spilled, and traced
+ * again by drawEdgesFromSpillKernel.
+ */
+__device__ void pushWalksCuda(int x, int y, bool horizontal, int pickCtr,
+                              unsigned char *d_gradient, unsigned char *d_edge,
+                              int width, int height, TraceFrame *stack,
+                              int &top, TraceSpill spill) {
+    if (!validCuda(x, y, width, height) || d_gradient[y * width + x] <= 0 ||
+        d_edge[y * width + x]) {
+        return;
     }
-    drawEdgesFromAnchorKernel(curr_x, curr_y, d_gradient, d_direction, d_edge,
-                              false, width, height, pickCtr);
-
-    pickCtr = initPickCtr;
-    curr_x = x;
-    curr_y = y;
-    d_edge[y * width + x] = 0;
-    while (validCuda(curr_x, curr_y, width, height) &&
-           d_gradient[curr_y * width + curr_x] > 0 &&
-           !d_edge[curr_y * width + curr_x] &&
-           isHorizontalCuda(d_direction[curr_y * width + curr_x])) {
-        d_edge[curr_y * width + curr_x] = 255;
-        if (pickCtr % 8 == 0) {
-            d_edge[curr_y * width + curr_x] = 254;
-        };
-        unsigned char rightUp = d_gradient[(curr_y - 1) * width + curr_x - 1];
-        unsigned char right = d_gradient[curr_y * width + curr_x - 1];
-        unsigned char rightDown = d_gradient[(curr_y + 1) * width + curr_x - 1];
-        // Move to the pixel with the highest gradient value
-        if (rightUp > right && rightUp > rightDown) {
-            curr_x += 1;
-            curr_y -= 1;  // Move up-right
-        } else if (rightDown > right && rightDown > rightUp) {
-            curr_x += 1;
-            curr_y += 1;  // Move down-right
-        } else {
-            curr_x += 1;  // Move straight-right
+    if (top + 2 > TRACE_STACK_SIZE) {
+        int slot = atomicAdd(spill.count, 1);
+        if (slot < spill.capacity) {
+            spill.frames[slot] = TraceFrame{
+                x, y, horizontal ? WALK_RIGHT : WALK_DOWN, pickCtr, false};
         }
-        pickCtr += 1;
+        return;
     }
-    drawEdgesFromAnchorKernel(curr_x, curr_y, d_gradient, d_direction, d_edge,
-                              false, width, height, pickCtr);
-}
-
-__device__ void drawVerticalEdgeFromAnchorKernel(
-    int x, int y, unsigned char *d_gradient, float *d_direction,
-    unsigned char *d_edge, int width, int height, int pickCtr) {
-    if (!validCuda(x, y, width, height)) return;
-
-    int initPickCtr = pickCtr;
-
-    int curr_x = x;
-    int curr_y = y;
-    d_edge[y * width + x] = 0;  // Assuming white edges on a black background
-
-    // Trace upwards from the anchor point
-    while (validCuda(curr_x, curr_y, width, height) &&
-           d_gradient[curr_y * width + curr_x] > 0 &&
-           !d_edge[curr_y * width + curr_x] &&
-           !isHorizontalCuda(d_direction[curr_y * width + curr_x])) {
-        d_edge[curr_y * width + curr_x] =
-            255;  // Mark this pixel as part of an edge
-        if (pickCtr % 8 == 0) {
-            d_edge[curr_y * width + curr_x] = 254;
-        };
-        unsigned char upLeft = d_gradient[(curr_y - 1) * width + curr_x - 1];
-        unsigned char up = d_gradient[(curr_y - 1) * width + curr_x];
-        unsigned char upRight = d_gradient[(curr_y - 1) * width + curr_x + 1];
-
-        // Move to the pixel with the highest gradient value above the current
-        // pixel
-        if (upLeft > up && upLeft > upRight) {
-            curr_x -= 1;
-            curr_y -= 1;  // Move top-left
-        } else if (upRight > up && upRight > upLeft) {
-            curr_x += 1;
-            curr_y -= 1;  // Move top-right
-        } else {
-            curr_y -= 1;  // Move straight up
-        }
-        pickCtr += 1;
+    if (horizontal) {
+        stack[top++] = TraceFrame{x, y, WALK_RIGHT, pickCtr, false};
+        stack[top++] = TraceFrame{x, y, WALK_LEFT, pickCtr, false};
+    } else {
+        stack[top++] = TraceFrame{x, y, WALK_DOWN, pickCtr, false};
+        stack[top++] = TraceFrame{x, y, WALK_UP, pickCtr, false};
     }
-    drawEdgesFromAnchorKernel(curr_x, curr_y, d_gradient, d_direction, d_edge,
-                              true, width, height, pickCtr);
-
-    // Reset to anchor point
-    pickCtr = initPickCtr;
-    curr_x = x;
-    curr_y = y;
-    d_edge[y * width + x] = 0;
+}
 
-    // Trace downwards from the anchor point
+/**
+ * Follow an edge from the start of a walk, see walkEdge in edgedraw.cpp
+ */
+__device__ void walkEdgeCuda(const TraceFrame &frame,
+                             unsigned char *d_gradient, float *d_direction,
+                             unsigned char *d_edge, int width, int height,
+                             TraceFrame *stack, int &top, TraceSpill spill) {
+    bool horizontal = frame.walk == WALK_LEFT || frame.walk == WALK_RIGHT;
+    int step = frame.walk == WALK_LEFT || frame.walk == WALK_UP ? -1 : 1;
+
+    int curr_x = frame.x;
+    int curr_y = frame.y;
+    int pickCtr = frame.pickCtr;
+    d_edge[curr_y * width + curr_x] = 0;
     while (validCuda(curr_x, curr_y, width, height) &&
            d_gradient[curr_y * width + curr_x] > 0 &&
            !d_edge[curr_y * width + curr_x] &&
-           !isHorizontalCuda(d_direction[curr_y * width + curr_x])) {
+           isHorizontalCuda(d_direction[curr_y * width + curr_x]) ==
+               horizontal) {
         d_edge[curr_y * width + curr_x] =
-            255;  // Mark this pixel as part of an edge
-        if (pickCtr % 8 == 0) {
-            d_edge[curr_y * width + curr_x] = 254;
-        };
-        unsigned char downLeft = d_gradient[(curr_y + 1) * width + curr_x - 1];
-        unsigned char down = d_gradient[(curr_y + 1) * width + curr_x];
-        unsigned char downRight = d_gradient[(curr_y + 1) * width + curr_x + 1];
-
-        // Move to the pixel with the highest gradient value below the current
-        // pixel
-        if (downLeft > down && downLeft > downRight) {
-            curr_x -= 1;
-            curr_y += 1;  // Move bottom-left
-        } else if (downRight > down && downRight > downLeft) {
-            curr_x += 1;
-            curr_y += 1;  // Move bottom-right
+            pickCtr % PICK_SPACING == 0 ? 254 : 255;
+
+        // Move to the pixel with the highest gradient value ahead
+        if (horizontal) {
+            int ahead = curr_x + step;
+            unsigned char up = d_gradient[(curr_y - 1) * width + ahead];
+            unsigned char straight = d_gradient[curr_y * width + ahead];
+            unsigned char down = d_gradient[(curr_y + 1) * width + ahead];
+            if (up > straight && up > down) {
+                curr_y -= 1;
+            } else if (down > straight && down > up) {
+                curr_y += 1;
+            }
+            curr_x += step;
         } else {
-            curr_y += 1;  // Move straight down
+            int ahead = (curr_y + step) * width;
+            unsigned char left = d_gradient[ahead + curr_x - 1];
+            unsigned char straight = d_gradient[ahead + curr_x];
+            unsigned char right = d_gradient[ahead + curr_x + 1];
+            if (left > straight && left > right) {
+                curr_x -= 1;
+            } else if (right > straight && right > left) {
+                curr_x += 1;
+            }
+            curr_y += step;
         }
-        pickCtr += 1;
+        pickCtr++;
     }
-    drawEdgesFromAnchorKernel(curr_x, curr_y, d_gradient, d_direction, d_edge,
-                              true, width, height, pickCtr);
+    pushWalksCuda(curr_x, curr_y, !horizontal, pickCtr, d_gradient, d_edge,
+                  width, height, stack, top, spill);
 }
 
+/**
+ * Draw the edges from an anchor point with an explicit stack of walks, see
+ * traceFromAnchor in edgedraw.cpp
+ */
 __device__ void drawEdgesFromAnchorKernel(int x, int y,
                                           unsigned char *d_gradient,
                                           float *d_direction,
                                           unsigned char *d_edge,
                                           const bool horizontal, int width,
-                                          int height, int pickCtr) {
-    // Check recursion base condition
-    if (!validCuda(x, y, width, height) || d_gradient[y * width + x] <= 0 ||
-        d_edge[y * width + x]) {
-        return;
-    }
-
-    if (horizontal) {
-        drawHorizontalEdgeFromAnchorKernel(x, y, d_gradient, d_direction,
-                                           d_edge, width, height, pickCtr);
-    } else {
-        drawVerticalEdgeFromAnchorKernel(x, y, d_gradient, d_direction, d_edge,
-                                         width, height, pickCtr);
+                                          int height, int pickCtr,
+                                          TraceSpill spill) {
+    TraceFrame stack[TRACE_STACK_SIZE];
+    int top = 0;
+    pushWalksCuda(x, y, horizontal, pickCtr, d_gradient, d_edge, width,
+                  height, stack, top, spill);
+    while (top > 0) {
+        TraceFrame frame = stack[--top];
+        walkEdgeCuda(frame, d_gradient, d_direction, d_edge, width, height,
+                     stack, top, spill);
     }
 }
 
 __global__ void drawEdgesFromAnchorsKernel(unsigned char *d_gradient,
                                            float *d_direction, bool *d_anchor,
                                            unsigned char *d_edge, int width,
-                                           int height) {
+                                           int height, TraceSpill spill) {
     int x = blockIdx.x * blockDim.x + threadIdx.x;
     int y = blockIdx.y * blockDim.y + threadIdx.y;
 
@@ -441,9 +444,114 @@ __global__ void drawEdgesFromAnchorsKernel(unsigned char *d_gradient,
                 bool horizontal =
                     isHorizontalCuda(d_direction[py * width + px]);
                 drawEdgesFromAnchorKernel(px, py, d_gradient, d_direction,
-                                          d_edge, horizontal, width, height, 0);
+                                          d_edge, horizontal, width, height, 0,
+                                          spill);
+            }
+        }
+}
+
+/**
+ * Trace the edges again from the points spilled by a previous launch, one
+ * thread per point
+ */
+__global__ void drawEdgesFromSpillKernel(const TraceFrame *frames, int count,
+                                         unsigned char *d_gradient,
+                                         float *d_direction,
+                                         unsigned char *d_edge, int width,
+                                         int height, TraceSpill spill) {
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < count) {
+        TraceFrame frame = frames[i];
+        drawEdgesFromAnchorKernel(frame.x, frame.y, d_gradient, d_direction,
+                                  d_edge, frame.walk == WALK_RIGHT, width,
+                                  height, frame.pickCtr, spill);
+    }
+}
+
+/**
+ * Trace the edges from the anchors on the device. The walks overflowing the
+ * stack of their thread are spilled and traced by further launches until
+ * none is left, so that dense edge maps lose no edge, unlike a fixed stack
+ * alone. A launch spilling more walks than its buffer holds is traced again
+ * from the edges it started with, into a buffer grown to fit. The spilled
+ * walks are counted as traceSpills and the launches traced again as
+ * traceRetraces; walks are only lost, with a warning, when the device has no
+ * memory left for a larger buffer.
+ */
+static void traceEdgesGPU(unsigned char *d_gradient, float *d_direction,
+                          bool *d_anchor, unsigned char *d_edge, int width,
+                          int height, dim3 gridSize, dim3 blockSize) {
+    size_t pixels = size_t(width) * height;
+    // Spills come from deep stacks only, a small part of the pixels
+    int capacity[2];
+    capacity[0] = capacity[1] = std::max(width * height / 16, 1024);
+    TraceFrame *d_frames[2];
+    int *d_count;
+    unsigned char *d_start;
+    cudaMalloc(&d_frames[0], capacity[0] * sizeof(TraceFrame));
+    cudaMalloc(&d_frames[1], capacity[1] * sizeof(TraceFrame));
+    cudaMalloc(&d_count, sizeof(int));
+    cudaMalloc(&d_start, pixels);
+
+    long long spilled = 0, retraces = 0, lost = 0;
+    // The first launch traces from the anchors, the next ones count frames
+    // of d_frames[current]
+    bool fromAnchors = true;
+    int current = 1, count = 0;
+    while (fromAnchors || count > 0) {
+        int next = 1 - current;
+        cudaMemcpy(d_start, d_edge, pixels, cudaMemcpyDeviceToDevice);
+        int spills;
+        while (true) {
+            cudaMemset(d_count, 0, sizeof(int));
+            TraceSpill spill{d_frames[next], d_count, capacity[next]};
+            if (fromAnchors) {
+                drawEdgesFromAnchorsKernel<<<gridSize, blockSize>>>(
+                    d_gradient, d_direction, d_anchor, d_edge, width, height,
+                    spill);
+            } else {
+                drawEdgesFromSpillKernel<<<(count + 255) / 256, 256>>>(
+                    d_frames[current], count, d_gradient, d_direction,
+                    d_edge, width, height, spill);
+            }
+            cudaMemcpy(&spills, d_count, sizeof(int), cudaMemcpyDeviceToHost);
+            if (spills <= capacity[next]) break;
+
+            // The walks past the buffer were dropped and cannot be found
+            // again, trace the whole launch again into a larger buffer
+            int grown = std::max(spills, 2 * capacity[next]);
+            TraceFrame *d_grown;
+            if (cudaMalloc(&d_grown, grown * sizeof(TraceFrame)) !=
+                cudaSuccess) {
+                lost += spills - capacity[next];
+                spills = capacity[next];
+                break;
             }
+            cudaFree(d_frames[next]);
+            d_frames[next] = d_grown;
+            capacity[next] = grown;
+            cudaMemcpy(d_edge, d_start, pixels, cudaMemcpyDeviceToDevice);
+            retraces++;
         }
+        spilled += spills;
+        count = spills;
+        current = next;
+        fromAnchors = false;
+    }
+    TRACE_COUNTER("traceSpills", spilled);
+    if (retraces > 0) {
+        TRACE_COUNTER("traceRetraces", retraces);
+    }
+    if (lost > 0) {
+        std::cerr << "Warning: " << lost
+                  << " edge walks lost, no device memory left to spill them"
+                  << std::endl;
+    }
+
+    cudaFree(d_frames[0]);
+    cudaFree(d_frames[1]);
+    cudaFree(d_count);
+    cudaFree(d_start);
 }
 
 void drawEdgesFromAnchorsGPU(const CImg &gradient, const CImgFloat &direction,
@@ -480,18 +588,20 @@ void drawEdgesFromAnchorsGPU(const CImg &gradient, const CImgFloat &direction,
         ((height + smallBlockLength - 1) / smallBlockLength + blockSize.y - 1) /
             blockSize.y);
 
-    // Set stack size limit if needed
-    if (width * height > 800 * 600) {
-        cudaDeviceSetLimit(cudaLimitStackSize, 2 * 1024);
-    }
-
     // Launch kernel
-    drawEdgesFromAnchorsKernel<<<gridSize, blockSize>>>(
-        d_gradient, d_direction, d_anchor, d_edge, width, height);
+    cudaMemset(d_edge, 0, numPixels * sizeof(unsigned char));
+    traceEdgesGPU(d_gradient, d_direction, d_anchor, d_edge, width, height,
+                  gridSize, blockSize);
 
     // Copy results back to host
     cudaMemcpy(edge.data(), d_edge, numPixels * sizeof(unsigned char),
                cudaMemcpyDeviceToHost);
+
+    // Free device memory
+    cudaFree(d_gradient);
+    cudaFree(d_direction);
+    cudaFree(d_anchor);
+    cudaFree(d_edge);
 }
 
 #define checkCudaErrors(val) check_cuda((val), #val, __FILE__, __LINE__)
@@ -510,11 +620,24 @@ void check_cuda(cudaError_t result, char const *const func,
     }
 }
 
+/**
+ * Copy the edge drawing parameters to the constant memory used by the kernels
+ * @param params Thresholds and vertex spacing of the edge drawing.
+ */
+void setEdgeDrawParamsGPU(const EdgeDrawParams &params) {
+    cudaMemcpyToSymbol(SUPPRESS_THRESHOLD, &params.gradientThresh,
+                       sizeof(unsigned char));
+    cudaMemcpyToSymbol(ANCHORS_THRESHOLD, &params.anchorThresh, sizeof(int));
+    cudaMemcpyToSymbol(PICK_SPACING, &params.vertexSpacing, sizeof(int));
+}
+
 /**
  * @brief Combines all the edge detection steps into a single function
  */
-CImg edgeDrawGPUCombined(CImg &image) {
+CImg edgeDrawGPUCombined(CImg &image, const EdgeDrawParams &params) {
+    TRACE_SCOPE("edgeDrawGPU");
     int width = image.width(), height = image.height();
+    setEdgeDrawParamsGPU(params);
 
     // Flatten the image data for CUDA
     unsigned char *d_image, *d_grayImage, *d_gradient, *d_edge;
@@ -552,27 +675,15 @@ CImg edgeDrawGPUCombined(CImg &image) {
                                                height);
     cudaFree(d_image);
 
-    // Step 2: Calculate the gradient and direction of the image
-    gradientCalculationKernel<<<gridSize, blockSize>>>(
-        d_grayImage, d_gradient, d_direction, width, height);
+    // Step 2: Calculate the gradient, suppress weak gradients and determine
+    // anchors in one kernel
+    gradientAnchorsKernel<<<gridSize, blockSize>>>(
+        d_grayImage, d_gradient, d_direction, d_anchor, width, height);
     cudaFree(d_grayImage);
 
-    // Step 3: Suppress weak gradients
-    suppressWeakGradientsKernel<<<gridSize, blockSize>>>(d_gradient, width,
-                                                         height);
-
-    // Step 4: Determine anchors
-    determineAnchorsKernel<<<gridSize, blockSize>>>(d_gradient, d_direction,
-                                                    d_anchor, width, height);
-
-    // Set stack size limit if needed
-    if (width * height > 800 * 600) {
-        cudaDeviceSetLimit(cudaLimitStackSize, 2 * 1024);
-    }
-
-    // Step 5: Draw edges from anchors
-    drawEdgesFromAnchorsKernel<<<gridSize, blockSize>>>(
-        d_gradient, d_direction, d_anchor, d_edge, width, height);
+    // Step 3: Draw edges from anchors
+    traceEdgesGPU(d_gradient, d_direction, d_anchor, d_edge, width, height,
+                  gridSize, blockSize);
 
     // Free device memory
     cudaFree(d_gradient);
@@ -583,5 +694,45 @@ CImg edgeDrawGPUCombined(CImg &image) {
     CImg edge(width, height, 1, 1, 0);
     cudaMemcpy(edge.data(), d_edge, grayImageSize, cudaMemcpyDeviceToHost);
     cudaFree(d_edge);
+    TRACE_COUNTER("edgePixels", edge.size() - std::count(edge.begin(),
+                                                         edge.end(), 0));
+    return edge;
+}
+
+CImg edgeDrawGPU(CImg &image, int method, const EdgeDrawParams &params) {
+    TRACE_SCOPE("edgeDrawGPU");
+    setEdgeDrawParamsGPU(params);
+
+    // Create a new image to store the edge
+    CImg gradient(image.width(), image.height());
+    CImgFloat direction(image.width(), image.height());
+
+    // Calculate gradient magnitude for each pixel
+    {
+        TRACE_SCOPE("gradient");
+        gradientInGrayGPU(image, gradient, direction);
+    }
+    {
+        TRACE_SCOPE("suppress");
+        suppressWeakGradientsGPU(gradient);
+    }
+
+    CImg edge(image.width(), image.height(), 1, 1, 0);
+    CImgBool anchor(image.width(), image.height(), 1, 1, false);
+
+    // Find anchors and draw edges from anchors
+    {
+        TRACE_SCOPE("anchors");
+        determineAnchorsGPU(gradient, direction, anchor);
+    }
+    {
+        TRACE_SCOPE("edges");
+        drawEdgesFromAnchorsGPU(gradient, direction, anchor, edge);
+    }
+    TRACE_COUNTER("anchorCount",
+                  std::count(anchor.begin(), anchor.end(), true));
+    TRACE_COUNTER("edgePixels", edge.size() - std::count(edge.begin(),
+                                                         edge.end(), 0));
+
     return edge;
-}
\ No newline at end of file
+}
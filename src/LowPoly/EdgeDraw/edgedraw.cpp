@@ -1,35 +1,50 @@
 #include "edgedraw.h"
 
-#include <chrono>
+#include <algorithm>
 #include <iostream>
+#include <vector>
+
+#include "processing.h"
+#include "trace.h"
 
 using namespace std;
 
+/**
+ * Set the weak gradients of a row to zero. Every byte is stored so that the
+ * loop vectorizes.
+ * @param gradient The gradient row.
+ * @param width Width of the row.
+ * @param threshold Gradients at or below this value are set to zero.
+ */
+static void suppressRow(unsigned char *gradient, int width,
+                        unsigned char threshold) {
+    for (int x = 0; x < width; ++x) {
+        gradient[x] = gradient[x] > threshold ? gradient[x] : 0;
+    }
+}
+
 /**
  * Suppress weak gradients in the image by setting pixels below a certain
  * threshold to zero.
  * @param gradient The gradient image where the suppression is applied.
+ * @param threshold Gradients at or below this value are set to zero.
  */
-void suppressWeakGradients(CImg &gradient) {
-    cimg_forXY(gradient, x, y) {
-        if (gradient(x, y) <= GRADIENT_THRESH) {
-            gradient(x, y) = 0;
+void suppressWeakGradients(CImg &gradient, unsigned char threshold) {
+    TRACE_SCOPE("suppress");
+    parallelFor(0, gradient.height(), [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            suppressRow(gradient.data(0, y), gradient.width(), threshold);
         }
-    }
+    });
 }
 
 /**
- * Check if the gradient direction at a pixel is approximately horizontal.
- * @param angle The angle of the gradient.
+ * Check if the gradient direction at a pixel is approximately horizontal,
+ * within 45 degrees of the x axis.
+ * @param bin The direction bin of the gradient.
  * @return Returns 1 if horizontal, otherwise 0.
  */
-bool isHorizontal(float angle) {
-    if (angle < 45 && angle >= -45 || angle >= 136 || angle < -135) {
-        return true;  // horizontal
-    } else {
-        return false;
-    }
-}
+bool isHorizontal(unsigned char bin) { return bin < 2 || bin >= 6; }
 
 /**
  * Validate if coordinates (x, y) are within the image bounds.
@@ -44,202 +59,398 @@ bool valid(int x, int y, int width, int height) {
 }
 
 /**
- * Determine and mark anchor points in the image based on gradient magnitude and
- * direction.
+ * List the anchors of every band strongest first, with a counting sort on the
+ * 256 magnitudes. Anchors of equal magnitude stay in scan order.
+ * @param bands Anchors of every band of rows, in scan order.
  * @param gradient The gradient magnitudes.
- * @param direction The gradient directions.
- * @param anchors Binary image to mark anchors.
+ * @return The anchors, by decreasing gradient magnitude.
  */
-void determineAnchors(const CImg &gradient, const CImgFloat &direction,
-                      CImgBool &anchor) {
-    cimg_forXY(anchor, x, y) {
-        // If the pixel is not at the edge of the image
-        anchor(x, y) = false;
-        if (x > 0 && x < anchor.width() - 1 && y > 0 &&
-            y < anchor.height() - 1) {
-            float angle = direction(x, y);  // Get the continuous angle
-            int magnitude = gradient(x, y);
-            int mag1 = 0, mag2 = 0;
-
-            if (isHorizontal(angle)) {
-                mag1 = gradient(x, y - 1);
-                mag2 = gradient(x, y + 1);
-            } else {
-                mag1 = gradient(x - 1, y);
-                mag2 = gradient(x + 1, y);
-            }
-
-            // Retain pixel if its magnitude is greater than its neighbors
-            // along the gradient direction
-            if (magnitude - mag1 >= ANCHOR_THRESH &&
-                magnitude - mag2 >= ANCHOR_THRESH) {
-                anchor(x, y) = true;  // This pixel is a local maximum
-            }
+static std::vector<Anchor> sortAnchors(
+    const std::vector<std::vector<Anchor>> &bands, const CImg &gradient) {
+    // Bin 0 holds the strongest anchors
+    std::vector<size_t> binStart(257, 0);
+    for (const std::vector<Anchor> &band : bands) {
+        for (const Anchor &anchor : band) {
+            binStart[256 - gradient(anchor.x, anchor.y)]++;
+        }
+    }
+    for (int bin = 0; bin < 256; bin++) {
+        binStart[bin + 1] += binStart[bin];
+    }
+    std::vector<Anchor> anchors(binStart[256]);
+    for (const std::vector<Anchor> &band : bands) {
+        for (const Anchor &anchor : band) {
+            anchors[binStart[255 - gradient(anchor.x, anchor.y)]++] = anchor;
         }
     }
+    TRACE_COUNTER("anchorCount", anchors.size());
+    return anchors;
 }
 
 /**
- * Draw horizontal edges from an anchor which direction is horizontal
- * @param x X-coordinate of the anchor.
- * @param y Y-coordinate of the anchor.
- * @param gradient The gradient image.
- * @param direction The gradient directions.
- * @param edge Binary image to mark edges.
+ * Determine anchor points based on gradient magnitude and direction, and list
+ * them strongest first with a counting sort on the 256 magnitudes, so that the
+ * strongest edges are drawn first. Anchors of equal magnitude stay in scan
+ * order. Pixels without gradient are never anchors since no edge starts
+ * there.
+ * @param gradient The gradient magnitudes.
+ * @param direction The gradient direction bins.
+ * @param threshold Margin an anchor must have over both its neighbors.
+ * @return The anchors, by decreasing gradient magnitude.
  */
-void drawHorizontalEdgeFromAnchor(int x, int y, const CImg &gradient,
-                                  const CImgFloat &direction, CImg &edge,
-                                  int pickCtr) {
-    int width = gradient.width();
-    int height = gradient.height();
-    if (!valid(x, y, width, height) || edge(x, y)) return;
+std::vector<Anchor> determineAnchors(const CImg &gradient,
+                                     const CImg &direction, int threshold) {
+    TRACE_SCOPE("anchors");
+    const int width = gradient.width(), height = gradient.height();
+    const int bandRows = 16;
+    const int numBands = (height + bandRows - 1) / bandRows;
+
+    const int simdLevel = detectSimdLevel();
+
+    // Anchors of every band of rows, in scan order
+    std::vector<std::vector<Anchor>> bands(numBands);
+    parallelFor(0, numBands, [&](int bandBegin, int bandEnd) {
+        AnchorRow kernel(width, threshold, simdLevel);
+        const unsigned char *rows[3];
+        for (int b = bandBegin; b < bandEnd; b++) {
+            int rowBegin = std::max(b * bandRows, 1);
+            int rowEnd = std::min((b + 1) * bandRows, height - 1);
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                for (int k = 0; k < 3; k++) {
+                    rows[k] = gradient.data(0, y - 1 + k);
+                }
+                kernel.find(rows, direction.data(0, y), y, bands[b]);
+            }
+        }
+    });
+    return sortAnchors(bands, gradient);
+}
 
-    int initPickCtr = pickCtr;
+/**
+ * Compute the gradient, drop weak gradients and find the anchors in one pass,
+ * the same as gradientInGray or gradientInColor followed by
+ * suppressWeakGradients and determineAnchors. Every strip of rows streams its
+ * gray rows through a window of three rows and its gradient rows into the
+ * output, and tests the anchors of a row as soon as the row below is ready,
+ * while the rows are still in cache. No gray image is stored. The rows just
+ * outside of a strip are computed again into scratch rows instead of waiting
+ * for the strip that owns them.
+ * @param image Image, RGB or grayscale.
+ * @param gradient Receives the suppressed gradient magnitudes, zero on the
+ * image border.
+ * @param direction Receives the gradient direction bins, zero on the image
+ * border.
+ * @param method 0 for the gray gradient, 1 for the color gradient.
+ * @param params Gradient operator and magnitude, gradient and anchor
+ * thresholds.
+ * @return The anchors, by decreasing gradient magnitude.
+ */
+std::vector<Anchor> gradientAnchors(CImg &image, CImg &gradient,
+                                    CImg &direction, int method,
+                                    const EdgeDrawParams &params) {
+    TRACE_SCOPE("gradientAnchors");
+    const int width = image.width(), height = image.height();
+    const bool color = method == 1 && image.spectrum() >= 3;
+    const bool convert = !color && image.spectrum() != 1;
+    const int simdLevel = detectSimdLevel();
+    const int bandRows = 16;
+    const int numBands = (height + bandRows - 1) / bandRows;
+
+    std::vector<std::vector<Anchor>> bands(numBands);
+    parallelFor(0, numBands, [&](int bandBegin, int bandEnd) {
+        GradientRow grayKernel(width, params.gradientOperator,
+                               params.magnitude, simdLevel);
+        ColorGradientRow colorKernel(width, params.gradientOperator,
+                                     simdLevel);
+        AnchorRow anchorKernel(width, params.anchorThresh, simdLevel);
+        std::vector<unsigned char> scratch(3 * size_t(width));
+        unsigned char *above = scratch.data();
+        unsigned char *below = above + width;
+        unsigned char *scratchDirection = below + width;
+        std::vector<unsigned char> gray(convert ? 3 * size_t(width) : 0);
+        int nextGray = std::max(bandBegin * bandRows - 2, 0);
+
+        // Suppressed gradient of row y, zero on the image border
+        auto computeRow = [&](int y, unsigned char *out, unsigned char *bins) {
+            if (y == 0 || y == height - 1) {
+                std::fill(out, out + width, 0);
+                std::fill(bins, bins + width, 0);
+                return;
+            }
+            const unsigned char *rows[9];
+            if (color) {
+                for (int c = 0; c < 3; c++) {
+                    for (int k = 0; k < 3; k++) {
+                        rows[3 * c + k] = image.data(0, y - 1 + k, 0, c);
+                    }
+                }
+                colorKernel.compute(rows, out, bins);
+            } else if (convert) {
+                // Gray rows up to y + 1, each replacing the row three above
+                for (; nextGray <= y + 1; nextGray++) {
+                    convertRowToGray(image.data(0, nextGray, 0, 0),
+                                     image.data(0, nextGray, 0, 1),
+                                     image.data(0, nextGray, 0, 2),
+                                     gray.data() + (nextGray % 3) * width,
+                                     width);
+                }
+                for (int k = 0; k < 3; k++) {
+                    rows[k] = gray.data() + ((y - 1 + k) % 3) * width;
+                }
+                grayKernel.compute(rows, out, bins);
+            } else {
+                for (int k = 0; k < 3; k++) {
+                    rows[k] = image.data(0, y - 1 + k);
+                }
+                grayKernel.compute(rows, out, bins);
+            }
+            out[0] = out[width - 1] = 0;
+            bins[0] = bins[width - 1] = 0;
+            suppressRow(out, width, params.gradientThresh);
+        };
 
-    int curr_x = x;
-    int curr_y = y;
-    edge(x, y) = 0;
-    while (valid(curr_x, curr_y, width, height) &&
-           gradient(curr_x, curr_y) > 0 && !edge(curr_x, curr_y) &&
-           isHorizontal(direction(curr_x, curr_y))) {
-        edge(curr_x, curr_y) = 255;
-        if (pickCtr % 8 == 0) {
-            edge(curr_x, curr_y) = 254;
+        int rowBegin = bandBegin * bandRows;
+        int rowEnd = std::min(bandEnd * bandRows, height);
+        auto gradientRow = [&](int y) -> const unsigned char * {
+            if (y < rowBegin) return above;
+            if (y >= rowEnd) return below;
+            return gradient.data(0, y);
         };
-        unsigned char leftUp = gradient(curr_x - 1, curr_y - 1);
-        unsigned char left = gradient(curr_x - 1, curr_y);
-        unsigned char leftDown = gradient(curr_x - 1, curr_y + 1);
-        // Move to the pixel with the highest gradient value
-        if (leftUp > left && leftUp > leftDown) {
-            curr_x -= 1;
-            curr_y -= 1;  // Move up-left
-        } else if (leftDown > left && leftDown > leftUp) {
-            curr_x -= 1;
-            curr_y += 1;  // Move down-left
-        } else {
-            curr_x -= 1;  // Move straight-left
+        auto findAnchors = [&](int y) {
+            if (y < std::max(rowBegin, 1) || y > height - 2) return;
+            const unsigned char *rows[3] = {gradientRow(y - 1), gradientRow(y),
+                                            gradientRow(y + 1)};
+            anchorKernel.find(rows, direction.data(0, y), y,
+                              bands[y / bandRows]);
+        };
+
+        if (rowBegin > 0) computeRow(rowBegin - 1, above, scratchDirection);
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            computeRow(y, gradient.data(0, y), direction.data(0, y));
+            findAnchors(y - 1);
         }
-        pickCtr += 1;
+        if (rowEnd < height) computeRow(rowEnd, below, scratchDirection);
+        findAnchors(rowEnd - 1);
+    });
+    return sortAnchors(bands, gradient);
+}
+
+/**
+ * Remove every chain
+ */
+void EdgeChains::clear() {
+    points.clear();
+    offsets.assign(1, 0);
+    firstPickCtr.clear();
+}
+
+/**
+ * Add the chains of another set after the chains of this one
+ * @param other The chains to add.
+ */
+void EdgeChains::append(const EdgeChains &other) {
+    int base = static_cast<int>(points.size());
+    points.insert(points.end(), other.points.begin(), other.points.end());
+    for (size_t i = 1; i < other.offsets.size(); i++) {
+        offsets.push_back(base + other.offsets[i]);
     }
-    drawEdgesFromAnchor(curr_x, curr_y, gradient, direction, edge, false,
-                        pickCtr);
+    firstPickCtr.insert(firstPickCtr.end(), other.firstPickCtr.begin(),
+                        other.firstPickCtr.end());
+}
 
-    pickCtr = initPickCtr;
-    curr_x = x;
-    curr_y = y;
-    edge(x, y) = 0;
-    while (valid(curr_x, curr_y, width, height) &&
-           gradient(curr_x, curr_y) > 0 && !edge(curr_x, curr_y) &&
-           isHorizontal(direction(curr_x, curr_y))) {
-        edge(curr_x, curr_y) = 255;
-        if (pickCtr % 8 == 0) {
-            edge(curr_x, curr_y) = 254;
-        };
-        unsigned char rightUp = gradient(curr_x - 1, curr_y - 1);
-        unsigned char right = gradient(curr_x - 1, curr_y);
-        unsigned char rightDown = gradient(curr_x - 1, curr_y + 1);
-        // Move to the pixel with the highest gradient value
-        if (rightUp > right && rightUp > rightDown) {
-            curr_x += 1;
-            curr_y -= 1;  // Move up-right
-        } else if (rightDown > right && rightDown > rightUp) {
-            curr_x += 1;
-            curr_y += 1;  // Move down-right
-        } else {
-            curr_x += 1;  // Move straight-right
-        }
-        pickCtr += 1;
+// Rectangle [x0, x1) x [y0, y1) of pixels drawn by a single thread
+struct EdgeTile {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+
+    bool contains(int x, int y) const {
+        return x >= x0 && x < x1 && y >= y0 && y < y1;
+    }
+};
+
+/**
+ * Queue the two walks of an edge through a point, left and right for a
+ * horizontal edge, up and down for a vertical one. The second walk is pushed
+ * first so that it waits until every edge branching from the first walk is
+ * drawn.
+ * @param x X-coordinate of the point.
+ * @param y Y-coordinate of the point.
+ * @param horizontal Whether the edge through the point is horizontal.
+ * @param pickCtr Number of edge pixels drawn before the point.
+ * @param gradient The gradient image.
+ * @param edge Binary image to mark edges.
+ * @param stack Walks waiting to be traced.
+ */
+static void pushWalks(int x, int y, bool horizontal, int pickCtr,
+                      const CImg &gradient, const CImg &edge,
+                      std::vector<TraceFrame> &stack) {
+    if (!valid(x, y, gradient.width(), gradient.height()) ||
+        gradient(x, y) <= 0 || edge(x, y)) {
+        return;
+    }
+    if (horizontal) {
+        stack.push_back(TraceFrame{x, y, WALK_RIGHT, pickCtr, false});
+        stack.push_back(TraceFrame{x, y, WALK_LEFT, pickCtr, false});
+    } else {
+        stack.push_back(TraceFrame{x, y, WALK_DOWN, pickCtr, false});
+        stack.push_back(TraceFrame{x, y, WALK_UP, pickCtr, false});
     }
-    drawEdgesFromAnchor(curr_x, curr_y, gradient, direction, edge, false,
-                        pickCtr);
 }
 
 /**
- * Draw vertical edges from an anchor which direction is horizontal
- * @param x X-coordinate of the anchor.
- * @param y Y-coordinate of the anchor.
+ * Follow an edge from the start of a walk, stepping to the neighbor with the
+ * highest gradient among the three ahead, while pixels are undrawn and keep
+ * the orientation of the walk. The walks of the perpendicular edge through
+ * the pixel where it stops are then queued. A walk stepping out of its tile
+ * is handed off to be resumed by the tile it enters.
+ * @param frame The walk.
  * @param gradient The gradient image.
- * @param direction The gradient directions.
+ * @param direction The gradient direction bins.
  * @param edge Binary image to mark edges.
+ * @param spacing Every spacing-th edge pixel is marked as a vertex.
+ * @param tile The only pixels this walk may draw.
+ * @param stack Walks waiting to be traced.
+ * @param handoffs Walks leaving the tile.
+ * @param chains Chains of the tile, the pixels drawn are added as a new
+ * chain. May be null.
  */
-void drawVerticalEdgeFromAnchor(int x, int y, const CImg &gradient,
-                                const CImgFloat &direction, CImg &edge,
-                                int pickCtr) {
+static void walkEdge(const TraceFrame &frame, const CImg &gradient,
+                     const CImg &direction, CImg &edge, int spacing,
+                     const EdgeTile &tile, std::vector<TraceFrame> &stack,
+                     std::vector<TraceFrame> &handoffs, EdgeChains *chains) {
     int width = gradient.width();
     int height = gradient.height();
-    if (!valid(x, y, width, height)) return;
-
-    int initPickCtr = pickCtr;
-
-    int curr_x = x;
-    int curr_y = y;
-    edge(x, y) = 0;  // Assuming white edges on a black background
+    bool horizontal = frame.walk == WALK_LEFT || frame.walk == WALK_RIGHT;
+    int step = frame.walk == WALK_LEFT || frame.walk == WALK_UP ? -1 : 1;
+
+    int curr_x = frame.x;
+    int curr_y = frame.y;
+    int pickCtr = frame.pickCtr;
+    // The start is drawn again by the second walk through it, but only the
+    // chain of the first walk holds it
+    bool skipStart = !frame.resume && edge(curr_x, curr_y);
+    if (!frame.resume) edge(curr_x, curr_y) = 0;
+    size_t chainBegin = chains ? chains->points.size() : 0;
+    int chainPickCtr = skipStart ? pickCtr + 1 : pickCtr;
+    auto endChain = [&]() {
+        if (chains && chains->points.size() > chainBegin) {
+            chains->offsets.push_back(static_cast<int>(chains->points.size()));
+            chains->firstPickCtr.push_back(chainPickCtr);
+        }
+    };
 
-    // Trace upwards from the anchor point
     while (valid(curr_x, curr_y, width, height) &&
            gradient(curr_x, curr_y) > 0 && !edge(curr_x, curr_y) &&
-           !isHorizontal(direction(curr_x, curr_y))) {
-        edge(curr_x, curr_y) = 255;  // Mark this pixel as part of an edge
-        if (pickCtr % 8 == 0) {
-            edge(curr_x, curr_y) = 254;
-        };
-        unsigned char upLeft = gradient(curr_x - 1, curr_y - 1);
-        unsigned char up = gradient(curr_x, curr_y - 1);
-        unsigned char upRight = gradient(curr_x + 1, curr_y - 1);
-
-        // Move to the pixel with the highest gradient value above the current
-        // pixel
-        if (upLeft > up && upLeft > upRight) {
-            curr_x -= 1;
-            curr_y -= 1;  // Move top-left
-        } else if (upRight > up && upRight > upLeft) {
-            curr_x += 1;
-            curr_y -= 1;  // Move top-right
+           isHorizontal(direction(curr_x, curr_y)) == horizontal) {
+        edge(curr_x, curr_y) = pickCtr % spacing == 0 ? 254 : 255;
+        if (chains && !skipStart) {
+            chains->points.push_back(EdgePoint{curr_x, curr_y});
+        }
+        skipStart = false;
+
+        // Move to the pixel with the highest gradient value ahead, straight
+        // ahead unless one side is strictly the highest
+        if (horizontal) {
+            int ahead = curr_x + step;
+            unsigned char up = gradient(ahead, curr_y - 1);
+            unsigned char straight = gradient(ahead, curr_y);
+            unsigned char down = gradient(ahead, curr_y + 1);
+            if (up > straight && up > down) {
+                curr_y -= 1;
+            } else if (down > straight && down > up) {
+                curr_y += 1;
+            }
+            curr_x += step;
         } else {
-            curr_y -= 1;  // Move straight up
+            int ahead = curr_y + step;
+            unsigned char left = gradient(curr_x - 1, ahead);
+            unsigned char straight = gradient(curr_x, ahead);
+            unsigned char right = gradient(curr_x + 1, ahead);
+            if (left > straight && left > right) {
+                curr_x -= 1;
+            } else if (right > straight && right > left) {
+                curr_x += 1;
+            }
+            curr_y += step;
         }
         pickCtr++;
+
+        if (!tile.contains(curr_x, curr_y)) {
+            endChain();
+            handoffs.push_back(
+                TraceFrame{curr_x, curr_y, frame.walk, pickCtr, true});
+            return;
+        }
     }
-    drawEdgesFromAnchor(curr_x, curr_y, gradient, direction, edge, true,
-                        pickCtr);
+    endChain();
+    pushWalks(curr_x, curr_y, !horizontal, pickCtr, gradient, edge, stack);
+}
 
-    // Reset to anchor point
-    pickCtr = initPickCtr;
-    curr_x = x;
-    curr_y = y;
-    edge(x, y) = 0;
+/**
+ * Trace the walks on the stack, and every walk they branch into, until the
+ * stack is empty
+ * @param gradient The gradient image.
+ * @param direction The gradient direction bins.
+ * @param edge Binary image to mark edges.
+ * @param spacing Every spacing-th edge pixel is marked as a vertex.
+ * @param tile The only pixels the walks may draw.
+ * @param stack Walks waiting to be traced.
+ * @param handoffs Walks leaving the tile.
+ * @param chains Chains of the tile, may be null.
+ */
+static void traceWalks(const CImg &gradient, const CImg &direction,
+                       CImg &edge, int spacing, const EdgeTile &tile,
+                       std::vector<TraceFrame> &stack,
+                       std::vector<TraceFrame> &handoffs, EdgeChains *chains) {
+    while (!stack.empty()) {
+        TraceFrame frame = stack.back();
+        stack.pop_back();
+        walkEdge(frame, gradient, direction, edge, spacing, tile, stack,
+                 handoffs, chains);
+    }
+}
 
-    // Trace downwards from the anchor point
-    while (valid(curr_x, curr_y, width, height) &&
-           gradient(curr_x, curr_y) > 0 && !edge(curr_x, curr_y) &&
-           !isHorizontal(direction(curr_x, curr_y))) {
-        edge(curr_x, curr_y) = 255;  // Mark this pixel as part of an edge
-        if (pickCtr % 8 == 0) {
-            edge(curr_x, curr_y) = 254;
-        };
-        unsigned char downLeft = gradient(curr_x - 1, curr_y + 1);
-        unsigned char down = gradient(curr_x, curr_y + 1);
-        unsigned char downRight = gradient(curr_x + 1, curr_y + 1);
-
-        // Move to the pixel with the highest gradient value below the current
-        // pixel
-        if (downLeft > down && downLeft > downRight) {
-            curr_x -= 1;
-            curr_y += 1;  // Move bottom-left
-        } else if (downRight > down && downRight > downLeft) {
-            curr_x += 1;
-            curr_y += 1;  // Move bottom-right
-        } else {
-            curr_y += 1;  // Move straight down
-        }
-        pickCtr += 1;
+/**
+ * One round of edge drawing in a tile: trace from its anchors in the first
+ * round, then resume the walks handed off to it
+ * @param tile The only pixels the walks may draw.
+ * @param anchorBegin First anchor of the tile, in the first round only.
+ * @param anchorEnd End of the anchors of the tile.
+ * @param resumed Walks handed off to the tile in the previous round.
+ * @param gradient The gradient image.
+ * @param direction The gradient direction bins.
+ * @param edge Binary image to mark edges.
+ * @param spacing Every spacing-th edge pixel is marked as a vertex.
+ * @param handoffs Walks leaving the tile.
+ * @param chains Chains of the tile, may be null.
+ */
+static void traceTile(const EdgeTile &tile, const Anchor *anchorBegin,
+                      const Anchor *anchorEnd,
+                      const std::vector<TraceFrame> &resumed,
+                      const CImg &gradient, const CImg &direction, CImg &edge,
+                      int spacing, std::vector<TraceFrame> &handoffs,
+                      EdgeChains *chains) {
+    std::vector<TraceFrame> stack;
+    handoffs.clear();
+    // Anchors already covered by earlier edges are skipped by pushWalks
+    for (const Anchor *anchor = anchorBegin; anchor != anchorEnd; anchor++) {
+        pushWalks(anchor->x, anchor->y,
+                  isHorizontal(direction(anchor->x, anchor->y)), 0, gradient,
+                  edge, stack);
+        traceWalks(gradient, direction, edge, spacing, tile, stack, handoffs,
+                   chains);
+    }
+    for (const TraceFrame &frame : resumed) {
+        stack.push_back(frame);
+        traceWalks(gradient, direction, edge, spacing, tile, stack, handoffs,
+                   chains);
     }
-    drawEdgesFromAnchor(curr_x, curr_y, gradient, direction, edge, true,
-                        pickCtr);
 }
 
 /**
- * Recursively draw edge from any an anchor point
+ * Draw the edges from an anchor point
  *
  * Say if anchor point direction is horizontal, then we need to proceed both to
  * the left and to the right. Say if we proceed left first, we keep selecting
@@ -248,131 +459,195 @@ void drawVerticalEdgeFromAnchor(int x, int y, const CImg &gradient,
  * again at this point and both proceed up and down. The procedure continues
  * until we reach a point which either has 0 gradient or is an edge point.
  *
+ * Pending walks are kept on an explicit stack on the heap rather than the call
+ * stack, so its size follows the number of open branches, not the recursion
+ * limits of the thread.
+ *
  * @param x The anchor point X-Coordinate
  * @param y The anchor point Y-Coordinate
  * @param gradient The gradient image.
- * @param direction The gradient directions.
+ * @param direction The gradient direction bins.
  * @param edge Binary image waiting for edges to be marked as true.
+ * @param isHorizontal Whether the edge through the anchor is horizontal.
+ * @param pickCtr Number of edge pixels drawn before this point.
+ * @param spacing Every spacing-th edge pixel is marked as a vertex.
  */
 void drawEdgesFromAnchor(int x, int y, const CImg &gradient,
-                         const CImgFloat &direction, CImg &edge,
-                         const bool isHorizontal, int pickCtr) {
-    // Check recursion base condition
-    if (!valid(x, y, gradient.width(), gradient.height()) ||
-        gradient(x, y) <= 0 || edge(x, y)) {
-        return;
-    }
-
-    if (isHorizontal) {
-        drawHorizontalEdgeFromAnchor(x, y, gradient, direction, edge, pickCtr);
-    } else {
-        drawVerticalEdgeFromAnchor(x, y, gradient, direction, edge, pickCtr);
-    }
+                         const CImg &direction, CImg &edge,
+                         const bool isHorizontal, int pickCtr, int spacing) {
+    EdgeTile image{0, 0, gradient.width(), gradient.height()};
+    std::vector<TraceFrame> stack, handoffs;
+    pushWalks(x, y, isHorizontal, pickCtr, gradient, edge, stack);
+    traceWalks(gradient, direction, edge, spacing, image, stack, handoffs,
+               nullptr);
 }
 
 /**
- * Initiate edge drawing from any anchor points.
+ * Initiate edge drawing from any anchor points, in parallel over square
+ * tiles of EDGE_TILE_SIZE pixels. Every tile traces its anchors in the order
+ * of the list, strongest first, and draws only its own pixels, so no pixel is
+ * drawn by two threads. Walks leaving a tile are handed off at the seam and
+ * resumed by the tile they enter in the next round, with the same vertex
+ * count, until no walk is left. Rounds resume the walks in a fixed order, so
+ * the edges do not depend on the number of threads.
+ *
+ * Every walk also adds the pixels it draws as a chain of its tile. A walk
+ * resumed at a seam starts a new chain. The chains are gathered tile by tile,
+ * so their order does not depend on the number of threads either.
+ *
  * @param gradient The gradient image.
- * @param direction The gradient directions.
- * @param anchors Binary image with only anchor points set to true.
+ * @param direction The gradient direction bins.
+ * @param anchors Anchor points, see determineAnchors.
  * @param edge Binary image waiting for edges to be marked as true.
+ * @param spacing Every spacing-th edge pixel is marked as a vertex.
+ * @param chains Receives the edges as chains of pixels if not null.
  */
-void drawEdgesFromAnchors(const CImg &gradient, const CImgFloat &direction,
-                          const CImgBool &anchors, CImg &edge) {
-    cimg_forXY(anchors, x, y) {
-        if (anchors(x, y)) {
-            drawEdgesFromAnchor(x, y, gradient, direction, edge,
-                                isHorizontal(direction(x, y)), 0);
+void drawEdgesFromAnchors(const CImg &gradient, const CImg &direction,
+                          const std::vector<Anchor> &anchors, CImg &edge,
+                          int spacing, EdgeChains *chains) {
+    TRACE_SCOPE("edges");
+    int width = gradient.width();
+    int height = gradient.height();
+    int tilesX = (width + EDGE_TILE_SIZE - 1) / EDGE_TILE_SIZE;
+    int tilesY = (height + EDGE_TILE_SIZE - 1) / EDGE_TILE_SIZE;
+    int numTiles = tilesX * tilesY;
+    auto tileOf = [&](int x, int y) {
+        return (y / EDGE_TILE_SIZE) * tilesX + x / EDGE_TILE_SIZE;
+    };
+
+    // Group the anchors by tile, keeping their order
+    std::vector<size_t> tileStart(numTiles + 1, 0);
+    for (const Anchor &anchor : anchors) {
+        tileStart[tileOf(anchor.x, anchor.y) + 1]++;
+    }
+    for (int t = 0; t < numTiles; t++) {
+        tileStart[t + 1] += tileStart[t];
+    }
+    std::vector<Anchor> tileAnchors(anchors.size());
+    {
+        std::vector<size_t> next(tileStart.begin(), tileStart.end() - 1);
+        for (const Anchor &anchor : anchors) {
+            tileAnchors[next[tileOf(anchor.x, anchor.y)]++] = anchor;
+        }
+    }
+
+    // Walks resumed by every tile in the current round, and walks handed
+    // off by every tile during it
+    std::vector<std::vector<TraceFrame>> resumed(numTiles), handoffs(numTiles);
+    std::vector<EdgeChains> tileChains(chains ? numTiles : 0);
+    long long totalHandoffs = 0;
+    bool firstRound = true;
+    bool pending;
+    do {
+        parallelFor(0, numTiles, [&](int tileBegin, int tileEnd) {
+            for (int t = tileBegin; t < tileEnd; t++) {
+                int x0 = (t % tilesX) * EDGE_TILE_SIZE;
+                int y0 = (t / tilesX) * EDGE_TILE_SIZE;
+                EdgeTile tile{x0, y0, std::min(x0 + EDGE_TILE_SIZE, width),
+                              std::min(y0 + EDGE_TILE_SIZE, height)};
+                const Anchor *first = tileAnchors.data() + tileStart[t];
+                const Anchor *last = tileAnchors.data() + tileStart[t + 1];
+                traceTile(tile, firstRound ? first : last, last, resumed[t],
+                          gradient, direction, edge, spacing, handoffs[t],
+                          chains ? &tileChains[t] : nullptr);
+            }
+        });
+
+        // Route the handed off walks to their tiles, in tile order
+        pending = false;
+        for (std::vector<TraceFrame> &frames : resumed) frames.clear();
+        for (const std::vector<TraceFrame> &frames : handoffs) {
+            for (const TraceFrame &frame : frames) {
+                resumed[tileOf(frame.x, frame.y)].push_back(frame);
+                pending = true;
+            }
+            totalHandoffs += frames.size();
         }
+        firstRound = false;
+    } while (pending);
+
+    if (chains) {
+        chains->clear();
+        for (const EdgeChains &tile : tileChains) chains->append(tile);
+        TRACE_COUNTER("edgeChains", chains->size());
     }
+
+    TRACE_COUNTER("seamHandoffs", totalHandoffs);
+    TRACE_COUNTER("edgePixels", edge.size() - std::count(edge.begin(),
+                                                         edge.end(), 0));
 }
 
 /**
- * Main function to perform edge detection on an image.
- * @param image Input image.
- * @param method Method to compute the gradient (0 for grayscale, 1 for color).
+ * Drop weak gradients, find anchors and draw edges from them.
+ * @param gradient The gradient image, weak gradients are set to zero.
+ * @param direction The gradient direction bins.
+ * @param params Thresholds and vertex spacing of the edge drawing.
+ * @param chains Receives the edges as chains of pixels if not null.
  * @return Image containing edges.
  */
-CImg edgeDraw(CImg &image, int method) {
-    // Create a new image to store the edge
-    CImg gradient(image.width(), image.height());
-    CImgFloat direction(image.width(), image.height());
-
-    // Calculate gradient magnitude for each pixel
-    // auto start = chrono::high_resolution_clock::now();
-    gradientInGray(image, gradient, direction);
-    // auto end = chrono::high_resolution_clock::now();
-    // auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    // cout << "Time Gray+Gradient CPU: " << duration.count() << " microseconds"
-    //      << endl;
-
-    // start = chrono::high_resolution_clock::now();
-    suppressWeakGradients(gradient);
-    // end = chrono::high_resolution_clock::now();
-    // duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    // cout << "Time Suppress CPU: " << duration.count() << " microseconds"
-    //      << endl;
+static CImg drawEdgesFromGradient(CImg &gradient, const CImg &direction,
+                                  const EdgeDrawParams &params,
+                                  EdgeChains *chains) {
+    suppressWeakGradients(gradient, params.gradientThresh);
 
-    CImg edge(image.width(), image.height(), 1, 1, 0);
-    CImgBool anchor(image.width(), image.height(), 1, 1, false);
+    CImg edge(gradient.width(), gradient.height(), 1, 1, 0);
 
     // Find anchors and draw edges from anchors
-    // start = chrono::high_resolution_clock::now();
-    determineAnchors(gradient, direction, anchor);
-    // end = chrono::high_resolution_clock::now();
-    // duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    // cout << "Time Anchors CPU: " << duration.count() << " microseconds" <<
-    // endl;
-
-    // start = chrono::high_resolution_clock::now();
-    drawEdgesFromAnchors(gradient, direction, anchor, edge);
-    // end = chrono::high_resolution_clock::now();
-    // duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    // cout << "Time Edges CPU: " << duration.count() << " microseconds" <<
-    // endl;
-
-    // return edge;
+    std::vector<Anchor> anchors =
+        determineAnchors(gradient, direction, params.anchorThresh);
+    drawEdgesFromAnchors(gradient, direction, anchors, edge,
+                         params.vertexSpacing, chains);
+
     return edge;
 }
 
-CImg edgeDrawGPU(CImg &image, int method) {
-    // Create a new image to store the edge
+/**
+ * Main function to perform edge detection on an image.
+ * @param image Input image, RGB or already converted to grayscale.
+ * @param method Method to compute the gradient (0 for grayscale, 1 for color,
+ * see gradientInColor).
+ * @param params Gradient operator, thresholds and vertex spacing of the edge
+ * drawing.
+ * @param chains Receives the edges as chains of pixels if not null, see
+ * drawEdgesFromAnchors.
+ * @return Image containing edges.
+ */
+CImg edgeDraw(CImg &image, int method, const EdgeDrawParams &params,
+              EdgeChains *chains) {
+    TRACE_SCOPE("edgeDraw");
+
+    // The fused pass writes every pixel, the border included
     CImg gradient(image.width(), image.height());
-    CImgFloat direction(image.width(), image.height());
-
-    // Calculate gradient magnitude for each pixel
-    // auto start = chrono::high_resolution_clock::now();
-    gradientInGrayGPU(image, gradient, direction);
-    // auto end = chrono::high_resolution_clock::now();
-    // auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    // cout << "Time Gray+Gradient GPU: " << duration.count() << " microseconds"
-    //      << endl;
-
-    // start = chrono::high_resolution_clock::now();
-    suppressWeakGradientsGPU(gradient);
-    // end = chrono::high_resolution_clock::now();
-    // duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    // cout << "Time Suppress GPU: " << duration.count() << " microseconds"
-    //      << endl;
+    CImg direction(image.width(), image.height());
 
+    // Calculate the suppressed gradient and find anchors in one pass, then
+    // draw edges from anchors
+    std::vector<Anchor> anchors =
+        gradientAnchors(image, gradient, direction, method, params);
     CImg edge(image.width(), image.height(), 1, 1, 0);
-    CImgBool anchor(image.width(), image.height(), 1, 1, false);
-
-    // Find anchors and draw edges from anchors
-    // start = chrono::high_resolution_clock::now();
-    determineAnchorsGPU(gradient, direction, anchor);
-    // end = chrono::high_resolution_clock::now();
-    // duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    // cout << "Time Anchors GPU: " << duration.count() << " microseconds" <<
-    // endl;
-
-    // start = chrono::high_resolution_clock::now();
-    drawEdgesFromAnchorsGPU(gradient, direction, anchor, edge);
-    // end = chrono::high_resolution_clock::now();
-    // duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    // cout << "Time Edges GPU: " << duration.count() << " microseconds" <<
-    // endl;
-
-    // return edge;
+    drawEdgesFromAnchors(gradient, direction, anchors, edge,
+                         params.vertexSpacing, chains);
     return edge;
 }
+
+/**
+ * Edge detection on an unblurred image, with the blur fused into the
+ * gradient computation (see blurredGradientInGray).
+ * @param image Input image, RGB or grayscale, not blurred.
+ * @param sigma Standard deviation of the Gaussian blur.
+ * @param params Gradient operator, thresholds and vertex spacing of the edge
+ * drawing.
+ * @param chains Receives the edges as chains of pixels if not null, see
+ * drawEdgesFromAnchors.
+ * @return Image containing edges.
+ */
+CImg edgeDrawFused(const CImg &image, double sigma,
+                   const EdgeDrawParams &params, EdgeChains *chains) {
+    TRACE_SCOPE("edgeDraw");
+
+    CImg gradient(image.width(), image.height());
+    CImg direction(image.width(), image.height());
+    blurredGradientInGray(image, gradient, direction, sigma,
+                          params.gradientOperator, params.magnitude);
+    return drawEdgesFromGradient(gradient, direction, params, chains);
+}
@@ -1,10 +1,14 @@
 #ifndef EDGE_DRAW_H
 #define EDGE_DRAW_H
 
+#include <stdint.h>
+
 #include <chrono>
 #include <iostream>
+#include <vector>
 
 #include "CImg.h"
+#include "gaussianblur.h"
 
 using CImg = cimg_library::CImg<unsigned char>;
 using CImgBool = cimg_library::CImg<bool>;
@@ -12,46 +16,222 @@ using CImgFloat = cimg_library::CImg<float>;
 
 const int ANCHOR_THRESH = 10;
 const unsigned char GRADIENT_THRESH = 30;
+const int VERTEX_SPACING = 8;
+// Side of the square tiles traced in parallel by drawEdgesFromAnchors
+const int EDGE_TILE_SIZE = 256;
 
 const int smallBlockLength = 1;
 
+// Gradient directions are stored as one of 8 bins of 22.5 degrees covering
+// the half turn of atan2(gradientY, gradientX), opposite directions sharing a
+// bin. Bins are found by comparing |gradientX| and |gradientY| and their
+// signs, tan(22.5) being taken as 13573 / 32768.
+const int DIRECTION_BINS = 8;
+const int TAN_22_5_Q15 = 13573;
+
+inline unsigned char directionBin(int gradientX, int gradientY) {
+    // Fold the angle onto [0, 180)
+    if (gradientY < 0 || (gradientY == 0 && gradientX < 0)) {
+        gradientX = -gradientX;
+        gradientY = -gradientY;
+    }
+    int absX = gradientX < 0 ? -gradientX : gradientX;
+
+    // Bin of the angle to the x axis in [0, 90]
+    int bin;
+    if (gradientY * 32768 < TAN_22_5_Q15 * absX) {
+        bin = 0;
+    } else if (gradientY < absX) {
+        bin = 1;
+    } else if (absX * 32768 > TAN_22_5_Q15 * gradientY) {
+        bin = 2;
+    } else {
+        bin = 3;
+    }
+    return static_cast<unsigned char>(gradientX >= 0 ? bin : 7 - bin);
+}
+
 struct gradientResp {
     unsigned char mag;  // magnitude of gradient
-    float dir;          // direction of the gradient
+    unsigned char dir;  // direction bin of the gradient
+
+    gradientResp(unsigned char _mag, unsigned char _dir)
+        : mag(_mag), dir(_dir) {}
+};
+
+// 3x3 derivative operators, Scharr magnitudes are scaled to the Sobel range
+const int GRADIENT_SOBEL = 0;
+const int GRADIENT_SCHARR = 1;
+
+// Gradient magnitude formulas
+const int MAGNITUDE_EXACT = 0;               // sqrt(gx^2 + gy^2)
+const int MAGNITUDE_L1 = 1;                  // |gx| + |gy|
+const int MAGNITUDE_ALPHA_MAX_BETA_MIN = 2;  // within 6.25% of exact
+
+// Gradient of a row from the rows around it, vectorized with the chosen
+// instruction set. Every SIMD level computes the same bytes.
+class GradientRow {
+   public:
+    GradientRow(int width, int op, int magnitude, int simdLevel);
+    void compute(const unsigned char *const *rows, unsigned char *gradient,
+                 unsigned char *direction) const;
+
+   private:
+    int width;
+    int16_t weights[2];  // edge and center weights of the operator
+    int magnitude;
+    int shift;  // right shift of the magnitude
+    void (*row)(const unsigned char *const *rows, unsigned char *gradient,
+                unsigned char *direction, int width, const int16_t *weights,
+                int magnitude, int shift);
+};
+
+// Di Zenzo gradient of a row of a three channel image: the magnitude and
+// direction of the largest eigenvalue of the structure tensor summed over
+// the channels, from one pass over the three planes. Magnitudes are scaled
+// so that a gray image gives the gray gradient.
+class ColorGradientRow {
+   public:
+    ColorGradientRow(int width, int op, int simdLevel);
+    void compute(const unsigned char *const *rows, unsigned char *gradient,
+                 unsigned char *direction) const;
+
+   private:
+    int width;
+    int16_t weights[2];  // edge and center weights of the operator
+    int shift;           // right shift of the magnitude
+    void (*row)(const unsigned char *const *rows, unsigned char *gradient,
+                unsigned char *direction, int width, const int16_t *weights,
+                int shift);
+};
+
+// Anchor pixel, where edge drawing starts
+struct Anchor {
+    int x;
+    int y;
+};
+
+// Anchors of a row of the suppressed gradient, see determineAnchors,
+// vectorized with the chosen instruction set
+class AnchorRow {
+   public:
+    AnchorRow(int width, int threshold, int simdLevel);
+    void find(const unsigned char *const *rows, const unsigned char *direction,
+              int y, std::vector<Anchor> &anchors) const;
+
+   private:
+    int width;
+    int threshold;
+    void (*row)(const unsigned char *const *rows,
+                const unsigned char *direction, int y, int width,
+                int threshold, std::vector<Anchor> &anchors);
+};
 
-    gradientResp(unsigned char _mag, float _dir) : mag(_mag), dir(_dir) {}
+// Walking directions of the edge tracers
+const int WALK_LEFT = 0;
+const int WALK_RIGHT = 1;
+const int WALK_UP = 2;
+const int WALK_DOWN = 3;
+
+// A walk of the edge tracers waiting on their explicit stack
+struct TraceFrame {
+    int x;
+    int y;
+    int walk;     // WALK_LEFT, WALK_RIGHT, WALK_UP or WALK_DOWN
+    int pickCtr;  // number of edge pixels drawn before the start
+    bool resume;  // continues a walk from another tile, start not yet drawn
+};
+
+// Pixel of a traced edge
+struct EdgePoint {
+    int x;
+    int y;
 };
-void gradientInGray(CImg &image, CImg &gradient, CImgFloat &direction);
-void gradientInColor(CImg &image, CImg &gradient, CImgFloat &direction);
+
+// Traced edges as chains of pixels in drawing order, one per walk of the
+// tracer. Chain i is points[offsets[i]] to points[offsets[i + 1] - 1], and
+// its j-th pixel is a vertex (254 in the edge image) when
+// (firstPickCtr[i] + j) % spacing == 0.
+struct EdgeChains {
+    std::vector<EdgePoint> points;
+    std::vector<int> offsets{0};
+    std::vector<int> firstPickCtr;  // vertex count of the first pixel
+
+    int size() const { return static_cast<int>(firstPickCtr.size()); }
+    void clear();
+    void append(const EdgeChains &other);
+};
+
+// Hysteresis thresholds of the Canny edge tracking, found from the histogram
+// of the suppressed gradient
+const int HYSTERESIS_MEAN_STD = 0;  // mean + 2 std and mean + 1 std
+const int HYSTERESIS_OTSU = 1;      // Otsu threshold and half of it
+
+// Tunable parameters of the edge drawing stage
+struct EdgeDrawParams {
+    unsigned char gradientThresh = GRADIENT_THRESH;  // weaker ones are dropped
+    int anchorThresh = ANCHOR_THRESH;  // margin over neighbors for an anchor
+    int vertexSpacing = VERTEX_SPACING;  // every n-th edge pixel is a vertex
+    int gradientOperator = GRADIENT_SOBEL;
+    int magnitude = MAGNITUDE_EXACT;
+};
+
+void convertRowToGray(const unsigned char *red, const unsigned char *green,
+                      const unsigned char *blue, unsigned char *gray,
+                      int width);
+CImg convertToGray(const CImg &image);
+void toRgb(CImg &image);
+// The CPU stages store directions as bins, see directionBin
+void gradientInGray(CImg &image, CImg &gradient, CImg &direction,
+                    int op = GRADIENT_SOBEL, int magnitude = MAGNITUDE_EXACT);
+void blurredGradientInGray(const CImg &image, CImg &gradient, CImg &direction,
+                           double sigma = BLUR_SIGMA, int op = GRADIENT_SOBEL,
+                           int magnitude = MAGNITUDE_EXACT);
+void gradientInColor(CImg &image, CImg &gradient, CImg &direction,
+                     int op = GRADIENT_SOBEL);
 gradientResp calculateGradient(CImg &image, int x, int y);
-void nonMaxSuppression(CImg &edge, CImg &gradient, CImgFloat &direction);
-int discretizeDirection(float angle);
-void trackEdge(CImg &edge);
-void mark(CImg &edge, int x, int y, unsigned char lowThreshold);
+void nonMaxSuppression(CImg &edge, CImg &gradient, CImg &direction);
+bool isHorizontal(unsigned char bin);
+int discretizeDirection(unsigned char bin);
+void trackEdge(CImg &edge, int thresholds = HYSTERESIS_MEAN_STD,
+               int tileSize = 0);
 
+void suppressWeakGradients(CImg &gradient,
+                           unsigned char threshold = GRADIENT_THRESH);
+std::vector<Anchor> determineAnchors(const CImg &gradient,
+                                     const CImg &direction,
+                                     int threshold = ANCHOR_THRESH);
+std::vector<Anchor> gradientAnchors(
+    CImg &image, CImg &gradient, CImg &direction, int method = 0,
+    const EdgeDrawParams &params = EdgeDrawParams());
 void drawEdgesFromAnchor(int x, int y, const CImg &gradient,
-                         const CImgFloat &direction, CImg &edge,
-                         const bool isHorizontal, int pickCtr);
-void drawHorizontalEdgeFromAnchor(int x, int y, const CImg &gradient,
-                                  const CImgFloat &direction, CImg &edge,
-                                  int pickCtr);
-void drawVerticalEdgeFromAnchor(int x, int y, const CImg &gradient,
-                                const CImgFloat &direction, CImg &edge,
-                                int pickCtr);
+                         const CImg &direction, CImg &edge,
+                         const bool isHorizontal, int pickCtr,
+                         int spacing = VERTEX_SPACING);
+void drawEdgesFromAnchors(const CImg &gradient, const CImg &direction,
+                          const std::vector<Anchor> &anchors, CImg &edge,
+                          int spacing = VERTEX_SPACING,
+                          EdgeChains *chains = nullptr);
 CImg extractEdge(CImg &image);
-CImg extractEdgeCanny(CImg &image, int method = 0);
-CImg edgeDraw(CImg &image, int method = 0);
+CImg extractEdgeCanny(CImg &image, int method = 0,
+                      int thresholds = HYSTERESIS_MEAN_STD, int tileSize = 0);
+CImg edgeDraw(CImg &image, int method = 0,
+              const EdgeDrawParams &params = EdgeDrawParams(),
+              EdgeChains *chains = nullptr);
+CImg edgeDrawFused(const CImg &image, double sigma = BLUR_SIGMA,
+                   const EdgeDrawParams &params = EdgeDrawParams(),
+                   EdgeChains *chains = nullptr);
 
-// Functions for edge draw GPU version
+// Functions for edge draw GPU version, directions are angles in degrees
 void gradientInGrayGPU(CImg &image, CImg &gradient, CImgFloat &direction);
 void suppressWeakGradientsGPU(CImg &gradient);
 void determineAnchorsGPU(const CImg &gradient, const CImgFloat &direction,
                          CImgBool &anchor);
 void drawEdgesFromAnchorsGPU(const CImg &gradient, const CImgFloat &direction,
                              const CImgBool &anchors, CImg &edge);
-CImg edgeDrawGPU(CImg &image, int method = 0);
-CImg edgeDrawGPUCombined(CImg &image);
-
-// Functions for Delaunay triangulation
-void pickVertices(CImg &edge);
+void setEdgeDrawParamsGPU(const EdgeDrawParams &params);
+CImg edgeDrawGPU(CImg &image, int method = 0,
+                 const EdgeDrawParams &params = EdgeDrawParams());
+CImg edgeDrawGPUCombined(CImg &image,
+                         const EdgeDrawParams &params = EdgeDrawParams());
 #endif
\ No newline at end of file
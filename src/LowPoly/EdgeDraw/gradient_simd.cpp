@@ -0,0 +1,809 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GRADIENT_X86
+#endif
+
+#include "edgedraw.h"
+#include "processing.h"
+
+// The Scharr weights sum to 16 against 4 for Sobel, its magnitudes are
+// divided by 4 so that the thresholds keep their meaning
+const int SCHARR_SHIFT = 2;
+
+// The float operands of the eigenvalue keep 12 significant bits, so that
+// their squares are exact and fused multiply-adds give the same bytes as
+// separate ones
+const uint32_t TENSOR_MANTISSA_MASK = 0xFFFFF000;
+
+/**
+ * Magnitude of a gradient, saturated to 255. The exact magnitude is taken in
+ * single precision like the vector kernels, which is exact below 256.
+ * @param gradientX response along y
+ * @param gradientY response along x
+ * @param magnitude MAGNITUDE_EXACT, MAGNITUDE_L1 or
+ * MAGNITUDE_ALPHA_MAX_BETA_MIN
+ * @param shift right shift scaling the magnitude
+ */
+static inline unsigned char gradientMagnitude(int gradientX, int gradientY,
+                                              int magnitude, int shift) {
+    int value;
+    if (magnitude == MAGNITUDE_EXACT) {
+        float norm =
+            sqrtf(float(gradientX * gradientX + gradientY * gradientY));
+        value = static_cast<int>(norm * (1.0f / (1 << shift)));
+    } else {
+        int absX = abs(gradientX), absY = abs(gradientY);
+        if (magnitude == MAGNITUDE_L1) {
+            value = absX + absY;
+        } else {
+            // 15/16 max + 15/32 min
+            int high = std::max(absX, absY), low = std::min(absX, absY);
+            value = high - (high >> 4) + (low >> 1) - (low >> 5);
+        }
+        value >>= shift;
+    }
+    return static_cast<unsigned char>(std::min(value, 255));
+}
+
+/**
+ * Gradient of columns [colBegin, width - 1) of the middle row
+ * @param rows the rows above, at and below the output row
+ * @param gradient output magnitudes
+ * @param direction output direction bins
+ * @param colBegin first column, at least 1
+ * @param width width of the rows
+ * @param weights edge and center weights of the operator
+ * @param magnitude magnitude formula
+ * @param shift right shift scaling the magnitude
+ */
+static void gradientRowScalar(const unsigned char *const *rows,
+                              unsigned char *gradient,
+                              unsigned char *direction, int colBegin,
+                              int width, const int16_t *weights,
+                              int magnitude, int shift) {
+    const unsigned char *up = rows[0], *mid = rows[1], *down = rows[2];
+    const int edge = weights[0], center = weights[1];
+    for (int x = colBegin; x < width - 1; x++) {
+        // Same responses as calculateGradient
+        int gradientX = edge * (down[x - 1] - up[x - 1]) +
+                        center * (down[x] - up[x]) +
+                        edge * (down[x + 1] - up[x + 1]);
+        int gradientY = edge * (up[x + 1] - up[x - 1]) +
+                        center * (mid[x + 1] - mid[x - 1]) +
+                        edge * (down[x + 1] - down[x - 1]);
+        gradient[x] = gradientMagnitude(gradientX, gradientY, magnitude, shift);
+        direction[x] = directionBin(gradientX, gradientY);
+    }
+}
+
+static void gradientScalar(const unsigned char *const *rows,
+                           unsigned char *gradient, unsigned char *direction,
+                           int width, const int16_t *weights, int magnitude,
+                           int shift) {
+    gradientRowScalar(rows, gradient, direction, 1, width, weights, magnitude,
+                      shift);
+}
+
+// Scale of the largest eigenvalue: a third, for the three channels, of the
+// Scharr range brought back to Sobel
+static inline float tensorScale(int shift) {
+    return 1.0f / (6 << (2 * shift));
+}
+
+static inline float truncateMantissa(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits &= TENSOR_MANTISSA_MASK;
+    memcpy(&value, &bits, sizeof(bits));
+    return value;
+}
+
+/**
+ * Magnitude and direction bin of a structure tensor. The eigenvector of the
+ * largest eigenvalue is at half the angle of (xx - yy, 2xy), so its bin of
+ * 22.5 degrees is the octant of that vector. Like directionBin, the lower half
+ * mirrors the upper one, so a gray image gets the same bins.
+ * @param xx sum of gradientX^2 over the channels
+ * @param yy sum of gradientY^2 over the channels
+ * @param xy2 sum of 2 gradientX gradientY over the channels
+ * @param shift right shift scaling the magnitude
+ * @param gradient output magnitude, saturated to 255
+ * @param direction output direction bin
+ */
+static inline void tensorResponse(int xx, int yy, int xy2, int shift,
+                                  unsigned char &gradient,
+                                  unsigned char &direction) {
+    float difference = truncateMantissa(float(xx - yy));
+    float product = truncateMantissa(float(xy2));
+    float root = sqrtf(difference * difference + product * product);
+    float norm = sqrtf((float(xx + yy) + root) * tensorScale(shift));
+    gradient = static_cast<unsigned char>(std::min(int(norm), 255));
+
+    // Octant of the vector mirrored onto [0, 180], then mirrored back
+    int x = xx - yy, y = std::abs(xy2);
+    int bin = 3 - (x > y) - (x > 0) - (x + y > 0);
+    direction = static_cast<unsigned char>(xy2 < 0 ? 7 - bin : bin);
+}
+
+/**
+ * Di Zenzo gradient of columns [colBegin, width - 1) of the middle row
+ * @param rows the rows above, at and below the output row of every channel
+ * @param gradient output magnitudes
+ * @param direction output direction bins
+ * @param colBegin first column, at least 1
+ * @param width width of the rows
+ * @param weights edge and center weights of the operator
+ * @param shift right shift scaling the magnitude
+ */
+static void colorGradientRowScalar(const unsigned char *const *rows,
+                                   unsigned char *gradient,
+                                   unsigned char *direction, int colBegin,
+                                   int width, const int16_t *weights,
+                                   int shift) {
+    const int edge = weights[0], center = weights[1];
+    for (int x = colBegin; x < width - 1; x++) {
+        int xx = 0, yy = 0, xy2 = 0;
+        for (int c = 0; c < 3; c++) {
+            const unsigned char *up = rows[3 * c], *mid = rows[3 * c + 1];
+            const unsigned char *down = rows[3 * c + 2];
+            int gradientX = edge * (down[x - 1] - up[x - 1]) +
+                            center * (down[x] - up[x]) +
+                            edge * (down[x + 1] - up[x + 1]);
+            int gradientY = edge * (up[x + 1] - up[x - 1]) +
+                            center * (mid[x + 1] - mid[x - 1]) +
+                            edge * (down[x + 1] - down[x - 1]);
+            xx += gradientX * gradientX;
+            yy += gradientY * gradientY;
+            xy2 += 2 * gradientX * gradientY;
+        }
+        tensorResponse(xx, yy, xy2, shift, gradient[x], direction[x]);
+    }
+}
+
+static void colorGradientScalar(const unsigned char *const *rows,
+                                unsigned char *gradient,
+                                unsigned char *direction, int width,
+                                const int16_t *weights, int shift) {
+    colorGradientRowScalar(rows, gradient, direction, 1, width, weights,
+                           shift);
+}
+
+/**
+ * Anchors among columns [colBegin, width - 1) of the middle row, see
+ * determineAnchors
+ * @param rows the gradient rows above, at and below the row
+ * @param direction direction bins of the row
+ * @param y the row
+ * @param colBegin first column, at least 1
+ * @param width width of the rows
+ * @param threshold margin an anchor must have over both its neighbors
+ * @param anchors receives the anchors in scan order
+ */
+static void anchorRowScalar(const unsigned char *const *rows,
+                            const unsigned char *direction, int y,
+                            int colBegin, int width, int threshold,
+                            std::vector<Anchor> &anchors) {
+    const unsigned char *up = rows[0], *mid = rows[1], *down = rows[2];
+    for (int x = colBegin; x < width - 1; ++x) {
+        int magnitude = mid[x];
+        if (magnitude == 0) continue;
+
+        // Compare across the edge, see isHorizontal
+        bool horizontal = direction[x] < 2 || direction[x] >= 6;
+        int mag1 = horizontal ? up[x] : mid[x - 1];
+        int mag2 = horizontal ? down[x] : mid[x + 1];
+        if (magnitude - mag1 >= threshold && magnitude - mag2 >= threshold) {
+            anchors.push_back(Anchor{x, y});
+        }
+    }
+}
+
+static void anchorScalar(const unsigned char *const *rows,
+                         const unsigned char *direction, int y, int width,
+                         int threshold, std::vector<Anchor> &anchors) {
+    anchorRowScalar(rows, direction, y, 1, width, threshold, anchors);
+}
+
+#ifdef GRADIENT_X86
+// Two 16-bit factors packed as the pair multiplied by madd
+static inline int32_t factorPair(int low, int high) {
+    return static_cast<int32_t>(static_cast<uint16_t>(low) |
+                                (static_cast<uint32_t>(
+                                     static_cast<uint16_t>(high))
+                                 << 16));
+}
+
+__attribute__((target("avx2"))) static inline __m256i loadAVX2(
+    const unsigned char *pixels) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)pixels));
+}
+
+// Store 16 words below 256 as bytes, in order
+__attribute__((target("avx2"))) static inline void storeAVX2(
+    unsigned char *out, __m256i words) {
+    __m256i bytes = _mm256_permute4x64_epi64(
+        _mm256_packus_epi16(words, words), _MM_SHUFFLE(3, 1, 2, 0));
+    _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(bytes));
+}
+
+// Responses of the derivative operator at the 16 pixels from x
+__attribute__((target("avx2"))) static inline void responsesAVX2(
+    const unsigned char *up, const unsigned char *mid,
+    const unsigned char *down, int x, __m256i edge, __m256i center,
+    __m256i &gradientX, __m256i &gradientY) {
+    __m256i upLeft = loadAVX2(up + x - 1), upRight = loadAVX2(up + x + 1);
+    __m256i downLeft = loadAVX2(down + x - 1);
+    __m256i downRight = loadAVX2(down + x + 1);
+    gradientX = _mm256_add_epi16(
+        _mm256_mullo_epi16(
+            edge, _mm256_add_epi16(_mm256_sub_epi16(downLeft, upLeft),
+                                   _mm256_sub_epi16(downRight, upRight))),
+        _mm256_mullo_epi16(
+            center, _mm256_sub_epi16(loadAVX2(down + x), loadAVX2(up + x))));
+    gradientY = _mm256_add_epi16(
+        _mm256_mullo_epi16(
+            edge, _mm256_add_epi16(_mm256_sub_epi16(upRight, upLeft),
+                                   _mm256_sub_epi16(downRight, downLeft))),
+        _mm256_mullo_epi16(center, _mm256_sub_epi16(loadAVX2(mid + x + 1),
+                                                    loadAVX2(mid + x - 1))));
+}
+
+/**
+ * AVX2 gradient, 16 pixels per iteration in 16-bit lanes. The ratio tests of
+ * the direction bins and the squared norm use madd on interleaved pairs,
+ * which packs back in order.
+ */
+__attribute__((target("avx2"))) static void gradientAVX2(
+    const unsigned char *const *rows, unsigned char *gradient,
+    unsigned char *direction, int width, const int16_t *weights,
+    int magnitude, int shift) {
+    const unsigned char *up = rows[0], *mid = rows[1], *down = rows[2];
+    const __m256i edge = _mm256_set1_epi16(weights[0]);
+    const __m256i center = _mm256_set1_epi16(weights[1]);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i three = _mm256_set1_epi16(3);
+    const __m256i seven = _mm256_set1_epi16(7);
+    const __m256i tanPair =
+        _mm256_set1_epi32(factorPair(TAN_22_5_Q15, -32768));
+    const __m256 scale = _mm256_set1_ps(1.0f / (1 << shift));
+    const __m128i shiftCount = _mm_cvtsi32_si128(shift);
+
+    int x = 1;
+    for (; x + 16 < width; x += 16) {
+        __m256i gradientX, gradientY;
+        responsesAVX2(up, mid, down, x, edge, center, gradientX, gradientY);
+        __m256i absX = _mm256_abs_epi16(gradientX);
+        __m256i absY = _mm256_abs_epi16(gradientY);
+
+        __m256i norm;
+        if (magnitude == MAGNITUDE_EXACT) {
+            __m256i lo = _mm256_unpacklo_epi16(gradientX, gradientY);
+            __m256i hi = _mm256_unpackhi_epi16(gradientX, gradientY);
+            __m256 normLo = _mm256_sqrt_ps(
+                _mm256_cvtepi32_ps(_mm256_madd_epi16(lo, lo)));
+            __m256 normHi = _mm256_sqrt_ps(
+                _mm256_cvtepi32_ps(_mm256_madd_epi16(hi, hi)));
+            norm = _mm256_packs_epi32(
+                _mm256_cvttps_epi32(_mm256_mul_ps(normLo, scale)),
+                _mm256_cvttps_epi32(_mm256_mul_ps(normHi, scale)));
+        } else if (magnitude == MAGNITUDE_L1) {
+            norm = _mm256_srl_epi16(_mm256_add_epi16(absX, absY), shiftCount);
+        } else {
+            __m256i high = _mm256_max_epi16(absX, absY);
+            __m256i low = _mm256_min_epi16(absX, absY);
+            norm = _mm256_add_epi16(
+                _mm256_sub_epi16(high, _mm256_srli_epi16(high, 4)),
+                _mm256_sub_epi16(_mm256_srli_epi16(low, 1),
+                                 _mm256_srli_epi16(low, 5)));
+            norm = _mm256_srl_epi16(norm, shiftCount);
+        }
+        storeAVX2(gradient + x, norm);
+
+        // Direction bins as in directionBin, the folded gradientY is absY
+        __m256i flip = _mm256_or_si256(
+            _mm256_cmpgt_epi16(zero, gradientY),
+            _mm256_and_si256(_mm256_cmpeq_epi16(gradientY, zero),
+                             _mm256_cmpgt_epi16(zero, gradientX)));
+        __m256i foldedX =
+            _mm256_sub_epi16(_mm256_xor_si256(gradientX, flip), flip);
+        __m256i xy = _mm256_unpacklo_epi16(absX, absY);
+        __m256i xyHi = _mm256_unpackhi_epi16(absX, absY);
+        __m256i yx = _mm256_unpacklo_epi16(absY, absX);
+        __m256i yxHi = _mm256_unpackhi_epi16(absY, absX);
+        // All ones where tan(22.5) * absX - absY > 0
+        __m256i below22 = _mm256_packs_epi32(
+            _mm256_srai_epi32(
+                _mm256_sub_epi32(zero, _mm256_madd_epi16(xy, tanPair)), 31),
+            _mm256_srai_epi32(
+                _mm256_sub_epi32(zero, _mm256_madd_epi16(xyHi, tanPair)),
+                31));
+        __m256i below45 = _mm256_cmpgt_epi16(absX, absY);
+        // All ones where tan(22.5) * absY - absX < 0
+        __m256i below67 = _mm256_packs_epi32(
+            _mm256_srai_epi32(_mm256_madd_epi16(yx, tanPair), 31),
+            _mm256_srai_epi32(_mm256_madd_epi16(yxHi, tanPair), 31));
+        __m256i bin = _mm256_add_epi16(
+            three, _mm256_add_epi16(below22, _mm256_add_epi16(below45,
+                                                              below67)));
+        bin = _mm256_xor_si256(
+            bin, _mm256_and_si256(_mm256_cmpgt_epi16(zero, foldedX), seven));
+        storeAVX2(direction + x, bin);
+    }
+    gradientRowScalar(rows, gradient, direction, x, width, weights, magnitude,
+                      shift);
+}
+
+/**
+ * Magnitudes and direction bins of 8 structure tensors in 32-bit lanes, see
+ * tensorResponse
+ */
+__attribute__((target("avx2"))) static inline void tensorAVX2(
+    __m256i xx, __m256i yy, __m256i xy2, __m256 scale, __m256i &norm,
+    __m256i &bin) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i mantissa = _mm256_set1_epi32(TENSOR_MANTISSA_MASK);
+    __m256i difference = _mm256_sub_epi32(xx, yy);
+    __m256 x = _mm256_castsi256_ps(_mm256_and_si256(
+        _mm256_castps_si256(_mm256_cvtepi32_ps(difference)), mantissa));
+    __m256 y = _mm256_castsi256_ps(_mm256_and_si256(
+        _mm256_castps_si256(_mm256_cvtepi32_ps(xy2)), mantissa));
+    __m256 root = _mm256_sqrt_ps(
+        _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)));
+    norm = _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_mul_ps(
+        _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(xx, yy)), root),
+        scale)));
+
+    // The comparisons are -1 when true, and 7 - bin is bin ^ 7
+    __m256i mirroredY = _mm256_abs_epi32(xy2);
+    bin = _mm256_add_epi32(_mm256_set1_epi32(3),
+                           _mm256_cmpgt_epi32(difference, mirroredY));
+    bin = _mm256_add_epi32(bin, _mm256_cmpgt_epi32(difference, zero));
+    bin = _mm256_add_epi32(
+        bin,
+        _mm256_cmpgt_epi32(_mm256_add_epi32(difference, mirroredY), zero));
+    bin = _mm256_xor_si256(bin, _mm256_and_si256(_mm256_cmpgt_epi32(zero, xy2),
+                                                 _mm256_set1_epi32(7)));
+}
+
+/**
+ * AVX2 Di Zenzo gradient, 16 pixels per iteration. The tensor sums come from
+ * madd on interleaved (gradientX, gradientY) pairs, masked or swapped, in
+ * 32-bit lanes that pack back in order.
+ */
+__attribute__((target("avx2"))) static void colorGradientAVX2(
+    const unsigned char *const *rows, unsigned char *gradient,
+    unsigned char *direction, int width, const int16_t *weights, int shift) {
+    const __m256i edge = _mm256_set1_epi16(weights[0]);
+    const __m256i center = _mm256_set1_epi16(weights[1]);
+    const __m256i lowWord = _mm256_set1_epi32(0x0000FFFF);
+    const __m256i highWord = _mm256_set1_epi32(0xFFFF0000);
+    const __m256 scale = _mm256_set1_ps(tensorScale(shift));
+
+    int x = 1;
+    for (; x + 16 < width; x += 16) {
+        __m256i xx[2], yy[2], xy2[2];
+        for (int h = 0; h < 2; h++) {
+            xx[h] = yy[h] = xy2[h] = _mm256_setzero_si256();
+        }
+        for (int c = 0; c < 3; c++) {
+            __m256i gradientX, gradientY;
+            responsesAVX2(rows[3 * c], rows[3 * c + 1], rows[3 * c + 2], x,
+                          edge, center, gradientX, gradientY);
+            __m256i pairs[2] = {_mm256_unpacklo_epi16(gradientX, gradientY),
+                                _mm256_unpackhi_epi16(gradientX, gradientY)};
+            for (int h = 0; h < 2; h++) {
+                __m256i swapped = _mm256_shufflehi_epi16(
+                    _mm256_shufflelo_epi16(pairs[h], _MM_SHUFFLE(2, 3, 0, 1)),
+                    _MM_SHUFFLE(2, 3, 0, 1));
+                xx[h] = _mm256_add_epi32(
+                    xx[h], _mm256_madd_epi16(
+                               pairs[h], _mm256_and_si256(pairs[h], lowWord)));
+                yy[h] = _mm256_add_epi32(
+                    yy[h], _mm256_madd_epi16(
+                               pairs[h], _mm256_and_si256(pairs[h], highWord)));
+                xy2[h] = _mm256_add_epi32(
+                    xy2[h], _mm256_madd_epi16(pairs[h], swapped));
+            }
+        }
+
+        __m256i norm[2], bin[2];
+        for (int h = 0; h < 2; h++) {
+            tensorAVX2(xx[h], yy[h], xy2[h], scale, norm[h], bin[h]);
+        }
+        storeAVX2(gradient + x, _mm256_packs_epi32(norm[0], norm[1]));
+        storeAVX2(direction + x, _mm256_packs_epi32(bin[0], bin[1]));
+    }
+    colorGradientRowScalar(rows, gradient, direction, x, width, weights,
+                           shift);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static inline __m512i loadAVX512(
+    const unsigned char *pixels) {
+    return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)pixels));
+}
+
+// Responses of the derivative operator at the 32 pixels from x
+__attribute__((target("avx512f,avx512bw"))) static inline void
+responsesAVX512(const unsigned char *up, const unsigned char *mid,
+                const unsigned char *down, int x, __m512i edge, __m512i center,
+                __m512i &gradientX, __m512i &gradientY) {
+    __m512i upLeft = loadAVX512(up + x - 1);
+    __m512i upRight = loadAVX512(up + x + 1);
+    __m512i downLeft = loadAVX512(down + x - 1);
+    __m512i downRight = loadAVX512(down + x + 1);
+    gradientX = _mm512_add_epi16(
+        _mm512_mullo_epi16(
+            edge, _mm512_add_epi16(_mm512_sub_epi16(downLeft, upLeft),
+                                   _mm512_sub_epi16(downRight, upRight))),
+        _mm512_mullo_epi16(center, _mm512_sub_epi16(loadAVX512(down + x),
+                                                    loadAVX512(up + x))));
+    gradientY = _mm512_add_epi16(
+        _mm512_mullo_epi16(
+            edge, _mm512_add_epi16(_mm512_sub_epi16(upRight, upLeft),
+                                   _mm512_sub_epi16(downRight, downLeft))),
+        _mm512_mullo_epi16(center, _mm512_sub_epi16(loadAVX512(mid + x + 1),
+                                                    loadAVX512(mid + x - 1))));
+}
+
+/**
+ * AVX-512 gradient, 32 pixels per iteration
+ */
+__attribute__((target("avx512f,avx512bw"))) static void gradientAVX512(
+    const unsigned char *const *rows, unsigned char *gradient,
+    unsigned char *direction, int width, const int16_t *weights,
+    int magnitude, int shift) {
+    const unsigned char *up = rows[0], *mid = rows[1], *down = rows[2];
+    const __m512i edge = _mm512_set1_epi16(weights[0]);
+    const __m512i center = _mm512_set1_epi16(weights[1]);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i three = _mm512_set1_epi16(3);
+    const __m512i seven = _mm512_set1_epi16(7);
+    const __m512i tanPair =
+        _mm512_set1_epi32(factorPair(TAN_22_5_Q15, -32768));
+    const __m512 scale = _mm512_set1_ps(1.0f / (1 << shift));
+    const __m128i shiftCount = _mm_cvtsi32_si128(shift);
+
+    int x = 1;
+    for (; x + 32 < width; x += 32) {
+        __m512i gradientX, gradientY;
+        responsesAVX512(up, mid, down, x, edge, center, gradientX, gradientY);
+        __m512i absX = _mm512_abs_epi16(gradientX);
+        __m512i absY = _mm512_abs_epi16(gradientY);
+
+        __m512i norm;
+        if (magnitude == MAGNITUDE_EXACT) {
+            __m512i lo = _mm512_unpacklo_epi16(gradientX, gradientY);
+            __m512i hi = _mm512_unpackhi_epi16(gradientX, gradientY);
+            __m512 normLo = _mm512_sqrt_ps(
+                _mm512_cvtepi32_ps(_mm512_madd_epi16(lo, lo)));
+            __m512 normHi = _mm512_sqrt_ps(
+                _mm512_cvtepi32_ps(_mm512_madd_epi16(hi, hi)));
+            norm = _mm512_packs_epi32(
+                _mm512_cvttps_epi32(_mm512_mul_ps(normLo, scale)),
+                _mm512_cvttps_epi32(_mm512_mul_ps(normHi, scale)));
+        } else if (magnitude == MAGNITUDE_L1) {
+            norm = _mm512_srl_epi16(_mm512_add_epi16(absX, absY), shiftCount);
+        } else {
+            __m512i high = _mm512_max_epi16(absX, absY);
+            __m512i low = _mm512_min_epi16(absX, absY);
+            norm = _mm512_add_epi16(
+                _mm512_sub_epi16(high, _mm512_srli_epi16(high, 4)),
+                _mm512_sub_epi16(_mm512_srli_epi16(low, 1),
+                                 _mm512_srli_epi16(low, 5)));
+            norm = _mm512_srl_epi16(norm, shiftCount);
+        }
+        _mm256_storeu_si256((__m256i *)(gradient + x),
+                            _mm512_cvtusepi16_epi8(norm));
+
+        // Direction bins as in directionBin, the folded gradientY is absY
+        __mmask32 flip =
+            _mm512_cmplt_epi16_mask(gradientY, zero) |
+            (_mm512_cmpeq_epi16_mask(gradientY, zero) &
+             _mm512_cmplt_epi16_mask(gradientX, zero));
+        __mmask32 negativeX = (_mm512_cmplt_epi16_mask(gradientX, zero) &
+                               ~flip) |
+                              (_mm512_cmpgt_epi16_mask(gradientX, zero) & flip);
+        __m512i xy = _mm512_unpacklo_epi16(absX, absY);
+        __m512i xyHi = _mm512_unpackhi_epi16(absX, absY);
+        __m512i yx = _mm512_unpacklo_epi16(absY, absX);
+        __m512i yxHi = _mm512_unpackhi_epi16(absY, absX);
+        __m512i below22 = _mm512_packs_epi32(
+            _mm512_srai_epi32(
+                _mm512_sub_epi32(zero, _mm512_madd_epi16(xy, tanPair)), 31),
+            _mm512_srai_epi32(
+                _mm512_sub_epi32(zero, _mm512_madd_epi16(xyHi, tanPair)),
+                31));
+        __m512i below45 =
+            _mm512_movm_epi16(_mm512_cmpgt_epi16_mask(absX, absY));
+        __m512i below67 = _mm512_packs_epi32(
+            _mm512_srai_epi32(_mm512_madd_epi16(yx, tanPair), 31),
+            _mm512_srai_epi32(_mm512_madd_epi16(yxHi, tanPair), 31));
+        __m512i bin = _mm512_add_epi16(
+            three, _mm512_add_epi16(below22, _mm512_add_epi16(below45,
+                                                              below67)));
+        bin = _mm512_xor_si512(bin, _mm512_maskz_mov_epi16(negativeX, seven));
+        _mm256_storeu_si256((__m256i *)(direction + x),
+                            _mm512_cvtepi16_epi8(bin));
+    }
+    gradientRowScalar(rows, gradient, direction, x, width, weights, magnitude,
+                      shift);
+}
+
+/**
+ * Magnitudes and direction bins of 16 structure tensors in 32-bit lanes
+ */
+__attribute__((target("avx512f,avx512bw"))) static inline void tensorAVX512(
+    __m512i xx, __m512i yy, __m512i xy2, __m512 scale, __m512i &norm,
+    __m512i &bin) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i mantissa = _mm512_set1_epi32(TENSOR_MANTISSA_MASK);
+    __m512i difference = _mm512_sub_epi32(xx, yy);
+    __m512 x = _mm512_castsi512_ps(_mm512_and_si512(
+        _mm512_castps_si512(_mm512_cvtepi32_ps(difference)), mantissa));
+    __m512 y = _mm512_castsi512_ps(_mm512_and_si512(
+        _mm512_castps_si512(_mm512_cvtepi32_ps(xy2)), mantissa));
+    __m512 root = _mm512_sqrt_ps(
+        _mm512_add_ps(_mm512_mul_ps(x, x), _mm512_mul_ps(y, y)));
+    norm = _mm512_cvttps_epi32(_mm512_sqrt_ps(_mm512_mul_ps(
+        _mm512_add_ps(_mm512_cvtepi32_ps(_mm512_add_epi32(xx, yy)), root),
+        scale)));
+
+    __m512i mirroredY = _mm512_abs_epi32(xy2);
+    bin = _mm512_set1_epi32(3);
+    bin = _mm512_mask_sub_epi32(
+        bin, _mm512_cmpgt_epi32_mask(difference, mirroredY), bin, one);
+    bin = _mm512_mask_sub_epi32(
+        bin, _mm512_cmpgt_epi32_mask(difference, zero), bin, one);
+    bin = _mm512_mask_sub_epi32(
+        bin,
+        _mm512_cmpgt_epi32_mask(_mm512_add_epi32(difference, mirroredY), zero),
+        bin, one);
+    bin = _mm512_mask_xor_epi32(bin, _mm512_cmplt_epi32_mask(xy2, zero), bin,
+                                _mm512_set1_epi32(7));
+}
+
+/**
+ * AVX-512 Di Zenzo gradient, 32 pixels per iteration
+ */
+__attribute__((target("avx512f,avx512bw"))) static void colorGradientAVX512(
+    const unsigned char *const *rows, unsigned char *gradient,
+    unsigned char *direction, int width, const int16_t *weights, int shift) {
+    const __m512i edge = _mm512_set1_epi16(weights[0]);
+    const __m512i center = _mm512_set1_epi16(weights[1]);
+    const __m512i lowWord = _mm512_set1_epi32(0x0000FFFF);
+    const __m512i highWord = _mm512_set1_epi32(0xFFFF0000);
+    const __m512 scale = _mm512_set1_ps(tensorScale(shift));
+
+    int x = 1;
+    for (; x + 32 < width; x += 32) {
+        __m512i xx[2], yy[2], xy2[2];
+        for (int h = 0; h < 2; h++) {
+            xx[h] = yy[h] = xy2[h] = _mm512_setzero_si512();
+        }
+        for (int c = 0; c < 3; c++) {
+            __m512i gradientX, gradientY;
+            responsesAVX512(rows[3 * c], rows[3 * c + 1], rows[3 * c + 2], x,
+                            edge, center, gradientX, gradientY);
+            __m512i pairs[2] = {_mm512_unpacklo_epi16(gradientX, gradientY),
+                                _mm512_unpackhi_epi16(gradientX, gradientY)};
+            for (int h = 0; h < 2; h++) {
+                __m512i swapped = _mm512_shufflehi_epi16(
+                    _mm512_shufflelo_epi16(pairs[h], _MM_SHUFFLE(2, 3, 0, 1)),
+                    _MM_SHUFFLE(2, 3, 0, 1));
+                xx[h] = _mm512_add_epi32(
+                    xx[h], _mm512_madd_epi16(
+                               pairs[h], _mm512_and_si512(pairs[h], lowWord)));
+                yy[h] = _mm512_add_epi32(
+                    yy[h], _mm512_madd_epi16(
+                               pairs[h], _mm512_and_si512(pairs[h], highWord)));
+                xy2[h] = _mm512_add_epi32(
+                    xy2[h], _mm512_madd_epi16(pairs[h], swapped));
+            }
+        }
+
+        __m512i norm[2], bin[2];
+        for (int h = 0; h < 2; h++) {
+            tensorAVX512(xx[h], yy[h], xy2[h], scale, norm[h], bin[h]);
+        }
+        _mm256_storeu_si256(
+            (__m256i *)(gradient + x),
+            _mm512_cvtusepi16_epi8(_mm512_packs_epi32(norm[0], norm[1])));
+        _mm256_storeu_si256(
+            (__m256i *)(direction + x),
+            _mm512_cvtepi16_epi8(_mm512_packs_epi32(bin[0], bin[1])));
+    }
+    colorGradientRowScalar(rows, gradient, direction, x, width, weights,
+                           shift);
+}
+
+/**
+ * AVX2 anchors, 32 pixels per iteration. The margins are saturating byte
+ * differences, so a pixel weaker than a neighbor has a margin of 0, below
+ * any threshold of at least 1, and the anchors come out of a movemask.
+ */
+__attribute__((target("avx2"))) static void anchorAVX2(
+    const unsigned char *const *rows, const unsigned char *direction, int y,
+    int width, int threshold, std::vector<Anchor> &anchors) {
+    const unsigned char *up = rows[0], *mid = rows[1], *down = rows[2];
+    const __m256i margin = _mm256_set1_epi8(char(threshold));
+    const __m256i two = _mm256_set1_epi8(2), three = _mm256_set1_epi8(3);
+
+    int x = 1;
+    for (; x + 32 < width; x += 32) {
+        __m256i magnitude = _mm256_loadu_si256((const __m256i *)(mid + x));
+
+        // Bins 2 to 5 compare to the left and right neighbors
+        __m256i shifted = _mm256_sub_epi8(
+            _mm256_loadu_si256((const __m256i *)(direction + x)), two);
+        __m256i vertical = _mm256_cmpeq_epi8(
+            _mm256_min_epu8(shifted, three), shifted);
+        __m256i mag1 = _mm256_blendv_epi8(
+            _mm256_loadu_si256((const __m256i *)(up + x)),
+            _mm256_loadu_si256((const __m256i *)(mid + x - 1)), vertical);
+        __m256i mag2 = _mm256_blendv_epi8(
+            _mm256_loadu_si256((const __m256i *)(down + x)),
+            _mm256_loadu_si256((const __m256i *)(mid + x + 1)), vertical);
+
+        __m256i margin1 = _mm256_subs_epu8(magnitude, mag1);
+        __m256i margin2 = _mm256_subs_epu8(magnitude, mag2);
+        __m256i anchor = _mm256_cmpeq_epi8(
+            _mm256_max_epu8(_mm256_min_epu8(margin1, margin2), margin),
+            _mm256_min_epu8(margin1, margin2));
+        uint32_t bits = _mm256_movemask_epi8(anchor);
+        while (bits) {
+            anchors.push_back(Anchor{x + __builtin_ctz(bits), y});
+            bits &= bits - 1;
+        }
+    }
+    anchorRowScalar(rows, direction, y, x, width, threshold, anchors);
+}
+
+/**
+ * AVX-512 anchors, 64 pixels per iteration, see anchorAVX2
+ */
+__attribute__((target("avx512f,avx512bw"))) static void anchorAVX512(
+    const unsigned char *const *rows, const unsigned char *direction, int y,
+    int width, int threshold, std::vector<Anchor> &anchors) {
+    const unsigned char *up = rows[0], *mid = rows[1], *down = rows[2];
+    const __m512i margin = _mm512_set1_epi8(char(threshold));
+    const __m512i two = _mm512_set1_epi8(2), four = _mm512_set1_epi8(4);
+
+    int x = 1;
+    for (; x + 64 < width; x += 64) {
+        __m512i magnitude = _mm512_loadu_si512(mid + x);
+        __mmask64 vertical = _mm512_cmplt_epu8_mask(
+            _mm512_sub_epi8(_mm512_loadu_si512(direction + x), two), four);
+        __m512i mag1 = _mm512_mask_blend_epi8(
+            vertical, _mm512_loadu_si512(up + x),
+            _mm512_loadu_si512(mid + x - 1));
+        __m512i mag2 = _mm512_mask_blend_epi8(
+            vertical, _mm512_loadu_si512(down + x),
+            _mm512_loadu_si512(mid + x + 1));
+
+        __m512i margins = _mm512_min_epu8(_mm512_subs_epu8(magnitude, mag1),
+                                          _mm512_subs_epu8(magnitude, mag2));
+        uint64_t bits = _mm512_cmpge_epu8_mask(margins, margin);
+        while (bits) {
+            anchors.push_back(Anchor{x + __builtin_ctzll(bits), y});
+            bits &= bits - 1;
+        }
+    }
+    anchorRowScalar(rows, direction, y, x, width, threshold, anchors);
+}
+#endif
+
+/**
+ * Prepare the row kernel of the gradient
+ * @param width width of the rows
+ * @param op GRADIENT_SOBEL or GRADIENT_SCHARR
+ * @param magnitude MAGNITUDE_EXACT, MAGNITUDE_L1 or
+ * MAGNITUDE_ALPHA_MAX_BETA_MIN
+ * @param simdLevel SIMD_SCALAR, SIMD_AVX2 or SIMD_AVX512, at most
+ * detectSimdLevel()
+ */
+GradientRow::GradientRow(int width, int op, int magnitude, int simdLevel)
+    : width(width),
+      magnitude(magnitude),
+      shift(op == GRADIENT_SCHARR ? SCHARR_SHIFT : 0) {
+    weights[0] = op == GRADIENT_SCHARR ? 3 : 1;
+    weights[1] = op == GRADIENT_SCHARR ? 10 : 2;
+
+    row = gradientScalar;
+#ifdef GRADIENT_X86
+    if (simdLevel >= SIMD_AVX512) {
+        row = gradientAVX512;
+    } else if (simdLevel >= SIMD_AVX2) {
+        row = gradientAVX2;
+    }
+#endif
+}
+
+/**
+ * Gradient of one row, columns 0 and width - 1 are left untouched
+ * @param rows the rows above, at and below the output row
+ * @param gradient output magnitudes, saturated to 255
+ * @param direction output direction bins
+ */
+void GradientRow::compute(const unsigned char *const *rows,
+                          unsigned char *gradient,
+                          unsigned char *direction) const {
+    row(rows, gradient, direction, width, weights, magnitude, shift);
+}
+
+/**
+ * Prepare the row kernel of the Di Zenzo gradient
+ * @param width width of the rows
+ * @param op GRADIENT_SOBEL or GRADIENT_SCHARR
+ * @param simdLevel SIMD_SCALAR, SIMD_AVX2 or SIMD_AVX512, at most
+ * detectSimdLevel()
+ */
+ColorGradientRow::ColorGradientRow(int width, int op, int simdLevel)
+    : width(width), shift(op == GRADIENT_SCHARR ? SCHARR_SHIFT : 0) {
+    weights[0] = op == GRADIENT_SCHARR ? 3 : 1;
+    weights[1] = op == GRADIENT_SCHARR ? 10 : 2;
+
+    row = colorGradientScalar;
+#ifdef GRADIENT_X86
+    if (simdLevel >= SIMD_AVX512) {
+        row = colorGradientAVX512;
+    } else if (simdLevel >= SIMD_AVX2) {
+        row = colorGradientAVX2;
+    }
+#endif
+}
+
+/**
+ * Di Zenzo gradient of one row, columns 0 and width - 1 are left untouched
+ * @param rows the rows above, at and below the output row of the first
+ * channel, then of the second and third channels
+ * @param gradient output magnitudes, saturated to 255
+ * @param direction output direction bins
+ */
+void ColorGradientRow::compute(const unsigned char *const *rows,
+                               unsigned char *gradient,
+                               unsigned char *direction) const {
+    row(rows, gradient, direction, width, weights, shift);
+}
+
+/**
+ * Prepare the row kernel of the anchor test. The SIMD kernels need a
+ * threshold in [1, 255], other thresholds use the scalar kernel.
+ * @param width width of the rows
+ * @param threshold margin an anchor must have over both its neighbors
+ * @param simdLevel SIMD_SCALAR, SIMD_AVX2 or SIMD_AVX512, at most
+ * detectSimdLevel()
+ */
+AnchorRow::AnchorRow(int width, int threshold, int simdLevel)
+    : width(width), threshold(threshold) {
+    row = anchorScalar;
+#ifdef GRADIENT_X86
+    if (threshold < 1 || threshold > 255) return;
+    if (simdLevel >= SIMD_AVX512) {
+        row = anchorAVX512;
+    } else if (simdLevel >= SIMD_AVX2) {
+        row = anchorAVX2;
+    }
+#endif
+}
+
+/**
+ * Append the anchors of one row in scan order, columns 0 and width - 1 are
+ * never anchors
+ * @param rows the gradient rows above, at and below the row
+ * @param direction direction bins of the row
+ * @param y the row, stored in the anchors
+ * @param anchors receives the anchors
+ */
+void AnchorRow::find(const unsigned char *const *rows,
+                     const unsigned char *direction, int y,
+                     std::vector<Anchor> &anchors) const {
+    row(rows, direction, y, width, threshold, anchors);
+}
@@ -3,86 +3,452 @@
 #include <algorithm>
 #include <iostream>
 
-#include "processing.h"
 #include "gaussianblur.h"
+#include "processing.h"
+#include "trace.h"
 
 /**
- * Create and return a Gaussian kernel for convolution
- * @param radius kernel radius
- * @param sigma  Gaussian kernel standard deviation
+ * Creates a Gaussian blur kernel for convolution
+ * @param radius radius of the kernel
+ * @param sigma  standard deviation of the kernel
  */
-double* gaussianKernel(const int radius, const int sigma) {
-    const int width = radius * 2 + 1;
-
-    double * kernel = (double *)malloc(sizeof(double) * width * width);
+double* gaussianKernel(int radius, double sigma) {
+    int kernelWidth = 2 * radius + 1;
+    double* kernel =
+        (double*)malloc(sizeof(double) * kernelWidth * kernelWidth);
     double sum = 0.0;
     // Populate every position in the kernel with the respective Gaussian
     // distribution value
-    std::cout << "\n kernel: \n";
     for (int x = -radius; x <= radius; x++) {
         for (int y = -radius; y <= radius; y++) {
             double expNumerator = -(x * x + y * y);
             double expDenominator = 2.0 * sigma * sigma;
             double eExpression = exp(expNumerator / expDenominator);
-            double kernelValue =
-                eExpression / (2.0 * M_PI * sigma * sigma);
-            size_t index = (x + radius) * width + y + radius;
+            double kernelValue = eExpression / (2.0 * M_PI * sigma * sigma);
+            size_t index = (x + radius) * kernelWidth + y + radius;
             kernel[index] = kernelValue;
             sum += kernelValue;
         }
     }
 
     // Normalize the kernel
-    for (int i = 0; i < width * width; i++) {
+    for (int i = 0; i < kernelWidth * kernelWidth; i++) {
         kernel[i] /= sum;
     }
 
     return kernel;
 }
 
-unsigned char* gaussianBlur(const unsigned char* inputImage, int width,
-                            int height, int channels) {
-    // Copy kernel to constant memory
-    double* kernel = gaussianKernel(BLUR_RADIUS, BLUR_SIGMA);
-    cudaMemcpyToSymbol(kernelConstant, kernel,
-                       sizeof(double) * BLUR_WIDTH * BLUR_WIDTH);
+/**
+ * Creates a one dimensional Gaussian kernel, the 2D kernel of gaussianKernel
+ * is the outer product of this kernel with itself
+ * @param radius radius of the kernel
+ * @param sigma  standard deviation of the kernel
+ */
+double* gaussianKernel1D(int radius, double sigma) {
+    int kernelWidth = 2 * radius + 1;
+    double* kernel = (double*)malloc(sizeof(double) * kernelWidth);
+    double sum = 0.0;
+    for (int x = -radius; x <= radius; x++) {
+        kernel[x + radius] = exp(-(x * x) / (2.0 * sigma * sigma));
+        sum += kernel[x + radius];
+    }
 
-    // Total image size each pixel 3 chars for R,G,B
-    int imageDataSize = sizeof(unsigned char) * width * height * channels;
+    // Normalize the kernel
+    for (int i = 0; i < kernelWidth; i++) {
+        kernel[i] /= sum;
+    }
 
-    // Allocate memory for output blurred image
-    unsigned char* outputImage = (unsigned char*)malloc(imageDataSize);
+    return kernel;
+}
 
-    // Allocate device memory
-    unsigned char* inputImageDevice, *outputImageDevice;
-    cudaMalloc(&inputImageDevice, imageDataSize);
-    cudaMemcpy(inputImageDevice, inputImage, imageDataSize,
-               cudaMemcpyHostToDevice);
-    cudaMalloc(&outputImageDevice, imageDataSize);
+/**
+ * Direct 2D convolution with the full (2 * BLUR_RADIUS + 1)^2 kernel,
+ * clamping the coordinates of every tap at the borders
+ * @param inputImage input image
+ * @param outputImage output image of the same size
+ * @param width width of input image
+ * @param height height of input image
+ * @param channels number of color channels input image has
+ * @param sigma standard deviation of the Gaussian
+ */
+static void gaussianBlurDirect(const unsigned char* inputImage,
+                               unsigned char* outputImage, int width,
+                               int height, int channels, double sigma) {
+    // Create Gaussian kernel
+    int kernelWidth = 2 * BLUR_RADIUS + 1;
+    double* kernel = gaussianKernel(BLUR_RADIUS, sigma);
 
-  
+    // Convolve over the input image
+    parallelFor(0, height, [&](int rowBegin, int rowEnd) {
+        for (int row = rowBegin; row < rowEnd; row++) {
+            for (int col = 0; col < width; col++) {
+                for (int c = 0; c < channels; ++c) {
+                    double sum = 0.0f;
 
-    // CUDA memory allocation and kernel invocation
-    dim3 blockSize(16, 16);
-    dim3 gridSize((width + blockSize.x - 1) / blockSize.x,
-                  (height + blockSize.y - 1) / blockSize.y);
-    gaussian_blur_kernel<<<gridSize, blockSize>>>(
-        inputImageDevice, outputImageDevice, width, height, channels);
+                    for (int i = -BLUR_RADIUS; i <= BLUR_RADIUS; ++i) {
+                        for (int j = -BLUR_RADIUS; j <= BLUR_RADIUS; ++j) {
+                            int newRow = std::min(std::max(row + i, 0),
+                                                  height - 1);
+                            int newCol = std::min(std::max(col + j, 0),
+                                                  width - 1);
+                            int newIdx =
+                                c * width * height + newRow * width + newCol;
 
-    // Copy the result back to host
-    cudaMemcpy(outputImage, outputImageDevice, imageDataSize,
-               cudaMemcpyDeviceToHost);
+                            double weight =
+                                kernel[(i + BLUR_RADIUS) * kernelWidth +
+                                       (j + BLUR_RADIUS)];
+                            sum += double(inputImage[newIdx]) * weight;
+                        }
+                    }
 
-    // unsigned char* grayscaleImage;
-    // cudaMallocManaged(&grayscaleImage, sizeof(unsigned char) * width * height);
+                    outputImage[c * width * height + row * width + col] =
+                        static_cast<unsigned char>(sum);
+                }
+            }
+        }
+    });
 
-    // rgb_to_grayscale_kernel<<<gridSize, blockSize>>>(outputImageDevice, grayscaleImage, width, height);
+    // Free Gaussian kernel
+    free(kernel);
+}
 
-    cudaDeviceSynchronize();
+/**
+ * Number of output rows per strip of the separable blurs. A strip and its
+ * halo of BLUR_RADIUS intermediate rows on each side fit in
+ * BLUR_STRIP_BYTES, there is at least one strip per thread, and a strip is
+ * never shorter than its halo.
+ * @param width width of the image
+ * @param height height of the image
+ * @param bytesPerValue size of one intermediate value
+ */
+int blurStripRows(int width, int height, size_t bytesPerValue) {
+    int threads = getNumThreads();
+    int rows = static_cast<int>(BLUR_STRIP_BYTES / (bytesPerValue * width)) -
+               2 * BLUR_RADIUS;
+    rows = std::min(rows, (height + threads - 1) / threads);
+    return std::max(rows, 2 * BLUR_RADIUS);
+}
+
+/**
+ * Separable convolution: a horizontal pass into a float buffer followed by a
+ * vertical pass, 2 * (2 * BLUR_RADIUS + 1) taps per pixel instead of
+ * (2 * BLUR_RADIUS + 1)^2. Borders are replicated into padding once, so the
+ * inner loops have no clamping. The image is processed in row strips spread
+ * over the thread pool, and each strip is filtered vertically while its
+ * intermediate rows are still in cache.
+ * @param inputImage input image
+ * @param outputImage output image of the same size
+ * @param width width of input image
+ * @param height height of input image
+ * @param channels number of color channels input image has
+ * @param sigma standard deviation of the Gaussian
+ */
+static void gaussianBlurSeparable(const unsigned char* inputImage,
+                                  unsigned char* outputImage, int width,
+                                  int height, int channels, double sigma) {
+    int kernelWidth = 2 * BLUR_RADIUS + 1;
+    double* kernel = gaussianKernel1D(BLUR_RADIUS, sigma);
+    float weights[2 * BLUR_RADIUS + 1];
+    for (int k = 0; k < kernelWidth; k++) {
+        weights[k] = static_cast<float>(kernel[k]);
+    }
+    free(kernel);
+
+    int stripRows = blurStripRows(width, height, sizeof(float));
+    int numStrips = (height + stripRows - 1) / stripRows;
+    size_t planeSize = size_t(width) * height;
 
-    // Free device memory
-    cudaFree(inputImageDevice);
-    cudaFree(outputImageDevice);
+    parallelFor(0, numStrips, [&](int stripBegin, int stripEnd) {
+        // Input row with BLUR_RADIUS replicated pixels on each side, the
+        // horizontal pass of a strip and its halo, and the vertical sums
+        float* paddedRow =
+            (float*)malloc(sizeof(float) * (width + 2 * BLUR_RADIUS));
+        float* strip = (float*)malloc(sizeof(float) * width *
+                                      (stripRows + 2 * BLUR_RADIUS));
+        float* sum = (float*)malloc(sizeof(float) * width);
+
+        for (int s = stripBegin; s < stripEnd; s++) {
+            int rowBegin = s * stripRows;
+            int rowEnd = std::min(height, rowBegin + stripRows);
+            for (int c = 0; c < channels; c++) {
+                // Rows above and below the image replicate the border rows
+                for (int row = rowBegin - BLUR_RADIUS;
+                     row < rowEnd + BLUR_RADIUS; row++) {
+                    const unsigned char* input =
+                        inputImage + c * planeSize +
+                        size_t(std::min(std::max(row, 0), height - 1)) * width;
+                    for (int i = 0; i < BLUR_RADIUS; i++) {
+                        paddedRow[i] = input[0];
+                        paddedRow[width + BLUR_RADIUS + i] = input[width - 1];
+                    }
+                    for (int col = 0; col < width; col++) {
+                        paddedRow[col + BLUR_RADIUS] = input[col];
+                    }
+
+                    float* output = strip + size_t(row - rowBegin +
+                                                   BLUR_RADIUS) *
+                                                width;
+                    for (int col = 0; col < width; col++) {
+                        float total = 0.0f;
+                        for (int k = 0; k < kernelWidth; k++) {
+                            total += paddedRow[col + k] * weights[k];
+                        }
+                        output[col] = total;
+                    }
+                }
+
+                // Vertical pass, accumulating whole rows so the inner loop
+                // is contiguous
+                for (int row = rowBegin; row < rowEnd; row++) {
+                    std::fill(sum, sum + width, 0.0f);
+                    for (int k = 0; k < kernelWidth; k++) {
+                        const float* input =
+                            strip + size_t(row - rowBegin + k) * width;
+                        for (int col = 0; col < width; col++) {
+                            sum[col] += input[col] * weights[k];
+                        }
+                    }
+
+                    unsigned char* output = outputImage + c * planeSize +
+                                            size_t(row) * width;
+                    for (int col = 0; col < width; col++) {
+                        output[col] = static_cast<unsigned char>(sum[col]);
+                    }
+                }
+            }
+        }
+        free(paddedRow);
+        free(strip);
+        free(sum);
+    });
+}
+
+/**
+ * Coefficients of the Young-van Vliet recursive Gaussian (2002 variant). A
+ * causal then an anti-causal third order filter, each computing
+ * y[n] = b * x[n] + a1 * y[n - 1] + a2 * y[n - 2] + a3 * y[n - 3]
+ * The anti-causal filter starts from the exact state of a signal that
+ * continues with its last value (Triggs and Sdika, 2006).
+ */
+struct RecursiveGaussian {
+    float b, a1, a2, a3;
+    float triggs[9];
+
+    explicit RecursiveGaussian(double sigma) {
+        sigma = std::max(sigma, 0.5);
+        const double m0 = 1.16680, m1 = 1.10783, m2 = 1.40586;
+        double q = sigma < 3.556
+                       ? -0.2568 + 0.5784 * sigma + 0.0561 * sigma * sigma
+                       : 2.5091 + 0.9804 * (sigma - 3.556);
+        double scale =
+            (m0 + q) * (m1 * m1 + m2 * m2 + 2 * m1 * q + q * q);
+        double c1 = q *
+                    (2 * m0 * m1 + m1 * m1 + m2 * m2 + (2 * m0 + 4 * m1) * q +
+                     3 * q * q) /
+                    scale;
+        double c2 = -q * q * (m0 + 2 * m1 + 3 * q) / scale;
+        double c3 = q * q * q / scale;
+        a1 = static_cast<float>(c1);
+        a2 = static_cast<float>(c2);
+        a3 = static_cast<float>(c3);
+        b = static_cast<float>(1 - (c1 + c2 + c3));
+
+        double m = 1 / ((1 + c1 - c2 + c3) * (1 - c1 - c2 - c3) *
+                        (1 + c2 + (c1 - c3) * c3));
+        double matrix[9] = {
+            -c3 * c1 + 1 - c3 * c3 - c2,
+            (c3 + c1) * (c2 + c3 * c1),
+            c3 * (c1 + c3 * c2),
+            c1 + c3 * c2,
+            -(c2 - 1) * (c2 + c3 * c1),
+            -c3 * (c3 * c1 + c3 * c3 + c2 - 1),
+            c3 * c1 + c2 + c1 * c1 - c2 * c2,
+            c1 * c2 + c3 * c2 * c2 - c1 * c3 * c3 - c3 * c3 * c3 - c3 * c2 +
+                c3,
+            c3 * (c1 + c3 * c2)};
+        for (int i = 0; i < 9; i++) {
+            triggs[i] = static_cast<float>(m * matrix[i] * b);
+        }
+    }
+
+    /**
+     * Start values y[N - 1], y[N] and y[N + 1] of the anti-causal filter
+     * @param last input value x[N - 1]
+     * @param w0 causal output w[N - 1]
+     * @param w1 causal output w[N - 2]
+     * @param w2 causal output w[N - 3]
+     * @param y the three start values
+     */
+    void backwardStart(float last, float w0, float w1, float w2,
+                       float *y) const {
+        // With unit gain the steady state of both filters is the last value
+        w0 -= last, w1 -= last, w2 -= last;
+        for (int i = 0; i < 3; i++) {
+            y[i] = triggs[3 * i] * w0 + triggs[3 * i + 1] * w1 +
+                   triggs[3 * i + 2] * w2 + last;
+        }
+    }
+};
+
+/**
+ * Filter a line in place, forward then backward, replicating the edge
+ * pixels beyond the borders
+ * @param line values to filter
+ * @param length number of values
+ * @param filter recursive filter coefficients
+ */
+static void recursiveGaussianLine(float* line, int length,
+                                  const RecursiveGaussian& filter) {
+    float last = line[length - 1];
+    float y1 = line[0], y2 = y1, y3 = y1;
+    for (int i = 0; i < length; i++) {
+        float y = filter.b * line[i] + filter.a1 * y1 + filter.a2 * y2 +
+                  filter.a3 * y3;
+        line[i] = y;
+        y3 = y2, y2 = y1, y1 = y;
+    }
+
+    float start[3];
+    filter.backwardStart(last, line[length - 1],
+                         line[std::max(length - 2, 0)],
+                         line[std::max(length - 3, 0)], start);
+    line[length - 1] = start[0];
+    y1 = start[0], y2 = start[1], y3 = start[2];
+    for (int i = length - 2; i >= 0; i--) {
+        float y = filter.b * line[i] + filter.a1 * y1 + filter.a2 * y2 +
+                  filter.a3 * y3;
+        line[i] = y;
+        y3 = y2, y2 = y1, y1 = y;
+    }
+}
+
+/**
+ * Recursive (IIR) Gaussian blur after Young and van Vliet. The cost per
+ * pixel does not depend on sigma and the Gaussian is not truncated at
+ * BLUR_RADIUS, so large sigmas cost the same as small ones.
+ * @param inputImage input image
+ * @param outputImage output image of the same size
+ * @param width width of input image
+ * @param height height of input image
+ * @param channels number of color channels input image has
+ * @param sigma standard deviation of the Gaussian
+ */
+static void gaussianBlurRecursive(const unsigned char* inputImage,
+                                  unsigned char* outputImage, int width,
+                                  int height, int channels, double sigma) {
+    RecursiveGaussian filter(sigma);
+    size_t planeSize = size_t(width) * height;
+    float* plane = (float*)malloc(sizeof(float) * planeSize);
+
+    for (int c = 0; c < channels; c++) {
+        const unsigned char* input = inputImage + c * planeSize;
+
+        // Rows are independent recursions
+        parallelFor(0, height, [&](int rowBegin, int rowEnd) {
+            for (int row = rowBegin; row < rowEnd; row++) {
+                float* line = plane + size_t(row) * width;
+                for (int col = 0; col < width; col++) {
+                    line[col] = input[size_t(row) * width + col];
+                }
+                recursiveGaussianLine(line, width, filter);
+            }
+        });
+
+        // Columns are filtered a block at a time, stepping down the rows so
+        // that the inner loop reads contiguous memory
+        parallelFor(
+            0, width,
+            [&](int colBegin, int colEnd) {
+                int n = colEnd - colBegin;
+                float* history = (float*)malloc(sizeof(float) * 4 * n);
+                float *y1 = history, *y2 = history + n, *y3 = history + 2 * n;
+                float* last = history + 3 * n;
+
+                const float* first = plane + colBegin;
+                const float* bottom =
+                    plane + size_t(height - 1) * width + colBegin;
+                std::copy(bottom, bottom + n, last);
+                std::copy(first, first + n, y1);
+                std::copy(first, first + n, y2);
+                std::copy(first, first + n, y3);
+                for (int row = 0; row < height; row++) {
+                    float* line = plane + size_t(row) * width + colBegin;
+                    for (int i = 0; i < n; i++) {
+                        float y = filter.b * line[i] + filter.a1 * y1[i] +
+                                  filter.a2 * y2[i] + filter.a3 * y3[i];
+                        line[i] = y;
+                        y3[i] = y2[i], y2[i] = y1[i], y1[i] = y;
+                    }
+                }
+
+                // Start of the anti-causal pass from the last three causal
+                // rows, the bottom row is final
+                const float* w0 = bottom;
+                const float* w1 =
+                    plane + size_t(std::max(height - 2, 0)) * width + colBegin;
+                const float* w2 =
+                    plane + size_t(std::max(height - 3, 0)) * width + colBegin;
+                unsigned char* output = outputImage + c * planeSize +
+                                        size_t(height - 1) * width + colBegin;
+                for (int i = 0; i < n; i++) {
+                    float start[3];
+                    filter.backwardStart(last[i], w0[i], w1[i], w2[i], start);
+                    y1[i] = start[0], y2[i] = start[1], y3[i] = start[2];
+                    output[i] = static_cast<unsigned char>(
+                        std::min(std::max(start[0] + 0.5f, 0.0f), 255.0f));
+                }
+
+                for (int row = height - 2; row >= 0; row--) {
+                    float* line = plane + size_t(row) * width + colBegin;
+                    output = outputImage + c * planeSize +
+                             size_t(row) * width + colBegin;
+                    for (int i = 0; i < n; i++) {
+                        float y = filter.b * line[i] + filter.a1 * y1[i] +
+                                  filter.a2 * y2[i] + filter.a3 * y3[i];
+                        y3[i] = y2[i], y2[i] = y1[i], y1[i] = y;
+                        output[i] = static_cast<unsigned char>(
+                            std::min(std::max(y + 0.5f, 0.0f), 255.0f));
+                    }
+                }
+                free(history);
+            },
+            64);
+    }
+
+    free(plane);
+}
+
+/**
+ * CPU version of Gaussian blur, rows are distributed over the CPU thread pool
+ * @param inputImage input image
+ * @param width width of input image
+ * @param height height of input image
+ * @param channels number of color channels input image has
+ * @param sigma standard deviation of the Gaussian
+ * @param method BLUR_FIXED_POINT, BLUR_SEPARABLE, BLUR_DIRECT or
+ * BLUR_RECURSIVE
+ */
+unsigned char* gaussianBlurCPU(const unsigned char* inputImage, int width,
+                               int height, int channels, double sigma,
+                               int method) {
+    TRACE_SCOPE("blur");
+
+    unsigned char* outputImage = (unsigned char*)malloc(
+        sizeof(unsigned char) * width * height * channels);
+    if (method == BLUR_DIRECT) {
+        gaussianBlurDirect(inputImage, outputImage, width, height, channels,
+                           sigma);
+    } else if (method == BLUR_RECURSIVE) {
+        gaussianBlurRecursive(inputImage, outputImage, width, height, channels,
+                              sigma);
+    } else if (method == BLUR_FIXED_POINT) {
+        gaussianBlurFixedPoint(inputImage, outputImage, width, height,
+                               channels, sigma, detectSimdLevel());
+    } else {
+        gaussianBlurSeparable(inputImage, outputImage, width, height, channels,
+                              sigma);
+    }
 
     return outputImage;
 }
@@ -1,6 +1,10 @@
 #ifndef GAUSSIAN_BLUR_H
 #define GAUSSIAN_BLUR_H
 
+#include <stdint.h>
+
+#include <vector>
+
 #include "CImg.h"
 
 using CImg = cimg_library::CImg<unsigned char>;
@@ -14,11 +18,56 @@ const double BLUR_SIGMA = 2.3;
 const int BLUR_RADIUS = 7;
 const int BLUR_WIDTH = 2 * BLUR_RADIUS + 1;
 
+// CPU blur methods: full 2D convolution, a horizontal then a vertical pass,
+// the separable passes in 16-bit fixed point on the widest SIMD unit, or a
+// recursive filter whose cost does not depend on sigma
+const int BLUR_DIRECT = 0;
+const int BLUR_SEPARABLE = 1;
+const int BLUR_FIXED_POINT = 2;
+const int BLUR_RECURSIVE = 3;
+
+// Cache budget of one row strip of the separable blurs, intermediate rows
+// included
+const size_t BLUR_STRIP_BYTES = 512 * 1024;
+
 // Creates a Gaussian kernel with input radius
+double *gaussianKernel(int radius, double sigma);
+double *gaussianKernel1D(int radius, double sigma);
+
+// Output rows per cache-sized strip of the separable blurs
+int blurStripRows(int width, int height, size_t bytesPerValue);
+
+// Gaussian blur on planar image data, CPU and GPU versions
 unsigned char *gaussianBlurCPU(const unsigned char *inputImage, int width,
-                               int height, int channels);
+                               int height, int channels,
+                               double sigma = BLUR_SIGMA,
+                               int method = BLUR_FIXED_POINT);
+// Fixed point separable blur, simdLevel selects the kernels (see processing.h)
+void gaussianBlurFixedPoint(const unsigned char *inputImage,
+                            unsigned char *outputImage, int width, int height,
+                            int channels, double sigma, int simdLevel);
+
+// Row at a time access to the fixed point blur, for stages that stream rows
+// through it. The horizontal pass gives Q7 rows, and BLUR_WIDTH of them give
+// one blurred row. One instance per thread.
+class FixedPointRowBlur {
+   public:
+    FixedPointRowBlur(int width, double sigma, int simdLevel);
+    void horizontal(const unsigned char *row, int16_t *out);
+    void vertical(const int16_t *const *rows, unsigned char *out) const;
+
+   private:
+    int width;
+    int16_t weights[BLUR_WIDTH + 1];
+    std::vector<unsigned char> paddedRow;
+    void (*horizontalRow)(const unsigned char *padded, int16_t *out,
+                          int width, const int16_t *weights);
+    void (*verticalRow)(const int16_t *const *rows, unsigned char *out,
+                        int width, const int16_t *weights);
+};
 unsigned char *gaussianBlur(const unsigned char *inputImage, int width,
-                            int height, int channels);
+                            int height, int channels,
+                            double sigma = BLUR_SIGMA);
 
 void gpuWarmUp();
 
@@ -0,0 +1,344 @@
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLUR_X86
+#endif
+
+#include "gaussianblur.h"
+#include "processing.h"
+
+// Fixed point formats: weights are Q14 so that they sum to 1 << 14, the
+// horizontal pass keeps Q7 intermediates, which fit in 16 bits for any
+// 8-bit input (255 << 7 = 32640), and the vertical pass accumulates Q21 sums
+// in 32 bits
+const int WEIGHT_BITS = 14;
+const int INTERMEDIATE_BITS = 7;
+const int HORIZONTAL_SHIFT = WEIGHT_BITS - INTERMEDIATE_BITS;
+const int VERTICAL_SHIFT = WEIGHT_BITS + INTERMEDIATE_BITS;
+
+// Taps rounded up to an even count, the last weight is zero
+const int PAIRED_WIDTH = BLUR_WIDTH + 1;
+
+// Extra zeroed bytes after a padded row, the vector loads of the last tap
+// pair may read one pixel past the padding
+const int ROW_SLACK = 64;
+
+using HorizontalRow = void (*)(const unsigned char *padded, int16_t *out,
+                               int width, const int16_t *weights);
+using VerticalRow = void (*)(const int16_t *const *rows, unsigned char *out,
+                             int width, const int16_t *weights);
+
+/**
+ * Quantize the 1D kernel to Q14, adjusting the center tap so that the
+ * weights sum to exactly 1 << 14
+ * @param sigma standard deviation of the Gaussian
+ * @param weights PAIRED_WIDTH output weights
+ */
+static void quantizeKernel(double sigma, int16_t *weights) {
+    double *kernel = gaussianKernel1D(BLUR_RADIUS, sigma);
+    int sum = 0;
+    for (int k = 0; k < BLUR_WIDTH; k++) {
+        weights[k] =
+            static_cast<int16_t>(lround(kernel[k] * (1 << WEIGHT_BITS)));
+        sum += weights[k];
+    }
+    weights[BLUR_RADIUS] += (1 << WEIGHT_BITS) - sum;
+    weights[BLUR_WIDTH] = 0;
+    free(kernel);
+}
+
+/**
+ * Horizontal pass over columns [colBegin, width) of a padded row
+ * @param padded input row with BLUR_RADIUS replicated pixels on each side
+ * @param out Q7 output row
+ * @param colBegin first column
+ * @param width width of the row
+ * @param weights Q14 weights
+ */
+static void horizontalRowScalar(const unsigned char *padded, int16_t *out,
+                                int colBegin, int width,
+                                const int16_t *weights) {
+    for (int col = colBegin; col < width; col++) {
+        int32_t sum = 0;
+        for (int k = 0; k < BLUR_WIDTH; k++) {
+            sum += padded[col + k] * weights[k];
+        }
+        out[col] = static_cast<int16_t>(
+            (sum + (1 << (HORIZONTAL_SHIFT - 1))) >> HORIZONTAL_SHIFT);
+    }
+}
+
+/**
+ * Vertical pass over columns [colBegin, width), truncating like the direct
+ * convolution
+ * @param rows the BLUR_WIDTH Q7 input rows
+ * @param out output row
+ * @param colBegin first column
+ * @param width width of the row
+ * @param weights Q14 weights
+ */
+static void verticalRowScalar(const int16_t *const *rows, unsigned char *out,
+                              int colBegin, int width,
+                              const int16_t *weights) {
+    for (int col = colBegin; col < width; col++) {
+        int32_t sum = 0;
+        for (int k = 0; k < BLUR_WIDTH; k++) {
+            sum += rows[k][col] * weights[k];
+        }
+        out[col] = static_cast<unsigned char>(sum >> VERTICAL_SHIFT);
+    }
+}
+
+static void horizontalScalar(const unsigned char *padded, int16_t *out,
+                             int width, const int16_t *weights) {
+    horizontalRowScalar(padded, out, 0, width, weights);
+}
+
+static void verticalScalar(const int16_t *const *rows, unsigned char *out,
+                           int width, const int16_t *weights) {
+    verticalRowScalar(rows, out, 0, width, weights);
+}
+
+#ifdef BLUR_X86
+// Two adjacent weights packed as the 16-bit pair multiplied by madd
+static inline int32_t weightPair(const int16_t *weights, int k) {
+    return static_cast<int32_t>(static_cast<uint16_t>(weights[k]) |
+                                (static_cast<uint32_t>(
+                                     static_cast<uint16_t>(weights[k + 1]))
+                                 << 16));
+}
+
+/**
+ * AVX2 horizontal pass, 16 pixels per iteration. Pixels of taps k and k + 1
+ * are interleaved so that one madd applies a pair of weights.
+ */
+__attribute__((target("avx2"))) static void horizontalAVX2(
+    const unsigned char *padded, int16_t *out, int width,
+    const int16_t *weights) {
+    const __m256i round = _mm256_set1_epi32(1 << (HORIZONTAL_SHIFT - 1));
+    int col = 0;
+    for (; col + 16 <= width; col += 16) {
+        __m256i lo = _mm256_setzero_si256();
+        __m256i hi = _mm256_setzero_si256();
+        for (int k = 0; k < PAIRED_WIDTH; k += 2) {
+            __m256i a = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i *)(padded + col + k)));
+            __m256i b = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i *)(padded + col + k + 1)));
+            __m256i pair = _mm256_set1_epi32(weightPair(weights, k));
+            lo = _mm256_add_epi32(
+                lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), pair));
+            hi = _mm256_add_epi32(
+                hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), pair));
+        }
+        lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), HORIZONTAL_SHIFT);
+        hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), HORIZONTAL_SHIFT);
+        // Unpack and pack both work within 128-bit lanes, so the pixels are
+        // back in order
+        _mm256_storeu_si256((__m256i *)(out + col),
+                            _mm256_packs_epi32(lo, hi));
+    }
+    horizontalRowScalar(padded, out, col, width, weights);
+}
+
+/**
+ * AVX2 vertical pass, 16 pixels per iteration
+ */
+__attribute__((target("avx2"))) static void verticalAVX2(
+    const int16_t *const *rows, unsigned char *out, int width,
+    const int16_t *weights) {
+    int col = 0;
+    for (; col + 16 <= width; col += 16) {
+        __m256i lo = _mm256_setzero_si256();
+        __m256i hi = _mm256_setzero_si256();
+        for (int k = 0; k < PAIRED_WIDTH; k += 2) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(rows[k] + col));
+            __m256i b =
+                k + 1 < BLUR_WIDTH
+                    ? _mm256_loadu_si256((const __m256i *)(rows[k + 1] + col))
+                    : _mm256_setzero_si256();
+            __m256i pair = _mm256_set1_epi32(weightPair(weights, k));
+            lo = _mm256_add_epi32(
+                lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), pair));
+            hi = _mm256_add_epi32(
+                hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), pair));
+        }
+        __m256i words =
+            _mm256_packs_epi32(_mm256_srai_epi32(lo, VERTICAL_SHIFT),
+                               _mm256_srai_epi32(hi, VERTICAL_SHIFT));
+        // Pack to bytes within lanes, then gather the two useful quadwords
+        __m256i bytes = _mm256_permute4x64_epi64(
+            _mm256_packus_epi16(words, words), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *)(out + col),
+                         _mm256_castsi256_si128(bytes));
+    }
+    verticalRowScalar(rows, out, col, width, weights);
+}
+
+/**
+ * AVX-512 horizontal pass, 32 pixels per iteration
+ */
+__attribute__((target("avx512f,avx512bw"))) static void horizontalAVX512(
+    const unsigned char *padded, int16_t *out, int width,
+    const int16_t *weights) {
+    const __m512i round = _mm512_set1_epi32(1 << (HORIZONTAL_SHIFT - 1));
+    int col = 0;
+    for (; col + 32 <= width; col += 32) {
+        __m512i lo = _mm512_setzero_si512();
+        __m512i hi = _mm512_setzero_si512();
+        for (int k = 0; k < PAIRED_WIDTH; k += 2) {
+            __m512i a = _mm512_cvtepu8_epi16(
+                _mm256_loadu_si256((const __m256i *)(padded + col + k)));
+            __m512i b = _mm512_cvtepu8_epi16(
+                _mm256_loadu_si256((const __m256i *)(padded + col + k + 1)));
+            __m512i pair = _mm512_set1_epi32(weightPair(weights, k));
+            lo = _mm512_add_epi32(
+                lo, _mm512_madd_epi16(_mm512_unpacklo_epi16(a, b), pair));
+            hi = _mm512_add_epi32(
+                hi, _mm512_madd_epi16(_mm512_unpackhi_epi16(a, b), pair));
+        }
+        lo = _mm512_srai_epi32(_mm512_add_epi32(lo, round), HORIZONTAL_SHIFT);
+        hi = _mm512_srai_epi32(_mm512_add_epi32(hi, round), HORIZONTAL_SHIFT);
+        _mm512_storeu_si512((void *)(out + col), _mm512_packs_epi32(lo, hi));
+    }
+    horizontalRowScalar(padded, out, col, width, weights);
+}
+
+/**
+ * AVX-512 vertical pass, 32 pixels per iteration
+ */
+__attribute__((target("avx512f,avx512bw"))) static void verticalAVX512(
+    const int16_t *const *rows, unsigned char *out, int width,
+    const int16_t *weights) {
+    int col = 0;
+    for (; col + 32 <= width; col += 32) {
+        __m512i lo = _mm512_setzero_si512();
+        __m512i hi = _mm512_setzero_si512();
+        for (int k = 0; k < PAIRED_WIDTH; k += 2) {
+            __m512i a = _mm512_loadu_si512((const void *)(rows[k] + col));
+            __m512i b =
+                k + 1 < BLUR_WIDTH
+                    ? _mm512_loadu_si512((const void *)(rows[k + 1] + col))
+                    : _mm512_setzero_si512();
+            __m512i pair = _mm512_set1_epi32(weightPair(weights, k));
+            lo = _mm512_add_epi32(
+                lo, _mm512_madd_epi16(_mm512_unpacklo_epi16(a, b), pair));
+            hi = _mm512_add_epi32(
+                hi, _mm512_madd_epi16(_mm512_unpackhi_epi16(a, b), pair));
+        }
+        __m512i words =
+            _mm512_packs_epi32(_mm512_srai_epi32(lo, VERTICAL_SHIFT),
+                               _mm512_srai_epi32(hi, VERTICAL_SHIFT));
+        _mm256_storeu_si256((__m256i *)(out + col),
+                            _mm512_cvtepi16_epi8(words));
+    }
+    verticalRowScalar(rows, out, col, width, weights);
+}
+#endif
+
+/**
+ * Prepare the row kernels of the fixed point blur
+ * @param width width of the rows
+ * @param sigma standard deviation of the Gaussian
+ * @param simdLevel SIMD_SCALAR, SIMD_AVX2 or SIMD_AVX512, at most
+ * detectSimdLevel()
+ */
+FixedPointRowBlur::FixedPointRowBlur(int width, double sigma, int simdLevel)
+    : width(width), paddedRow(width + 2 * BLUR_RADIUS + ROW_SLACK, 0) {
+    quantizeKernel(sigma, weights);
+
+    horizontalRow = horizontalScalar;
+    verticalRow = verticalScalar;
+#ifdef BLUR_X86
+    if (simdLevel >= SIMD_AVX512) {
+        horizontalRow = horizontalAVX512;
+        verticalRow = verticalAVX512;
+    } else if (simdLevel >= SIMD_AVX2) {
+        horizontalRow = horizontalAVX2;
+        verticalRow = verticalAVX2;
+    }
+#endif
+}
+
+/**
+ * Horizontal pass of one row, replicating its border pixels
+ * @param row input row of width pixels
+ * @param out Q7 output row
+ */
+void FixedPointRowBlur::horizontal(const unsigned char *row, int16_t *out) {
+    unsigned char *padded = paddedRow.data();
+    std::fill(padded, padded + BLUR_RADIUS, row[0]);
+    std::copy(row, row + width, padded + BLUR_RADIUS);
+    std::fill(padded + BLUR_RADIUS + width, padded + 2 * BLUR_RADIUS + width,
+              row[width - 1]);
+    horizontalRow(padded, out, width, weights);
+}
+
+/**
+ * Vertical pass producing one output row
+ * @param rows the BLUR_WIDTH Q7 rows centered on the output row
+ * @param out output row
+ */
+void FixedPointRowBlur::vertical(const int16_t *const *rows,
+                                 unsigned char *out) const {
+    verticalRow(rows, out, width, weights);
+}
+
+/**
+ * Separable Gaussian blur in 16-bit fixed point. Every SIMD level computes
+ * exactly the same integers, so the output does not depend on the host. Row
+ * strips are spread over the thread pool like in the float separable blur.
+ * @param inputImage input image
+ * @param outputImage output image of the same size
+ * @param width width of input image
+ * @param height height of input image
+ * @param channels number of color channels input image has
+ * @param sigma standard deviation of the Gaussian
+ * @param simdLevel SIMD_SCALAR, SIMD_AVX2 or SIMD_AVX512, at most
+ * detectSimdLevel()
+ */
+void gaussianBlurFixedPoint(const unsigned char *inputImage,
+                            unsigned char *outputImage, int width, int height,
+                            int channels, double sigma, int simdLevel) {
+    int stripRows = blurStripRows(width, height, sizeof(int16_t));
+    int numStrips = (height + stripRows - 1) / stripRows;
+    size_t planeSize = size_t(width) * height;
+
+    parallelFor(0, numStrips, [&](int stripBegin, int stripEnd) {
+        // Horizontal pass of a strip and its halo
+        FixedPointRowBlur blur(width, sigma, simdLevel);
+        int16_t *strip = (int16_t *)malloc(sizeof(int16_t) * width *
+                                           (stripRows + 2 * BLUR_RADIUS));
+        const int16_t *rows[BLUR_WIDTH];
+
+        for (int s = stripBegin; s < stripEnd; s++) {
+            int rowBegin = s * stripRows;
+            int rowEnd = std::min(height, rowBegin + stripRows);
+            for (int c = 0; c < channels; c++) {
+                // Rows above and below the image replicate the border rows
+                for (int row = rowBegin - BLUR_RADIUS;
+                     row < rowEnd + BLUR_RADIUS; row++) {
+                    blur.horizontal(
+                        inputImage + c * planeSize +
+                            size_t(std::min(std::max(row, 0), height - 1)) *
+                                width,
+                        strip + size_t(row - rowBegin + BLUR_RADIUS) * width);
+                }
+
+                // Vertical pass while the strip is still in cache
+                for (int row = rowBegin; row < rowEnd; row++) {
+                    for (int k = 0; k < BLUR_WIDTH; k++) {
+                        rows[k] = strip + size_t(row - rowBegin + k) * width;
+                    }
+                    blur.vertical(rows, outputImage + c * planeSize +
+                                            size_t(row) * width);
+                }
+            }
+        }
+        free(strip);
+    });
+}
@@ -0,0 +1,391 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CImg.h"
+#include "delaunay.h"
+#include "edgedraw.h"
+#include "gaussianblur.h"
+#include "processing.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Options of the benchmark
+struct BenchOptions {
+    vector<string> images;  // input images, the resolution ladder by default
+    vector<int> threads;    // thread counts to measure
+    int iterations = 5;     // timed runs per stage
+    int warmup = 1;         // untimed runs per stage before timing
+    string output;          // JSON file, stdout if empty
+};
+
+// Timing summary of one stage, in microseconds
+struct StageResult {
+    string name;
+    double minUs;
+    double medianUs;
+    double p99Us;
+    double megapixelsPerSecond;
+};
+
+void printUsage(const char* program) {
+    cout << "Usage: " << program << " [options] [image ...]\n"
+         << "\n"
+         << "Times every CPU stage on each image and thread count and prints "
+            "the results as JSON.\n"
+         << "Without images, the ../images/resolution ladder is used.\n"
+         << "\n"
+         << "Options:\n"
+         << "  --threads <a,b,...>   thread counts (default 1 and powers of "
+            "two up to the core count)\n"
+         << "  --iterations <n>      timed runs per stage (default 5)\n"
+         << "  --warmup <n>          untimed runs per stage (default 1)\n"
+         << "  --out <file>          write JSON to a file instead of stdout\n";
+}
+
+vector<int> defaultThreadCounts() {
+    int cores = max(1, static_cast<int>(thread::hardware_concurrency()));
+    vector<int> counts;
+    for (int n = 1; n < cores; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(cores);
+    return counts;
+}
+
+vector<string> defaultImages() {
+    vector<string> images;
+    for (const char* name : {"480p", "1080p", "2160p", "4320p"}) {
+        images.push_back(string("../images/resolution/") + name + ".png");
+    }
+    return images;
+}
+
+bool parseOptions(int argc, char* argv[], BenchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            options.images.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc) {
+            cerr << "Error: missing value for " << arg << endl;
+            return false;
+        }
+        string value = argv[++i];
+        try {
+            if (arg == "--threads") {
+                stringstream list(value);
+                string item;
+                while (getline(list, item, ',')) {
+                    options.threads.push_back(stoi(item));
+                }
+            } else if (arg == "--iterations") {
+                options.iterations = stoi(value);
+            } else if (arg == "--warmup") {
+                options.warmup = stoi(value);
+            } else if (arg == "--out") {
+                options.output = value;
+            } else {
+                cerr << "Error: unknown option " << arg << endl;
+                return false;
+            }
+        } catch (const exception&) {
+            cerr << "Error: invalid value '" << value << "' for " << arg
+                 << endl;
+            return false;
+        }
+    }
+
+    if (options.images.empty()) options.images = defaultImages();
+    if (options.threads.empty()) options.threads = defaultThreadCounts();
+    if (options.iterations < 1 || options.warmup < 0 ||
+        *min_element(options.threads.begin(), options.threads.end()) < 1) {
+        cerr << "Error: numeric options out of range" << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Time a stage. setup prepares fresh inputs before every run and is not
+ * timed, run is the stage itself.
+ * @param name stage name
+ * @param megapixels image size used for the throughput
+ * @param options warmup and iteration counts
+ * @param setup untimed preparation before every run
+ * @param run the stage to time
+ */
+StageResult timeStage(const string& name, double megapixels,
+                      const BenchOptions& options,
+                      const function<void()>& setup,
+                      const function<void()>& run) {
+    vector<double> samples;
+    for (int i = 0; i < options.warmup + options.iterations; i++) {
+        setup();
+        auto start = chrono::high_resolution_clock::now();
+        run();
+        auto end = chrono::high_resolution_clock::now();
+        if (i >= options.warmup) {
+            samples.push_back(
+                chrono::duration<double, micro>(end - start).count());
+        }
+    }
+
+    sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    double median = n % 2 ? samples[n / 2]
+                          : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    // Nearest rank percentile
+    size_t p99Rank = max<size_t>(1, (99 * n + 99) / 100);
+    return StageResult{name, samples.front(), median, samples[p99Rank - 1],
+                       megapixels / (median / 1e6)};
+}
+
+/**
+ * Run every stage of the CPU pipeline on an image. Each stage is fed with
+ * the output of the previous stage computed once outside of the timing.
+ * @param image input image with three channels
+ * @param options benchmark options
+ */
+vector<StageResult> benchImage(CImg& image, const BenchOptions& options) {
+    int width = image.width(), height = image.height();
+    double megapixels = width * height / 1e6;
+    EdgeDrawParams params;
+    vector<StageResult> results;
+    auto noSetup = [] {};
+
+    // Gaussian blur
+    unsigned char* gbImage = nullptr;
+    results.push_back(timeStage(
+        "blur", megapixels, options,
+        [&] {
+            free(gbImage);
+            gbImage = nullptr;
+        },
+        [&] {
+            gbImage = gaussianBlurCPU(image.data(), width, height,
+                                      image.spectrum());
+        }));
+    CImg blurred(gbImage, width, height, 1, 3);
+    free(gbImage);
+    gbImage = nullptr;
+
+    // Grayscale conversion then a single plane blur, the --gray-first path
+    results.push_back(timeStage(
+        "gray_blur", megapixels, options,
+        [&] {
+            free(gbImage);
+            gbImage = nullptr;
+        },
+        [&] {
+            CImg gray = convertToGray(image);
+            gbImage = gaussianBlurCPU(gray.data(), width, height, 1);
+        }));
+    free(gbImage);
+
+    // Grayscale and gradient
+    CImg gradient(width, height, 1, 1, 0);
+    CImg direction(width, height, 1, 1, 0);
+    results.push_back(timeStage("gradient", megapixels, options, noSetup, [&] {
+        gradientInGray(blurred, gradient, direction);
+    }));
+
+    // Di Zenzo gradient of the three channels, the --color-gradient path
+    CImg colorGradient(width, height, 1, 1, 0);
+    CImg colorDirection(width, height, 1, 1, 0);
+    results.push_back(
+        timeStage("color_gradient", megapixels, options, noSetup, [&] {
+            gradientInColor(blurred, colorGradient, colorDirection);
+        }));
+
+    // Blur, grayscale and gradient fused in one streaming pass
+    CImg fusedGradient(width, height);
+    CImg fusedDirection(width, height);
+    results.push_back(
+        timeStage("fused_gradient", megapixels, options, noSetup, [&] {
+            blurredGradientInGray(image, fusedGradient, fusedDirection);
+        }));
+
+    // Weak gradient suppression and anchors
+    CImg suppressed;
+    vector<Anchor> anchors;
+    results.push_back(timeStage(
+        "anchors", megapixels, options, [&] { suppressed = gradient; },
+        [&] {
+            suppressWeakGradients(suppressed, params.gradientThresh);
+            anchors = determineAnchors(suppressed, direction,
+                                       params.anchorThresh);
+        }));
+
+    // Gradient, weak gradient suppression and anchors fused in one pass
+    CImg fusedSuppressed(width, height);
+    CImg fusedAnchorDirection(width, height);
+    vector<Anchor> fusedAnchors;
+    results.push_back(
+        timeStage("gradient_anchors", megapixels, options, noSetup, [&] {
+            fusedAnchors = gradientAnchors(blurred, fusedSuppressed,
+                                           fusedAnchorDirection, 0, params);
+        }));
+
+    // Edge tracing from anchors
+    CImg edge;
+    results.push_back(timeStage(
+        "edges", megapixels, options,
+        [&] { edge.assign(width, height, 1, 1, 0); },
+        [&] {
+            drawEdgesFromAnchors(suppressed, direction, anchors, edge,
+                                 params.vertexSpacing);
+        }));
+
+    // Vertex picking
+    vector<Point> vertices;
+    results.push_back(timeStage("vertices", megapixels, options, noSetup,
+                                [&] { vertices = pickVertices(edge); }));
+
+    // Jump flooding
+    CImgInt voronoi;
+    results.push_back(timeStage("jfa", megapixels, options, noSetup, [&] {
+        voronoi = jumpFloodAlgorithm(vertices, width, height);
+    }));
+    CImgInt voronoiOnePlus;
+    results.push_back(timeStage(
+        "jfa_one_plus", megapixels, options, noSetup, [&] {
+            voronoiOnePlus = jumpFloodAlgorithm(vertices, width, height, true);
+        }));
+    CImgInt voronoiExact;
+    results.push_back(timeStage(
+        "feature_transform", megapixels, options, noSetup, [&] {
+            voronoiExact = featureTransformVoronoi(vertices, width, height);
+        }));
+
+    // Triangle extraction
+    vector<Triangle> triangles;
+    results.push_back(timeStage(
+        "triangles", megapixels, options, noSetup,
+        [&] { triangles = extractTriangles(voronoi); }));
+
+    // Rasterization
+    CImg lowPoly;
+    results.push_back(timeStage(
+        "raster", megapixels, options, [&] { lowPoly = image; },
+        [&] { rasterizeTriangles(triangles, lowPoly); }));
+
+    return results;
+}
+
+/**
+ * Quote a string for JSON, escaping quotes, backslashes and control
+ * characters
+ * @param text string to quote
+ */
+string jsonString(const string& text) {
+    ostringstream out;
+    out << '"';
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c < 0x20) {
+            out << "\\u" << hex << setw(4) << setfill('0') << int(c) << dec;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+/**
+ * Write a JSON number, null when it is not finite (a rate over a median
+ * rounded to 0 us)
+ * @param out JSON stream
+ * @param value number to write
+ */
+void writeNumber(ostream& out, double value) {
+    if (isfinite(value)) {
+        out << value;
+    } else {
+        out << "null";
+    }
+}
+
+void writeStage(ostream& out, const StageResult& stage, bool last) {
+    out << "        " << jsonString(stage.name) << ": {\"min_us\": ";
+    writeNumber(out, stage.minUs);
+    out << ", \"median_us\": ";
+    writeNumber(out, stage.medianUs);
+    out << ", \"p99_us\": ";
+    writeNumber(out, stage.p99Us);
+    out << ", \"mpix_per_s\": ";
+    writeNumber(out, stage.megapixelsPerSecond);
+    out << "}" << (last ? "\n" : ",\n");
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    cimg_library::cimg::exception_mode(0);
+
+    stringstream json;
+    json << fixed << setprecision(3);
+    json << "{\n  \"simd\": \"" << simdLevelName(detectSimdLevel())
+         << "\",\n  \"iterations\": " << options.iterations
+         << ",\n  \"warmup\": " << options.warmup << ",\n  \"results\": [";
+
+    bool first = true;
+    for (const string& path : options.images) {
+        CImg image;
+        try {
+            image.load(path.c_str());
+        } catch (const cimg_library::CImgException&) {
+            cerr << "Error: cannot read " << path << endl;
+            return 1;
+        }
+        toRgb(image);
+
+        for (int threads : options.threads) {
+            setNumThreads(threads);
+            cerr << "Benchmarking " << path << " with " << threads
+                 << " threads" << endl;
+            vector<StageResult> stages = benchImage(image, options);
+
+            json << (first ? "\n" : ",\n") << "    {\n      \"image\": "
+                 << jsonString(fs::path(path).filename().string())
+                 << ",\n      \"width\": " << image.width()
+                 << ",\n      \"height\": " << image.height()
+                 << ",\n      \"threads\": " << threads
+                 << ",\n      \"stages\": {\n";
+            for (size_t i = 0; i < stages.size(); i++) {
+                writeStage(json, stages[i], i + 1 == stages.size());
+            }
+            json << "      }\n    }";
+            first = false;
+        }
+    }
+    json << "\n  ]\n}\n";
+
+    if (options.output.empty()) {
+        cout << json.str();
+    } else {
+        ofstream file(options.output);
+        file << json.str();
+        if (!file) {
+            cerr << "Error: cannot write " << options.output << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,617 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "CImg.h"
+#include "delaunay.h"
+#include "edgedraw.h"
+#include "gaussianblur.h"
+#include "processing.h"
+
+using namespace std;
+
+// Thread counts every check runs with, the results must not depend on them
+const int CHECK_THREADS[] = {1, 3};
+
+int failures = 0;
+
+/**
+ * Report the outcome of a check
+ * @param passed whether the check passed
+ * @param name what was checked
+ */
+void expect(bool passed, const string& name) {
+    if (!passed) {
+        cerr << "FAIL " << name << endl;
+        failures++;
+    }
+}
+
+/**
+ * Sort sites in scan order and drop the repeated ones
+ * @param sites the sites, sorted in place
+ */
+void sortSites(vector<Point>& sites) {
+    sort(sites.begin(), sites.end(), [](const Point& a, const Point& b) {
+        return a.y != b.y ? a.y < b.y : a.x < b.x;
+    });
+    sites.erase(unique(sites.begin(), sites.end(),
+                       [](const Point& a, const Point& b) {
+                           return a.x == b.x && a.y == b.y;
+                       }),
+                sites.end());
+}
+
+/**
+ * Random sites of an image, in scan order without duplicates
+ * @param generator random generator
+ * @param width width of the image
+ * @param height height of the image
+ * @param count number of sites drawn, fewer are left after duplicates
+ */
+vector<Point> randomSites(mt19937& generator, int width, int height,
+                          int count) {
+    vector<Point> sites;
+    for (int i = 0; i < count; i++) {
+        sites.push_back(Point{int(generator() % width),
+                              int(generator() % height)});
+    }
+    sortSites(sites);
+    return sites;
+}
+
+/**
+ * Exact Voronoi diagram by brute force, the site of the smallest column then
+ * of the smallest row on ties, as featureTransformVoronoi
+ * @param sites the sites
+ * @param width width of the image
+ * @param height height of the image
+ */
+CImgInt bruteForceVoronoi(const vector<Point>& sites, int width, int height) {
+    CImgInt voronoi(width, height, 1, 1, -1);
+    cimg_forXY(voronoi, x, y) {
+        long long minDist = LLONG_MAX;
+        const Point* closest = nullptr;
+        for (const Point& site : sites) {
+            long long dx = site.x - x, dy = site.y - y;
+            long long dist = dx * dx + dy * dy;
+            if (dist < minDist ||
+                (dist == minDist &&
+                 (site.x < closest->x ||
+                  (site.x == closest->x && site.y < closest->y)))) {
+                minDist = dist;
+                closest = &site;
+            }
+        }
+        if (closest) voronoi(x, y) = closest->y * width + closest->x;
+    }
+    return voronoi;
+}
+
+/**
+ * The feature transform gives the exact Voronoi diagram, in the site ids of
+ * jumpFloodAlgorithm
+ */
+void checkVoronoi() {
+    mt19937 generator(2024);
+    for (int test = 0; test < 300; test++) {
+        int width = 1 + generator() % 64, height = 1 + generator() % 48;
+        int count = generator() % 40;
+        vector<Point> sites = randomSites(generator, width, height, count);
+        // Sites on a single column or row give ties over whole lines
+        if (test % 10 == 1) {
+            for (Point& site : sites) site.x = width / 2;
+        } else if (test % 10 == 2) {
+            for (Point& site : sites) site.y = height / 2;
+        }
+        sortSites(sites);
+
+        CImgInt expected = bruteForceVoronoi(sites, width, height);
+        string name = "voronoi " + to_string(width) + "x" +
+                      to_string(height) + " with " +
+                      to_string(sites.size()) + " sites";
+        for (int threads : CHECK_THREADS) {
+            setNumThreads(threads);
+            CImgInt exact = featureTransformVoronoi(sites, width, height);
+            expect(exact == expected,
+                   name + " at " + to_string(threads) + " threads");
+
+            // Jump flooding labels the same sites, every site labels itself
+            CImgInt flooded = jumpFloodAlgorithm(sites, width, height);
+            bool sameIds = true;
+            for (const Point& site : sites) {
+                int id = site.y * width + site.x;
+                sameIds &= flooded(site.x, site.y) == id &&
+                           exact(site.x, site.y) == id;
+            }
+            cimg_forXY(flooded, x, y) {
+                int id = flooded(x, y);
+                sameIds &= sites.empty()
+                               ? id == -1
+                               : id >= 0 && id < width * height &&
+                                     expected(id % width, id / width) == id;
+            }
+            expect(sameIds, name + " site ids of jump flooding");
+        }
+    }
+}
+
+/**
+ * Hysteresis thresholding by a serial breadth-first search, with the
+ * thresholds of every tile computed on its own, as trackEdge
+ * @param edge suppressed gradient, replaced by 255 on edges and 0 elsewhere
+ * @param thresholds HYSTERESIS_MEAN_STD or HYSTERESIS_OTSU
+ * @param tileSize side of the tiles, 0 for the whole image
+ */
+void bruteForceHysteresis(CImg& edge, int thresholds, int tileSize) {
+    int width = edge.width(), height = edge.height();
+    int tileWidth = tileSize > 0 ? tileSize : width;
+    int tileHeight = tileSize > 0 ? tileSize : height;
+
+    // 0 below the low threshold of the tile, 1 weak, 2 strong
+    CImg level(width, height, 1, 1, 0);
+    for (int top = 0; top < height; top += tileHeight) {
+        for (int left = 0; left < width; left += tileWidth) {
+            int bottom = min(top + tileHeight, height);
+            int right = min(left + tileWidth, width);
+            vector<long long> histogram(256, 0);
+            for (int y = top; y < bottom; y++) {
+                for (int x = left; x < right; x++) histogram[edge(x, y)]++;
+            }
+            long long count = 0;
+            double sum = 0;
+            for (int v = 0; v < 256; v++) {
+                count += histogram[v];
+                sum += double(v) * histogram[v];
+            }
+            double mean = sum / count, lowValue, highValue;
+            if (thresholds == HYSTERESIS_OTSU) {
+                double bestVariance = -1;
+                int otsu = 0;
+                for (int t = 0; t < 255; t++) {
+                    long long below = 0;
+                    double sumBelow = 0;
+                    for (int v = 0; v <= t; v++) {
+                        below += histogram[v];
+                        sumBelow += double(v) * histogram[v];
+                    }
+                    long long above = count - below;
+                    if (below == 0 || above == 0) continue;
+                    double difference =
+                        sumBelow / below - (sum - sumBelow) / above;
+                    double variance =
+                        double(below) * above * difference * difference;
+                    if (variance > bestVariance) {
+                        bestVariance = variance;
+                        otsu = t;
+                    }
+                }
+                highValue = otsu + 1;
+                lowValue = highValue / 2;
+            } else {
+                double squares = 0;
+                for (int v = 0; v < 256; v++) {
+                    squares += (v - mean) * (v - mean) * histogram[v];
+                }
+                double stdDev = sqrt(squares / count);
+                highValue = mean + 2 * stdDev;
+                lowValue = mean + stdDev;
+            }
+            auto clampThreshold = [](double value) {
+                return static_cast<unsigned char>(min(max(value, 1.0), 255.0));
+            };
+            unsigned char low = clampThreshold(lowValue);
+            unsigned char high = clampThreshold(highValue);
+            for (int y = top; y < bottom; y++) {
+                for (int x = left; x < right; x++) {
+                    level(x, y) = edge(x, y) >= high ? 2
+                                  : edge(x, y) >= low ? 1
+                                                      : 0;
+                }
+            }
+        }
+    }
+
+    CImg result(width, height, 1, 1, 0);
+    vector<Point> queue;
+    cimg_forXY(level, x, y) {
+        if (level(x, y) != 2 || result(x, y)) continue;
+        result(x, y) = 255;
+        queue.assign(1, Point{x, y});
+        while (!queue.empty()) {
+            Point p = queue.back();
+            queue.pop_back();
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    int nx = p.x + dx, ny = p.y + dy;
+                    if (nx < 0 || nx >= width || ny < 0 || ny >= height ||
+                        !level(nx, ny) || result(nx, ny)) {
+                        continue;
+                    }
+                    result(nx, ny) = 255;
+                    queue.push_back(Point{nx, ny});
+                }
+            }
+        }
+    }
+    edge.swap(result);
+}
+
+/**
+ * Suppressed gradient like image: sparse noise crossed by strokes of high
+ * magnitude, so that components span bands and tiles
+ * @param generator random generator
+ * @param width width of the image
+ * @param height height of the image
+ */
+CImg randomGradient(mt19937& generator, int width, int height) {
+    CImg gradient(width, height, 1, 1, 0);
+    cimg_forXY(gradient, x, y) {
+        if (generator() % 3 == 0) gradient(x, y) = generator() % 256;
+    }
+    int strokes = 1 + (width + height) / 16;
+    for (int i = 0; i < strokes; i++) {
+        int x = generator() % width, y = generator() % height;
+        unsigned char magnitude = 64 + generator() % 192;
+        for (int step = generator() % (2 * (width + height)); step > 0;
+             step--) {
+            gradient(x, y) = magnitude;
+            x = min(max(x + int(generator() % 3) - 1, 0), width - 1);
+            y = min(max(y + int(generator() % 3) - 1, 0), height - 1);
+        }
+    }
+    return gradient;
+}
+
+/**
+ * The parallel union-find hysteresis with histogram thresholds keeps the
+ * same edges as a serial search, for both threshold modes, with and without
+ * tiles
+ */
+void checkHysteresis() {
+    mt19937 generator(7);
+    const int sizes[][2] = {{1, 1},   {17, 5},   {64, 33},
+                            {257, 129}, {300, 200}, {40, 300}};
+    for (const auto& size : sizes) {
+        CImg gradient = randomGradient(generator, size[0], size[1]);
+        for (int thresholds : {HYSTERESIS_MEAN_STD, HYSTERESIS_OTSU}) {
+            for (int tileSize : {0, 7, 100}) {
+                CImg expected = gradient;
+                bruteForceHysteresis(expected, thresholds, tileSize);
+                for (int threads : CHECK_THREADS) {
+                    setNumThreads(threads);
+                    CImg edge = gradient;
+                    trackEdge(edge, thresholds, tileSize);
+                    expect(edge == expected,
+                           "hysteresis " + to_string(size[0]) + "x" +
+                               to_string(size[1]) + " thresholds " +
+                               to_string(thresholds) + " tiles " +
+                               to_string(tileSize) + " at " +
+                               to_string(threads) + " threads");
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Image of flat rectangles over faint noise, so that edges of every
+ * direction run through it
+ * @param generator random generator
+ * @param width width of the image
+ * @param height height of the image
+ * @param channels number of channels
+ */
+CImg randomImage(mt19937& generator, int width, int height, int channels) {
+    CImg image(width, height, 1, channels);
+    cimg_forXYC(image, x, y, c) { image(x, y, c) = 96 + generator() % 32; }
+    int rectangles = 2 + (width + height) / 8;
+    for (int i = 0; i < rectangles; i++) {
+        int left = generator() % width, top = generator() % height;
+        int right = min(width, left + 1 + int(generator() % (width / 2 + 1)));
+        int bottom =
+            min(height, top + 1 + int(generator() % (height / 2 + 1)));
+        for (int c = 0; c < channels; c++) {
+            unsigned char value = generator() % 256;
+            for (int y = top; y < bottom; y++) {
+                for (int x = left; x < right; x++) image(x, y, c) = value;
+            }
+        }
+    }
+    return image;
+}
+
+/**
+ * Every SIMD level of the fixed point blur gives the bytes of the scalar
+ * kernels, and the separable and fixed point blurs stay within 1 of the
+ * direct convolution
+ */
+void checkBlur() {
+    mt19937 generator(11);
+    const int sizes[][2] = {{1, 1}, {5, 3}, {33, 17}, {100, 64}, {257, 40}};
+    for (const auto& size : sizes) {
+        int width = size[0], height = size[1];
+        for (int channels : {1, 3}) {
+            CImg image = randomImage(generator, width, height, channels);
+            string name = "blur " + to_string(width) + "x" +
+                          to_string(height) + "x" + to_string(channels);
+            for (int threads : CHECK_THREADS) {
+                setNumThreads(threads);
+                string at = " at " + to_string(threads) + " threads";
+                CImg scalar(width, height, 1, channels);
+                gaussianBlurFixedPoint(image.data(), scalar.data(), width,
+                                       height, channels, BLUR_SIGMA,
+                                       SIMD_SCALAR);
+                for (int level = SIMD_SCALAR + 1; level <= detectSimdLevel();
+                     level++) {
+                    CImg blurred(width, height, 1, channels);
+                    gaussianBlurFixedPoint(image.data(), blurred.data(), width,
+                                           height, channels, BLUR_SIGMA,
+                                           level);
+                    expect(blurred == scalar, name + " fixed point " +
+                                                  simdLevelName(level) + at);
+                }
+
+                unsigned char* direct =
+                    gaussianBlurCPU(image.data(), width, height, channels,
+                                    BLUR_SIGMA, BLUR_DIRECT);
+                for (int method : {BLUR_SEPARABLE, BLUR_FIXED_POINT}) {
+                    unsigned char* blurred =
+                        gaussianBlurCPU(image.data(), width, height, channels,
+                                        BLUR_SIGMA, method);
+                    bool close = true;
+                    for (size_t i = 0; i < image.size(); i++) {
+                        close &= abs(blurred[i] - direct[i]) <= 1;
+                    }
+                    expect(close, name + " method " + to_string(method) +
+                                      " against direct" + at);
+                    free(blurred);
+                }
+                free(direct);
+            }
+        }
+    }
+}
+
+/**
+ * Rows of the image around row y, clamped to the image
+ * @param image the image
+ * @param y the middle row
+ * @param rows receives the rows above, at and below y of every channel
+ */
+void rowsAround(const CImg& image, int y, const unsigned char** rows) {
+    for (int c = 0; c < image.spectrum(); c++) {
+        for (int k = 0; k < 3; k++) {
+            int v = min(max(y - 1 + k, 0), image.height() - 1);
+            rows[3 * c + k] = image.data(0, v, 0, c);
+        }
+    }
+}
+
+/**
+ * Every SIMD level of the gradient and anchor row kernels gives the bytes,
+ * and the anchors, of the scalar kernels, over the vector tails too
+ */
+void checkSimdRows() {
+    mt19937 generator(5);
+    for (int width : {3, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 257}) {
+        CImg gray = randomImage(generator, width, 5, 1);
+        CImg color = randomImage(generator, width, 5, 3);
+        CImg gradient = randomGradient(generator, width, 5);
+        CImg bins(width, 5);
+        cimg_forXY(bins, x, y) { bins(x, y) = generator() % DIRECTION_BINS; }
+        const unsigned char* rows[9];
+
+        for (int level = SIMD_SCALAR + 1; level <= detectSimdLevel();
+             level++) {
+            string name = string(simdLevelName(level)) + " width " +
+                          to_string(width);
+            for (int op : {GRADIENT_SOBEL, GRADIENT_SCHARR}) {
+                for (int magnitude : {MAGNITUDE_EXACT, MAGNITUDE_L1,
+                                      MAGNITUDE_ALPHA_MAX_BETA_MIN}) {
+                    for (int y = 1; y < 4; y++) {
+                        CImg expected(width, 2, 1, 1, 7), actual = expected;
+                        rowsAround(gray, y, rows);
+                        GradientRow(width, op, magnitude, SIMD_SCALAR)
+                            .compute(rows, expected.data(0, 0),
+                                     expected.data(0, 1));
+                        GradientRow(width, op, magnitude, level)
+                            .compute(rows, actual.data(0, 0),
+                                     actual.data(0, 1));
+                        expect(actual == expected,
+                               name + " gradient operator " + to_string(op) +
+                                   " magnitude " + to_string(magnitude));
+                    }
+                }
+                for (int y = 1; y < 4; y++) {
+                    CImg expected(width, 2, 1, 1, 7), actual = expected;
+                    rowsAround(color, y, rows);
+                    ColorGradientRow(width, op, SIMD_SCALAR)
+                        .compute(rows, expected.data(0, 0),
+                                 expected.data(0, 1));
+                    ColorGradientRow(width, op, level)
+                        .compute(rows, actual.data(0, 0), actual.data(0, 1));
+                    expect(actual == expected,
+                           name + " color gradient operator " +
+                               to_string(op));
+                }
+            }
+            for (int threshold : {1, 8, 64}) {
+                vector<Anchor> expected, actual;
+                for (int y = 1; y < 4; y++) {
+                    rowsAround(gradient, y, rows);
+                    AnchorRow(width, threshold, SIMD_SCALAR)
+                        .find(rows, bins.data(0, y), y, expected);
+                    AnchorRow(width, threshold, level)
+                        .find(rows, bins.data(0, y), y, actual);
+                }
+                bool same = expected.size() == actual.size();
+                for (size_t i = 0; same && i < expected.size(); i++) {
+                    same = expected[i].x == actual[i].x &&
+                           expected[i].y == actual[i].y;
+                }
+                expect(same, name + " anchors threshold " +
+                                 to_string(threshold));
+            }
+        }
+    }
+}
+
+/**
+ * The fused blur and gradient draws the edges of the fixed point blur
+ * followed by edgeDraw, pixel for pixel
+ */
+void checkFused() {
+    mt19937 generator(3);
+    const int sizes[][2] = {{3, 3}, {40, 17}, {257, 129}};
+    EdgeDrawParams scharr;
+    scharr.gradientOperator = GRADIENT_SCHARR;
+    scharr.magnitude = MAGNITUDE_L1;
+    for (const auto& size : sizes) {
+        int width = size[0], height = size[1];
+        for (int channels : {1, 3}) {
+            CImg image = randomImage(generator, width, height, channels);
+            for (const EdgeDrawParams& params : {EdgeDrawParams(), scharr}) {
+                for (int threads : CHECK_THREADS) {
+                    setNumThreads(threads);
+                    unsigned char* blurred =
+                        gaussianBlurCPU(image.data(), width, height,
+                                        channels, BLUR_SIGMA,
+                                        BLUR_FIXED_POINT);
+                    CImg blurredImage(blurred, width, height, 1, channels);
+                    free(blurred);
+                    CImg expected = edgeDraw(blurredImage, 0, params);
+                    CImg fused = edgeDrawFused(image, BLUR_SIGMA, params);
+                    expect(fused == expected,
+                           "fused edges " + to_string(width) + "x" +
+                               to_string(height) + "x" +
+                               to_string(channels) + " operator " +
+                               to_string(params.gradientOperator) + " at " +
+                               to_string(threads) + " threads");
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Whether the chains cover the edge image: every edge pixel is in exactly
+ * one chain, and is a vertex (254) exactly where its chain says so
+ * @param edge the edge image
+ * @param chains the chains drawn with it
+ * @param spacing vertex spacing of the edge drawing
+ */
+bool chainsMatchEdge(const CImg& edge, const EdgeChains& chains,
+                     int spacing) {
+    if (chains.offsets.size() != size_t(chains.size()) + 1 ||
+        chains.offsets.front() != 0 ||
+        chains.offsets.back() != int(chains.points.size())) {
+        return false;
+    }
+    CImgInt count(edge.width(), edge.height(), 1, 1, 0);
+    for (int i = 0; i < chains.size(); i++) {
+        if (chains.offsets[i + 1] <= chains.offsets[i]) return false;
+        for (int j = 0; chains.offsets[i] + j < chains.offsets[i + 1]; j++) {
+            const EdgePoint& p = chains.points[chains.offsets[i] + j];
+            if (!edge.containsXYZC(p.x, p.y) || !edge(p.x, p.y)) return false;
+            bool vertex = (chains.firstPickCtr[i] + j) % spacing == 0;
+            if (vertex != (edge(p.x, p.y) == 254)) return false;
+            count(p.x, p.y)++;
+        }
+    }
+    cimg_forXY(edge, x, y) {
+        if (count(x, y) != (edge(x, y) ? 1 : 0)) return false;
+    }
+    return true;
+}
+
+/**
+ * Whether two sets of chains hold the same chains in the same order
+ */
+bool sameChains(const EdgeChains& a, const EdgeChains& b) {
+    return a.offsets == b.offsets && a.firstPickCtr == b.firstPickCtr &&
+           equal(a.points.begin(), a.points.end(), b.points.begin(),
+                 b.points.end(), [](const EdgePoint& p, const EdgePoint& q) {
+                     return p.x == q.x && p.y == q.y;
+                 });
+}
+
+/**
+ * The chains of the edge drawing match the edge image, across tile seams,
+ * and neither depends on the number of threads
+ */
+void checkChains() {
+    mt19937 generator(16);
+    const int sizes[][2] = {{3, 3}, {90, 40}, {600, 300}, {260, 520}};
+    for (const auto& size : sizes) {
+        int width = size[0], height = size[1];
+        CImg image = randomImage(generator, width, height, 3);
+        // Noise with random directions branches at almost every pixel, the
+        // border is zero as in a real gradient
+        CImg gradient = randomGradient(generator, width, height);
+        CImg bins(width, height);
+        cimg_forXY(bins, x, y) {
+            bins(x, y) = generator() % DIRECTION_BINS;
+            if (x == 0 || y == 0 || x == width - 1 || y == height - 1) {
+                gradient(x, y) = 0;
+            }
+        }
+        for (int spacing : {1, 3, VERTEX_SPACING}) {
+            EdgeDrawParams params;
+            params.vertexSpacing = spacing;
+            string name = "chains " + to_string(width) + "x" +
+                          to_string(height) + " spacing " +
+                          to_string(spacing);
+            CImg firstEdges[3];
+            EdgeChains firstChains[3];
+            for (int threads : CHECK_THREADS) {
+                setNumThreads(threads);
+                CImg edges[3];
+                EdgeChains chains[3];
+                edges[0] = edgeDraw(image, 0, params, &chains[0]);
+                edges[1] = edgeDrawFused(image, BLUR_SIGMA, params, &chains[1]);
+                vector<Anchor> anchors =
+                    determineAnchors(gradient, bins, params.anchorThresh);
+                edges[2].assign(width, height, 1, 1, 0);
+                drawEdgesFromAnchors(gradient, bins, anchors, edges[2],
+                                     spacing, &chains[2]);
+                for (int k = 0; k < 3; k++) {
+                    string which = name + " of " +
+                                   (k == 0   ? "edgeDraw"
+                                    : k == 1 ? "edgeDrawFused"
+                                             : "noise") +
+                                   " at " + to_string(threads) + " threads";
+                    expect(chainsMatchEdge(edges[k], chains[k], spacing),
+                           which);
+                    if (threads == CHECK_THREADS[0]) {
+                        firstEdges[k] = edges[k];
+                        firstChains[k] = chains[k];
+                    } else {
+                        expect(edges[k] == firstEdges[k] &&
+                                   sameChains(chains[k], firstChains[k]),
+                               which + " against 1 thread");
+                    }
+                }
+            }
+        }
+    }
+}
+
+int main() {
+    checkVoronoi();
+    checkHysteresis();
+    checkBlur();
+    checkSimdRows();
+    checkFused();
+    checkChains();
+    if (failures > 0) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All checks passed" << endl;
+    return 0;
+}
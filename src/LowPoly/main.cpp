@@ -1,210 +1,531 @@
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <filesystem>
 #include <iostream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #include "CImg.h"
 #include "delaunay.h"
 #include "edgedraw.h"
 #include "gaussianblur.h"
+#include "processing.h"
+#include "trace.h"
 
 using namespace std;
+namespace fs = std::filesystem;
+
+// Options of the render command
+struct RenderOptions {
+    string backend = "cpu";  // cpu or gpu
+    string input;            // image file or directory of images
+    string output;           // directory receiving the results
+    int threads = 0;         // CPU threads, 0 for one per core
+    double blurSigma = BLUR_SIGMA;
+    int blurMethod = BLUR_FIXED_POINT;  // CPU blur method
+    bool blurMethodSet = false;         // --blur-method was given
+    EdgeDrawParams edgeParams;
+    int maxVertices = 0;         // vertex budget, 0 for no limit
+    bool grayFirst = false;      // blur a grayscale plane instead of RGB
+    bool fused = false;          // stream blur, grayscale and gradient rows
+    bool colorGradient = false;  // Di Zenzo gradient of the three channels
+    bool onePlusJfa = false;     // step 1 pass before the jump flooding
+    bool exactVoronoi = false;   // feature transform instead of jump flooding
+    bool saveStages = false;     // also write blurred and edge images
+    bool verbose = false;        // print the time taken by every stage
+    string tracePath;            // Chrome trace JSON file, none if empty
+};
+
+void printUsage(const char* program) {
+    cout << "Usage: " << program << " render --in <file|dir> --out <dir> "
+         << "[options]\n"
+         << "\n"
+         << "Options:\n"
+         << "  --backend <cpu|gpu>      processing backend (default cpu)\n"
+         << "  --threads <n>            CPU threads, 0 for one per core "
+            "(default 0)\n"
+         << "  --blur-sigma <s>         Gaussian blur standard deviation "
+            "(default "
+         << BLUR_SIGMA << ")\n"
+         << "  --blur-method <m>        CPU blur: fixed, separable, direct or "
+            "recursive (default fixed)\n"
+         << "  --gradient-thresh <t>    drop gradients at or below t "
+            "(default "
+         << int(GRADIENT_THRESH) << ")\n"
+         << "  --anchor-thresh <t>      anchor margin over its neighbors "
+            "(default "
+         << ANCHOR_THRESH << ")\n"
+         << "  --vertex-spacing <n>     pick every n-th edge pixel as a "
+            "vertex (default "
+         << VERTEX_SPACING << ")\n"
+         << "  --max-vertices <n>       keep at most n vertices, the strongest "
+            "of every\n"
+         << "                           grid cell, 0 for no limit (default "
+            "0)\n"
+         << "  --gradient-operator <o>  CPU gradient: sobel or scharr "
+            "(default sobel)\n"
+         << "  --magnitude <m>          CPU gradient magnitude: exact, l1 or "
+            "max-min (default exact)\n"
+         << "  --gray-first             convert to grayscale before the blur, "
+            "one plane instead of three (cpu only)\n"
+         << "  --fused                  blur, grayscale and gradient in one "
+            "streaming pass with the fixed blur (cpu only)\n"
+         << "  --color-gradient         gradient of the three channels "
+            "instead of the gray level (cpu only)\n"
+         << "  --one-plus-jfa           jump flooding pass of step 1 first, "
+            "fixing most wrong\n"
+         << "                           Voronoi pixels\n"
+         << "  --exact-voronoi          exact Voronoi diagram from a feature "
+            "transform instead\n"
+         << "                           of jump flooding (cpu only)\n"
+         << "  --save-stages            also write blurred and edge images\n"
+         << "  --verbose                print the time taken by every stage\n"
+         << "  --trace <file>           write a Chrome/Perfetto trace of every "
+            "stage\n";
+}
 
-unsigned char* applyGaussianBlur(CImg& image, int width, int height,
-                                 int channels) {
-    // Apply Gaussian blur using CUDA
-    auto start = std::chrono::high_resolution_clock::now();
-
-    unsigned char* outputImage =
-        gaussianBlur(image.data(), width, height, channels);
+/**
+ * Parse a whole option value as an integer
+ * @param value text of the value
+ * @throw invalid_argument on anything but an integer, out_of_range when it
+ * does not fit an int
+ */
+int parseInt(const string& value) {
+    size_t end;
+    int result = stoi(value, &end);
+    if (end != value.size()) throw invalid_argument(value);
+    return result;
+}
 
-    auto end = std::chrono::high_resolution_clock::now();
+/**
+ * Parse a whole option value as a finite real number
+ * @param value text of the value
+ * @throw invalid_argument on anything but a finite number
+ */
+double parseDouble(const string& value) {
+    size_t end;
+    double result = stod(value, &end);
+    if (end != value.size() || !isfinite(result)) {
+        throw invalid_argument(value);
+    }
+    return result;
+}
 
-    // Get duration
-    auto duration =
-        std::chrono::duration_cast<chrono::microseconds>(end - start);
-    cout << "Time taken for Gaussian blur GPU: " << duration.count()
-         << " microseconds" << endl;
+/**
+ * Parse the arguments following the render command
+ * @param argc argument count, including the program name and command
+ * @param argv argument values
+ * @param options parsed options
+ * @return true if all arguments are valid
+ */
+bool parseRenderOptions(int argc, char* argv[], RenderOptions& options) {
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--save-stages") {
+            options.saveStages = true;
+            continue;
+        }
+        if (arg == "--gray-first") {
+            options.grayFirst = true;
+            continue;
+        }
+        if (arg == "--fused") {
+            options.fused = true;
+            continue;
+        }
+        if (arg == "--one-plus-jfa") {
+            options.onePlusJfa = true;
+            continue;
+        }
+        if (arg == "--exact-voronoi") {
+            options.exactVoronoi = true;
+            continue;
+        }
+        if (arg == "--color-gradient") {
+            options.colorGradient = true;
+            continue;
+        }
+        if (arg == "--verbose") {
+            options.verbose = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            cerr << "Error: missing value for " << arg << endl;
+            return false;
+        }
+        string value = argv[++i];
+        try {
+            if (arg == "--backend") {
+                options.backend = value;
+            } else if (arg == "--in") {
+                options.input = value;
+            } else if (arg == "--out") {
+                options.output = value;
+            } else if (arg == "--threads") {
+                options.threads = parseInt(value);
+            } else if (arg == "--blur-sigma") {
+                options.blurSigma = parseDouble(value);
+            } else if (arg == "--blur-method") {
+                if (value == "fixed") {
+                    options.blurMethod = BLUR_FIXED_POINT;
+                } else if (value == "separable") {
+                    options.blurMethod = BLUR_SEPARABLE;
+                } else if (value == "direct") {
+                    options.blurMethod = BLUR_DIRECT;
+                } else if (value == "recursive") {
+                    options.blurMethod = BLUR_RECURSIVE;
+                } else {
+                    throw invalid_argument(value);
+                }
+                options.blurMethodSet = true;
+            } else if (arg == "--gradient-thresh") {
+                int thresh = parseInt(value);
+                if (thresh < 0 || thresh > 255) throw out_of_range(value);
+                options.edgeParams.gradientThresh =
+                    static_cast<unsigned char>(thresh);
+            } else if (arg == "--anchor-thresh") {
+                options.edgeParams.anchorThresh = parseInt(value);
+            } else if (arg == "--vertex-spacing") {
+                options.edgeParams.vertexSpacing = parseInt(value);
+            } else if (arg == "--max-vertices") {
+                options.maxVertices = parseInt(value);
+            } else if (arg == "--gradient-operator") {
+                if (value == "sobel") {
+                    options.edgeParams.gradientOperator = GRADIENT_SOBEL;
+                } else if (value == "scharr") {
+                    options.edgeParams.gradientOperator = GRADIENT_SCHARR;
+                } else {
+                    throw invalid_argument(value);
+                }
+            } else if (arg == "--magnitude") {
+                if (value == "exact") {
+                    options.edgeParams.magnitude = MAGNITUDE_EXACT;
+                } else if (value == "l1") {
+                    options.edgeParams.magnitude = MAGNITUDE_L1;
+                } else if (value == "max-min") {
+                    options.edgeParams.magnitude =
+                        MAGNITUDE_ALPHA_MAX_BETA_MIN;
+                } else {
+                    throw invalid_argument(value);
+                }
+            } else if (arg == "--trace") {
+                options.tracePath = value;
+            } else {
+                cerr << "Error: unknown option " << arg << endl;
+                return false;
+            }
+        } catch (const exception&) {
+            cerr << "Error: invalid value '" << value << "' for " << arg
+                 << endl;
+            return false;
+        }
+    }
 
-    return outputImage;
+    if (options.input.empty() || options.output.empty()) {
+        cerr << "Error: --in and --out are required" << endl;
+        return false;
+    }
+    if (options.backend != "cpu" && options.backend != "gpu") {
+        cerr << "Error: unknown backend " << options.backend << endl;
+        return false;
+    }
+#ifdef LOWPOLY_CPU_ONLY
+    if (options.backend == "gpu") {
+        cerr << "Error: this build has no GPU backend" << endl;
+        return false;
+    }
+#endif
+    if ((options.grayFirst || options.fused) && options.backend == "gpu") {
+        cerr << "Error: --gray-first and --fused need the cpu backend" << endl;
+        return false;
+    }
+    if (options.fused && options.blurMethodSet &&
+        options.blurMethod != BLUR_FIXED_POINT) {
+        cerr << "Error: --fused always uses the fixed blur, not another "
+                "--blur-method"
+             << endl;
+        return false;
+    }
+    if (options.exactVoronoi &&
+        (options.backend == "gpu" || options.onePlusJfa)) {
+        cerr << "Error: --exact-voronoi needs the cpu backend, and replaces "
+                "--one-plus-jfa"
+             << endl;
+        return false;
+    }
+    if (options.colorGradient &&
+        (options.backend == "gpu" || options.grayFirst || options.fused)) {
+        cerr << "Error: --color-gradient needs the cpu backend and the colors "
+                "of the blurred image, not --gray-first or --fused"
+             << endl;
+        return false;
+    }
+    if ((options.edgeParams.gradientOperator != GRADIENT_SOBEL ||
+         options.edgeParams.magnitude != MAGNITUDE_EXACT) &&
+        options.backend == "gpu") {
+        cerr << "Error: --gradient-operator and --magnitude need the cpu "
+                "backend"
+             << endl;
+        return false;
+    }
+    if (options.threads < 0 || options.blurSigma <= 0 ||
+        options.edgeParams.anchorThresh < 0 ||
+        options.edgeParams.vertexSpacing < 1 || options.maxVertices < 0) {
+        cerr << "Error: numeric options out of range" << endl;
+        return false;
+    }
+    return true;
 }
 
-unsigned char* applyGaussianBlurCPU(CImg& image, int width, int height,
-                                    int channels) {
-    // Apply Gaussian blur using CUDA
-    auto start = std::chrono::high_resolution_clock::now();
-
-    unsigned char* outputImage =
-        gaussianBlurCPU(image.data(), width, height, channels);
+/**
+ * List the images to render, a single file or the images of a directory
+ * sorted by name
+ * @param input path of an image file or a directory
+ */
+vector<fs::path> collectInputs(const string& input) {
+    vector<fs::path> inputs;
+    if (!fs::is_directory(input)) {
+        inputs.push_back(input);
+        return inputs;
+    }
 
-    auto end = std::chrono::high_resolution_clock::now();
+    const vector<string> extensions = {".png", ".jpg", ".jpeg",
+                                       ".bmp", ".ppm", ".pgm"};
+    for (const fs::directory_entry& entry : fs::directory_iterator(input)) {
+        string extension = entry.path().extension().string();
+        transform(extension.begin(), extension.end(), extension.begin(),
+                  ::tolower);
+        if (entry.is_regular_file() &&
+            find(extensions.begin(), extensions.end(), extension) !=
+                extensions.end()) {
+            inputs.push_back(entry.path());
+        }
+    }
+    sort(inputs.begin(), inputs.end());
+    return inputs;
+}
 
-    // Get duration
-    auto duration =
-        std::chrono::duration_cast<chrono::microseconds>(end - start);
-    cout << "Time taken for Gaussian blur CPU: " << duration.count()
-         << " microseconds" << endl;
+/**
+ * Name the results of every input after its stem, or after its whole file
+ * name when several inputs share the stem, like a.png and a.jpg
+ * @param inputs the images to render
+ * @param saveStages whether the blurred and edge images are written too
+ * @param names base name of the results of each input
+ * @return false if two inputs would still write the same results
+ */
+bool outputNames(const vector<fs::path>& inputs, bool saveStages,
+                 vector<string>& names) {
+    map<string, int> stems;
+    for (const fs::path& imagePath : inputs) {
+        stems[imagePath.stem().string()]++;
+    }
+    names.clear();
+    set<string> taken;
+    for (const fs::path& imagePath : inputs) {
+        string stem = imagePath.stem().string();
+        string name =
+            stems[stem] > 1 ? imagePath.filename().string() : stem;
+        bool available = taken.insert(name).second;
+        if (saveStages) {
+            available &= taken.insert(name + "_blur").second;
+            available &= taken.insert(name + "_edge").second;
+        }
+        if (!available) {
+            cerr << "Error: " << imagePath.string()
+                 << " would overwrite the results of another image" << endl;
+            return false;
+        }
+        names.push_back(name);
+    }
+    return true;
+}
 
+unsigned char* applyGaussianBlur(CImg& image, const RenderOptions& options) {
+    unsigned char* outputImage;
+#ifndef LOWPOLY_CPU_ONLY
+    if (options.backend == "gpu") {
+        outputImage = gaussianBlur(image.data(), image.width(), image.height(),
+                                   image.spectrum(), options.blurSigma);
+    } else
+#endif
+    {
+        outputImage =
+            gaussianBlurCPU(image.data(), image.width(), image.height(),
+                            image.spectrum(), options.blurSigma,
+                            options.blurMethod);
+    }
     return outputImage;
 }
 
-CImg applyEdgeDetectionCPU(CImg& blurredImage) {
-    auto start = chrono::high_resolution_clock::now();
-    cimg_library::CImg<unsigned char> edgeCPU = edgeDraw(blurredImage);
-    auto end = chrono::high_resolution_clock::now();
-    auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    cout << "Time taken for Edge Extraction (CPU): " << duration.count()
-         << " microseconds" << endl;
-    return edgeCPU;
+CImg applyEdgeDetection(CImg& blurredImage, const RenderOptions& options) {
+    CImg edge;
+#ifndef LOWPOLY_CPU_ONLY
+    if (options.backend == "gpu") {
+        edge = edgeDrawGPUCombined(blurredImage, options.edgeParams);
+    } else
+#endif
+    {
+        edge = edgeDraw(blurredImage, options.colorGradient ? 1 : 0,
+                        options.edgeParams);
+    }
+    return edge;
 }
 
-CImg applyEdgeDetectionGPU(CImg& blurredImage) {
-    auto start = chrono::high_resolution_clock::now();
-    cimg_library::CImg<unsigned char> edgeGPU = edgeDrawGPU(blurredImage);
-    auto end = chrono::high_resolution_clock::now();
-    auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    cout << "Time taken for Edge Extraction (GPU): " << duration.count()
-         << " microseconds" << endl;
-    return edgeGPU;
+void applyTriangulation(CImg& edge, CImg& image, const RenderOptions& options) {
+    vector<Point> vertices;
+#ifndef LOWPOLY_CPU_ONLY
+    if (options.backend == "gpu") {
+        vertices = pickVerticesGPU(edge, options.maxVertices, &image);
+    } else
+#endif
+    {
+        vertices = pickVertices(edge, options.maxVertices, &image);
+    }
+
+    CImgInt voronoi;
+#ifndef LOWPOLY_CPU_ONLY
+    if (options.backend == "gpu") {
+        voronoi = jumpFloodAlgorithmGPU(vertices, edge.width(), edge.height(),
+                                        options.onePlusJfa);
+    } else
+#endif
+    if (options.exactVoronoi) {
+        voronoi =
+            featureTransformVoronoi(vertices, edge.width(), edge.height());
+    } else {
+        voronoi = jumpFloodAlgorithm(vertices, edge.width(), edge.height(),
+                                     options.onePlusJfa);
+    }
+
+#ifndef LOWPOLY_CPU_ONLY
+    if (options.backend == "gpu") {
+        delaunayTriangulationGPU(voronoi, image);
+    } else
+#endif
+    {
+        delaunayTriangulation(voronoi, image);
+    }
 }
 
-CImg applyEdgeDetectionGPUCombined(CImg& blurredImage) {
+/**
+ * Run the pipeline once on an image and write the results to the output
+ * directory
+ * @param imagePath path of the input image
+ * @param name base name of the results
+ * @param options render options
+ * @return true on success
+ */
+bool renderImage(const fs::path& imagePath, const string& name,
+                 const RenderOptions& options) {
+    TRACE_SCOPE("render");
     auto start = chrono::high_resolution_clock::now();
-    cimg_library::CImg<unsigned char> edgeGPU =
-        edgeDrawGPUCombined(blurredImage);
-    auto end = chrono::high_resolution_clock::now();
-    auto duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    cout << "Time taken for Edge Extraction (GPU Combined): "
-         << duration.count() << " microseconds" << endl;
-    return edgeGPU;
-}
 
-void applyTriangulation(CImg& edge, CImg& image) {
-    cout << "-------------------------------------------" << endl;
-    auto veryStart = chrono::high_resolution_clock::now();
-    pickVertices(edge);
-    auto end = chrono::high_resolution_clock::now();
-    auto duration =
-        chrono::duration_cast<chrono::microseconds>(end - veryStart);
-    cout << "Time taken for pickVertices (CPU): " << duration.count()
-         << " microseconds" << endl;
+    CImg image;
+    try {
+        image.load(imagePath.string().c_str());
+    } catch (const cimg_library::CImgException&) {
+        cerr << "Error: cannot read " << imagePath.string() << endl;
+        return false;
+    }
+    toRgb(image);
 
-    auto start = chrono::high_resolution_clock::now();
-    CImgInt voronoi = jumpFloodAlgorithm(edge);
-    end = chrono::high_resolution_clock::now();
-    duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    cout << "Time taken for jumpFloodAlgorithm (CPU): " << duration.count()
-         << " microseconds" << endl;
-
-    start = chrono::high_resolution_clock::now();
-    delaunayTriangulation(voronoi, image);
-    auto veryEnd = chrono::high_resolution_clock::now();
-    duration = chrono::duration_cast<chrono::microseconds>(veryEnd - start);
-    cout << "Time taken for delaunayTriangulation (CPU): " << duration.count()
-         << " microseconds" << endl;
-
-    duration = chrono::duration_cast<chrono::microseconds>(veryEnd - veryStart);
-    cout << "Time taken for Triangulation in total (CPU): " << duration.count()
-         << " microseconds" << endl;
-    cout << "-------------------------------------------" << endl;
-}
+    // Step 1: perform the Gaussian blur, on the luminance only when the
+    // colors are not needed by the edge detection
+    CImg grayImage;
+    if (options.grayFirst) {
+        grayImage = convertToGray(image);
+    }
+    CImg& blurInput = options.grayFirst ? grayImage : image;
+    fs::path outputDir(options.output);
+
+    // Step 2: extract edges
+    CImg edge;
+    if (options.fused) {
+        // No blurred image is ever materialized
+        edge = edgeDrawFused(blurInput, options.blurSigma, options.edgeParams);
+    } else {
+        unsigned char* gbImage = applyGaussianBlur(blurInput, options);
+        CImg blurredImage(gbImage, image.width(), image.height(), 1,
+                          blurInput.spectrum(), true);
+        edge = applyEdgeDetection(blurredImage, options);
+        if (options.saveStages) {
+            blurredImage.save(
+                (outputDir / (name + "_blur.png")).string().c_str());
+        }
+        free(gbImage);
+    }
+    if (options.saveStages) {
+        edge.save((outputDir / (name + "_edge.png")).string().c_str());
+    }
 
-void applyTriangulationGPU(CImg& edge, CImg& image) {
-    cout << "-------------------------------------------" << endl;
-    auto veryStart = chrono::high_resolution_clock::now();
-    pickVerticesGPU(edge);
-    auto end = chrono::high_resolution_clock::now();
-    auto duration =
-        chrono::duration_cast<chrono::microseconds>(end - veryStart);
-    cout << "Time taken for pickVertices (GPU): " << duration.count()
-         << " microseconds" << endl;
+    // Step 3: Delaunay triangulation painted over the original image
+    applyTriangulation(edge, image, options);
 
-    auto start = chrono::high_resolution_clock::now();
-    CImgInt voronoi = jumpFloodAlgorithmGPU(edge);
-    end = chrono::high_resolution_clock::now();
-    duration = chrono::duration_cast<chrono::microseconds>(end - start);
-    cout << "Time taken for jumpFloodAlgorithm (GPU): " << duration.count()
-         << " microseconds" << endl;
-
-    start = chrono::high_resolution_clock::now();
-    delaunayTriangulationGPU(voronoi, image);
-    auto veryEnd = chrono::high_resolution_clock::now();
-    duration = chrono::duration_cast<chrono::microseconds>(veryEnd - start);
-    cout << "Time taken for delaunayTriangulation (GPU): " << duration.count()
-         << " microseconds" << endl;
-
-    duration = chrono::duration_cast<chrono::microseconds>(veryEnd - veryStart);
-    cout << "Time taken for Triangulation in total (GPU): " << duration.count()
-         << " microseconds" << endl;
-    cout << "-------------------------------------------" << endl;
+    fs::path outputPath = outputDir / (name + ".png");
+    try {
+        image.save(outputPath.string().c_str());
+    } catch (const cimg_library::CImgException&) {
+        cerr << "Error: cannot write " << outputPath.string() << endl;
+        return false;
+    }
+
+    auto end = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::milliseconds>(end - start);
+    cout << imagePath.string() << " -> " << outputPath.string() << " ("
+         << duration.count() << " ms)" << endl;
+    return true;
 }
 
 int main(int argc, char* argv[]) {
-    string imagePath;
+    if (argc < 2 || string(argv[1]) != "render") {
+        printUsage(argv[0]);
+        return argc < 2 ? 0 : 1;
+    }
 
-    // Get image path from commandline or cin
-    if (argc > 1) {
-        imagePath = argv[1];
-    } else {
-        // Ask the user to enter the path to the image
-        cout << "Enter the path to the image: ";
-        getline(cin, imagePath);  // Read the entire line, including spaces
-    }
-
-    gpuWarmUp();
-
-    // Load the image
-    CImg image(imagePath.c_str());
-    int width = image.width();
-    int height = image.height();
-    unsigned char* inputImage = image.data();
-    int channels = image.spectrum();
-
-    cout << image.width() << " " << image.height() << endl;
-
-    // Step 1: perform the Gaussian blur
-    unsigned char* gbImage = applyGaussianBlur(image, width, height, channels);
-    gbImage = applyGaussianBlurCPU(image, width, height, channels);
-
-    CImg blurredImage(gbImage, width, height, 1, 3, true);
-
-    // Apply edge extraction using CPU
-    CImg edgeCPU = applyEdgeDetectionCPU(blurredImage);
-
-    // Apply edge extraction using GPU
-    CImg edgeGPU = applyEdgeDetectionGPU(blurredImage);
-
-    // Apply edge extraction using GPU Combined
-    CImg edgeGPUCombined = applyEdgeDetectionGPUCombined(blurredImage);
-
-    // // Delaunay triangulation
-    CImg lowPolyImageCPU = image;
-    CImg lowPolyImageGPU = image;
-    applyTriangulation(edgeCPU, lowPolyImageCPU);
-    applyTriangulationGPU(edgeGPU, lowPolyImageGPU);
-
-    // Display the original and blurred images
-    cimg_library::CImgDisplay display(image, "Original Image");
-    cimg_library::CImgDisplay displayBlurred(blurredImage, "Blurred Image");
-    cimg_library::CImgDisplay displayEdgeCPU(edgeCPU, "Edge Image CPU");
-    cimg_library::CImgDisplay displayEdgeGPU(edgeGPU, "Edge Image GPU");
-    cimg_library::CImgDisplay displayLowPolyCPU(lowPolyImageCPU,
-                                                "Low Poly Image CPU");
-    cimg_library::CImgDisplay displayLowPolyGPU(lowPolyImageGPU,
-                                                "Low Poly Image GPU");
-
-    // cimg_library::CImgDisplay displayVoronoi(voronoi, "Edge Image");
-    // Wait for the display windows to close
-    while (!display.is_closed() && !displayEdgeCPU.is_closed() &&
-           !displayBlurred.is_closed() && !displayEdgeGPU.is_closed() &&
-           !displayLowPolyCPU.is_closed()) {
-        display.wait();
-        displayEdgeCPU.wait();
-        displayEdgeGPU.wait();
-        displayLowPolyCPU.wait();
-        displayLowPolyGPU.wait();
-    }
-
-    // Free memory
-    delete[] gbImage;
-
-    return 0;
-}
\ No newline at end of file
+    RenderOptions options;
+    if (!parseRenderOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    cimg_library::cimg::exception_mode(0);
+    setNumThreads(options.threads);
+    setTracingEnabled(options.verbose || !options.tracePath.empty());
+#ifndef LOWPOLY_CPU_ONLY
+    if (options.backend == "gpu") {
+        gpuWarmUp();
+    }
+#endif
+
+    vector<fs::path> inputs = collectInputs(options.input);
+    if (inputs.empty()) {
+        cerr << "Error: no images found in " << options.input << endl;
+        return 1;
+    }
+    vector<string> names;
+    if (!outputNames(inputs, options.saveStages, names)) {
+        return 1;
+    }
+    fs::create_directories(options.output);
+
+    int failures = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (!renderImage(inputs[i], names[i], options)) {
+            failures++;
+        }
+    }
+
+    if (options.verbose) {
+        printTraceSummary(cout);
+    }
+    if (!options.tracePath.empty() && !writeTraceJson(options.tracePath)) {
+        cerr << "Error: cannot write " << options.tracePath << endl;
+        failures++;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
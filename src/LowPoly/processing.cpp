@@ -0,0 +1,214 @@
+#include "processing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Set on pool workers and on a caller while it helps running a job, so that
+// nested parallelFor calls run inline instead of waiting on a busy pool
+thread_local bool insideParallelRegion = false;
+
+/**
+ * Fixed size pool of worker threads. The calling thread always takes part in
+ * a job, so a pool of size n owns n - 1 threads.
+ */
+class ThreadPool {
+   public:
+    explicit ThreadPool(int numThreads) {
+        for (int i = 1; i < numThreads; ++i) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    int size() const { return static_cast<int>(workers.size()) + 1; }
+
+    /**
+     * Run task(i) for every i in [0, numTasks) and wait for completion.
+     * @param numTasks number of independent tasks
+     * @param task function invoked once per task index
+     */
+    void run(int numTasks, const std::function<void(int)> &task) {
+        std::lock_guard<std::mutex> submit(submitMutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &task;
+            jobSize = numTasks;
+            nextTask = 0;
+            busyWorkers = static_cast<int>(workers.size());
+            ++generation;
+        }
+        wakeUp.notify_all();
+
+        insideParallelRegion = true;
+        drain();
+        insideParallelRegion = false;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        jobDone.wait(lock, [this] { return busyWorkers == 0; });
+        job = nullptr;
+    }
+
+   private:
+    void drain() {
+        int i;
+        while ((i = nextTask.fetch_add(1)) < jobSize) {
+            (*job)(i);
+        }
+    }
+
+    void workerLoop() {
+        insideParallelRegion = true;
+        unsigned long seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeUp.wait(lock,
+                            [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            drain();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--busyWorkers == 0) jobDone.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex submitMutex;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    std::condition_variable jobDone;
+    const std::function<void(int)> *job = nullptr;
+    int jobSize = 0;
+    std::atomic<int> nextTask{0};
+    int busyWorkers = 0;
+    unsigned long generation = 0;
+    bool stopping = false;
+};
+
+std::mutex poolMutex;
+std::unique_ptr<ThreadPool> pool;
+int requestedThreads = 0;
+
+int defaultThreads() {
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+ThreadPool &getPool() {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    if (!pool) {
+        pool.reset(new ThreadPool(requestedThreads > 0 ? requestedThreads
+                                                       : defaultThreads()));
+    }
+    return *pool;
+}
+
+}  // namespace
+
+/**
+ * Set the number of threads used by the CPU pipeline. Must not be called
+ * while a parallelFor is running.
+ * @param numThreads number of threads, 0 to use one thread per core
+ */
+void setNumThreads(int numThreads) {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    requestedThreads = std::max(0, numThreads);
+    pool.reset();
+}
+
+/**
+ * Get the number of threads used by the CPU pipeline
+ */
+int getNumThreads() {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    if (pool) return pool->size();
+    return requestedThreads > 0 ? requestedThreads : defaultThreads();
+}
+
+/**
+ * Run body over [begin, end) split into contiguous chunks. Chunks are handed
+ * out dynamically, a few per thread, to even out uneven rows.
+ * @param begin first index
+ * @param end one past the last index
+ * @param body function called with the bounds of each chunk
+ * @param grain minimum number of indices per chunk
+ */
+void parallelFor(int begin, int end,
+                 const std::function<void(int, int)> &body, int grain) {
+    int count = end - begin;
+    if (count <= 0) return;
+    grain = std::max(1, grain);
+
+    if (insideParallelRegion || count <= grain) {
+        body(begin, end);
+        return;
+    }
+
+    ThreadPool &threads = getPool();
+    if (threads.size() == 1) {
+        body(begin, end);
+        return;
+    }
+
+    int numChunks = std::min(threads.size() * 4, (count + grain - 1) / grain);
+    int chunkSize = (count + numChunks - 1) / numChunks;
+    numChunks = (count + chunkSize - 1) / chunkSize;
+    threads.run(numChunks, [&](int chunk) {
+        int chunkBegin = begin + chunk * chunkSize;
+        body(chunkBegin, std::min(end, chunkBegin + chunkSize));
+    });
+}
+
+/**
+ * Get the widest instruction set the SIMD kernels can use on this host. The
+ * AVX-512 kernels need the F and BW subsets.
+ */
+int detectSimdLevel() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const int level = [] {
+        if (__builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw")) {
+            return SIMD_AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+        return SIMD_SCALAR;
+    }();
+    return level;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+/**
+ * Get a printable name of a SIMD level
+ * @param level one of SIMD_SCALAR, SIMD_AVX2 or SIMD_AVX512
+ */
+const char *simdLevelName(int level) {
+    switch (level) {
+        case SIMD_AVX512:
+            return "avx512";
+        case SIMD_AVX2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef PROCESSING_H
+#define PROCESSING_H
+
+#include <functional>
+
+// Set the number of threads used by the CPU pipeline, 0 means one per core
+void setNumThreads(int numThreads);
+int getNumThreads();
+
+// Split [begin, end) into contiguous chunks of at least grain items and run
+// body(chunkBegin, chunkEnd) for every chunk on the CPU thread pool
+void parallelFor(int begin, int end,
+                 const std::function<void(int, int)> &body, int grain = 1);
+
+// Instruction sets of the SIMD kernels, from narrowest to widest
+const int SIMD_SCALAR = 0;
+const int SIMD_AVX2 = 1;
+const int SIMD_AVX512 = 2;
+
+// Widest instruction set supported by the host, detected once through CPUID
+int detectSimdLevel();
+const char *simdLevelName(int level);
+
+#endif
@@ -0,0 +1,177 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> tracingEnabledFlag{false};
+
+namespace {
+
+// A complete stage ('X') or a counter sample ('C')
+struct TraceEvent {
+    const char *name;
+    char phase;
+    double timestamp;
+    double duration;
+    long long value;
+    int threadId;
+};
+
+std::mutex traceMutex;
+std::vector<TraceEvent> traceEvents;
+std::atomic<int> nextThreadId{0};
+const auto traceEpoch = std::chrono::steady_clock::now();
+
+// Small sequential id of the calling thread, stable for its lifetime
+int currentThreadId() {
+    thread_local int id = nextThreadId.fetch_add(1);
+    return id;
+}
+
+}  // namespace
+
+/**
+ * Turn recording of stages and counters on or off
+ * @param enabled true to record
+ */
+void setTracingEnabled(bool enabled) {
+    tracingEnabledFlag.store(enabled, std::memory_order_relaxed);
+}
+
+/**
+ * Drop every recorded event
+ */
+void clearTrace() {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    traceEvents.clear();
+}
+
+double traceClock() {
+    return std::chrono::duration<double, std::micro>(
+               std::chrono::steady_clock::now() - traceEpoch)
+        .count();
+}
+
+/**
+ * Record a stage that ran on the calling thread
+ * @param name stage name, must outlive the trace
+ * @param start start time from traceClock
+ * @param end end time from traceClock
+ */
+void recordStage(const char *name, double start, double end) {
+    int threadId = currentThreadId();
+    std::lock_guard<std::mutex> lock(traceMutex);
+    traceEvents.push_back(
+        TraceEvent{name, 'X', start, end - start, 0, threadId});
+}
+
+/**
+ * Record a sample of a counter
+ * @param name counter name, must outlive the trace
+ * @param value counter value
+ */
+void recordCounter(const char *name, long long value) {
+    double now = traceClock();
+    int threadId = currentThreadId();
+    std::lock_guard<std::mutex> lock(traceMutex);
+    traceEvents.push_back(TraceEvent{name, 'C', now, 0, value, threadId});
+}
+
+/**
+ * Write the recorded events in the Chrome trace event format, which can be
+ * opened with chrome://tracing or ui.perfetto.dev
+ * @param path output JSON file
+ * @return true if the file was written
+ */
+bool writeTraceJson(const std::string &path) {
+    std::ofstream out(path);
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+
+    std::lock_guard<std::mutex> lock(traceMutex);
+    for (size_t i = 0; i < traceEvents.size(); i++) {
+        const TraceEvent &event = traceEvents[i];
+        out << (i ? ",\n" : "\n") << "{\"name\": \"" << event.name
+            << "\", \"ph\": \"" << event.phase
+            << "\", \"ts\": " << event.timestamp
+            << ", \"pid\": 1, \"tid\": " << event.threadId;
+        if (event.phase == 'X') {
+            out << ", \"cat\": \"stage\", \"dur\": " << event.duration;
+        } else {
+            out << ", \"args\": {\"" << event.name << "\": " << event.value
+                << "}";
+        }
+        out << "}";
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+/**
+ * Print the number of calls and total time of every stage and the sum of
+ * every counter, in order of first appearance
+ * @param out output stream
+ */
+void printTraceSummary(std::ostream &out) {
+    struct Total {
+        int order;
+        int calls;
+        double total;
+    };
+    std::map<std::string, Total> stages, counters;
+
+    {
+        std::lock_guard<std::mutex> lock(traceMutex);
+        for (const TraceEvent &event : traceEvents) {
+            std::map<std::string, Total> &totals =
+                event.phase == 'X' ? stages : counters;
+            auto inserted = totals.emplace(
+                event.name, Total{static_cast<int>(totals.size()), 0, 0});
+            Total &total = inserted.first->second;
+            total.calls++;
+            total.total += event.phase == 'X'
+                               ? event.duration
+                               : static_cast<double>(event.value);
+        }
+    }
+
+    auto byOrder = [](const std::map<std::string, Total> &totals) {
+        std::vector<std::pair<std::string, Total>> sorted(totals.begin(),
+                                                          totals.end());
+        std::sort(sorted.begin(), sorted.end(),
+                  [](const std::pair<std::string, Total> &a,
+                     const std::pair<std::string, Total> &b) {
+                      return a.second.order < b.second.order;
+                  });
+        return sorted;
+    };
+
+    // The formatting of the caller's stream is restored at the end
+    std::ios state(nullptr);
+    state.copyfmt(out);
+    out << std::fixed << std::setprecision(3);
+    out << std::left << std::setw(20) << "Stage" << std::right << std::setw(8)
+        << "calls" << std::setw(13) << "total ms" << std::setw(13)
+        << "mean ms" << "\n";
+    for (const auto &stage : byOrder(stages)) {
+        out << std::left << std::setw(20) << stage.first << std::right
+            << std::setw(8) << stage.second.calls << std::setw(13)
+            << stage.second.total / 1000 << std::setw(13)
+            << stage.second.total / 1000 / stage.second.calls << "\n";
+    }
+    if (!counters.empty()) {
+        out << std::left << std::setw(20) << "Counter" << std::right
+            << std::setw(8) << "samples" << std::setw(13) << "total" << "\n";
+        for (const auto &counter : byOrder(counters)) {
+            out << std::left << std::setw(20) << counter.first << std::right
+                << std::setw(8) << counter.second.calls << std::setw(13)
+                << static_cast<long long>(counter.second.total) << "\n";
+        }
+    }
+    out.copyfmt(state);
+}
@@ -0,0 +1,64 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <ostream>
+#include <string>
+
+// Stage timers and counters. Recording is off until setTracingEnabled(true);
+// while off, a timer or counter costs one relaxed atomic load. Defining
+// LOWPOLY_NO_TRACE removes the macros entirely.
+extern std::atomic<bool> tracingEnabledFlag;
+
+inline bool isTracingEnabled() {
+    return tracingEnabledFlag.load(std::memory_order_relaxed);
+}
+
+void setTracingEnabled(bool enabled);
+void clearTrace();
+
+// Microseconds since the start of the trace clock
+double traceClock();
+void recordStage(const char *name, double start, double end);
+void recordCounter(const char *name, long long value);
+
+// Export as Chrome/Perfetto trace JSON, and print per-stage totals
+bool writeTraceJson(const std::string &path);
+void printTraceSummary(std::ostream &out);
+
+// Records the lifetime of a scope as a stage when tracing is enabled
+class StageTimer {
+   public:
+    explicit StageTimer(const char *name)
+        : name(isTracingEnabled() ? name : nullptr) {
+        if (this->name) start = traceClock();
+    }
+    ~StageTimer() {
+        if (name) recordStage(name, start, traceClock());
+    }
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+
+   private:
+    const char *name;
+    double start = 0;
+};
+
+#ifdef LOWPOLY_NO_TRACE
+#define TRACE_SCOPE(name)
+#define TRACE_COUNTER(name, value) \
+    do {                           \
+    } while (0)
+#else
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Time the enclosing scope as stage name
+#define TRACE_SCOPE(name) StageTimer TRACE_CONCAT(stageTimer, __LINE__)(name)
+// Record a counter, value is only evaluated when tracing is enabled
+#define TRACE_COUNTER(name, value)                           \
+    do {                                                     \
+        if (isTracingEnabled()) recordCounter(name, (value)); \
+    } while (0)
+#endif
+
+#endif